@@ -0,0 +1,183 @@
+#pragma once
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <cstdio>
+#include <fstream>
+#include <future>
+
+#include "global.h"
+#include "mathematics.h"
+#include "primitives.h"
+#include "camera.h"
+
+// Pose of an animated object at one frame: scaled uniformly about its own origin, turned about the
+// y axis (in degrees) and then moved. Frames between keyframes blend the two around them linearly.
+struct Keyframe {
+    double  frame;
+    Vector3 translation = Vector3(0.0);
+    double  rotation = 0.0;
+    double  scale = 1.0;
+};
+
+// Renders a frame range of a scene in which some objects follow keyframes. Objects are flattened into
+// a PrimitiveStore like any other geometry, so materials, textures and everything static are loaded
+// once and persist across frames; only the animated spheres and quads are rewritten between frames,
+// after which the BVH is refitted in place, or rebuilt once refitting has worn it down. The next
+// frame's poses are worked out, and the last frame written to disk, while the current one renders.
+class Animation {
+public:
+    // Constructors
+    Animation(shared_ptr<PrimitiveStore> _store) : store(_store) {}
+
+    // Methods
+    // Add an object in its rest pose; only spheres and quads can move, anything else stays still.
+    void Add(shared_ptr<Shapes> object, const vector<Keyframe>& keyframes) {
+        if (keyframes.empty()) { store->Add(object); return; }
+        Track track;
+        track.keyframes = keyframes;
+        std::sort(track.keyframes.begin(), track.keyframes.end(),
+                  [](const Keyframe& a, const Keyframe& b) { return a.frame < b.frame; });
+        track.spheres.first = store->spheres.Size();
+        track.moving.first  = store->moving_spheres.Size();
+        track.quads.first   = store->quads.Size();
+        size_t others = store->shapes.size() + store->meshes.size() + store->boxes.size();
+        store->Add(object);
+        track.spheres.last = store->spheres.Size();
+        track.moving.last  = store->moving_spheres.Size();
+        track.quads.last   = store->quads.Size();
+        if (store->shapes.size() + store->meshes.size() + store->boxes.size() != others)
+            std::cerr << "ERROR: Only the spheres and quads of an animated object move.\n";
+        for (uint32_t i = track.spheres.first; i < track.spheres.last; i += 1)
+            track.rest.push_back(Rest{store->spheres.Centre(i), Vector3(0.0), Vector3(0.0), store->spheres.radius[i]});
+        for (uint32_t i = track.moving.first; i < track.moving.last; i += 1) {
+            auto centre = store->moving_spheres.Centre(i, 0.0);
+            track.rest.push_back(Rest{centre, store->moving_spheres.Centre(i, 1.0) - centre, Vector3(0.0),
+                                      store->moving_spheres.radius[i]});
+        }
+        for (uint32_t i = track.quads.first; i < track.quads.last; i += 1)
+            track.rest.push_back(Rest{store->quads.Pin(i), store->quads.U(i), store->quads.V(i), 0.0});
+        tracks.push_back(std::move(track));
+    }
+    // Render frames first to last into files named prefix0001.ppm and so on.
+    void Render(Camera& camera, int first, int last, const std::string& prefix = "frame_") {
+        bool sampled_lights = camera.lights != nullptr;
+        Update(Evaluate(first));
+        if (bvh == nullptr) bvh = make_shared<PrimitiveBVH>(store);
+        std::future<vector<Rest>> next;
+        std::future<void> written;
+        for (int frame = first; frame <= last; frame += 1) {
+            std::clog << "Frame " << frame << " of " << first << "-" << last << "... \n";
+            if (frame < last) next = std::async(std::launch::async, [this, frame] { return Evaluate(frame + 1); });
+            if (sampled_lights) camera.lights = make_shared<LightBVH>(*store);
+            auto image = camera.RenderFrame(*bvh);
+            if (written.valid()) written.get();
+            written = std::async(std::launch::async, [image = std::move(image), width = camera.image_width,
+                                                      filename = FrameName(prefix, frame)] {
+                std::ofstream file(filename);
+                Camera::WriteFrame(image, width, image.size() / width, file);
+                if (!file) std::cerr << "ERROR: Could not write frame '" << filename << "'.\n";
+            });
+            if (frame < last) Update(next.get());
+        }
+        if (written.valid()) written.get();
+    }
+
+private:
+    // Members
+    struct Range {
+        uint32_t first = 0, last = 0;
+    };
+    // Rest pose of one primitive: a sphere's centre, shift and radius, or a quad's pin and sides
+    struct Rest {
+        Point3  point;
+        Vector3 a, b;
+        double  radius;
+    };
+    struct Track {
+        vector<Keyframe> keyframes;
+        Range spheres, moving, quads;
+        vector<Rest> rest;      // Spheres, then moving spheres, then quads
+    };
+    shared_ptr<PrimitiveStore> store;
+    shared_ptr<PrimitiveBVH> bvh;
+    vector<Track> tracks;
+
+    // Methods
+    static std::string FrameName(const std::string& prefix, int frame) {
+        char number[16];
+        std::snprintf(number, sizeof(number), "%04d", frame);
+        return prefix + number + ".ppm";
+    }
+    static Transform Pose(const vector<Keyframe>& keyframes, double frame) {
+        size_t next = 0;
+        while (next < keyframes.size() && keyframes[next].frame <= frame) next += 1;
+        const auto& a = keyframes[next == 0 ? 0 : next - 1];
+        const auto& b = keyframes[Min(next, keyframes.size() - 1)];
+        double t = b.frame > a.frame ? (frame - a.frame) / (b.frame - a.frame) : 0.0;
+        double scale = a.scale + t * (b.scale - a.scale);
+        return Translate(a.translation + t * (b.translation - a.translation))
+             * RotateY(a.rotation + t * (b.rotation - a.rotation)) * Scale(Vector3(scale));
+    }
+    // Every animated primitive posed for a frame, in track order. Reads nothing the renderer touches,
+    // so it runs alongside the frame before.
+    vector<Rest> Evaluate(int frame) const {
+        vector<Rest> posed;
+        for (const auto& track : tracks) {
+            auto transform = Pose(track.keyframes, frame);
+            double scale = Length(transform.ApplyVector(Vector3(1, 0, 0)));
+            size_t spheres = (track.spheres.last - track.spheres.first) + (track.moving.last - track.moving.first);
+            for (size_t i = 0; i < track.rest.size(); i += 1) {
+                const auto& rest = track.rest[i];
+                posed.push_back(Rest{transform.ApplyPoint(rest.point), transform.ApplyVector(rest.a),
+                                     transform.ApplyVector(rest.b), i < spheres ? rest.radius * scale : 0.0});
+            }
+        }
+        return posed;
+    }
+    // Write the posed primitives into the store; no frame may be rendering.
+    void Apply(const vector<Rest>& posed) {
+        size_t k = 0;
+        for (const auto& track : tracks) {
+            auto& spheres = store->spheres;
+            for (uint32_t i = track.spheres.first; i < track.spheres.last; i += 1, k += 1) {
+                spheres.x[i] = posed[k].point.x; spheres.y[i] = posed[k].point.y; spheres.z[i] = posed[k].point.z;
+                spheres.radius[i] = posed[k].radius;
+            }
+            auto& moving = store->moving_spheres;
+            for (uint32_t i = track.moving.first; i < track.moving.last; i += 1, k += 1) {
+                moving.x[i]  = posed[k].point.x; moving.y[i]  = posed[k].point.y; moving.z[i]  = posed[k].point.z;
+                moving.dx[i] = posed[k].a.x;     moving.dy[i] = posed[k].a.y;     moving.dz[i] = posed[k].a.z;
+                moving.radius[i] = posed[k].radius;
+            }
+            auto& quads = store->quads;
+            for (uint32_t i = track.quads.first; i < track.quads.last; i += 1, k += 1) {
+                // Plane terms as a Quad derives them from its pin and sides
+                const auto& pin = posed[k].point;
+                const auto& u = posed[k].a;
+                const auto& v = posed[k].b;
+                auto n = Cross(u, v);
+                auto normal = Normalize(n);
+                auto w = n / Dot(n, n);
+                quads.px[i] = pin.x;    quads.py[i] = pin.y;    quads.pz[i] = pin.z;
+                quads.ux[i] = u.x;      quads.uy[i] = u.y;      quads.uz[i] = u.z;
+                quads.vx[i] = v.x;      quads.vy[i] = v.y;      quads.vz[i] = v.z;
+                quads.wx[i] = w.x;      quads.wy[i] = w.y;      quads.wz[i] = w.z;
+                quads.nx[i] = normal.x; quads.ny[i] = normal.y; quads.nz[i] = normal.z;
+                quads.constant[i] = Dot(pin, normal);
+            }
+        }
+        if (bvh != nullptr) bvh->RefreshClusters();
+    }
+    void Update(const vector<Rest>& posed) {
+        Apply(posed);
+        if (bvh == nullptr) return;
+        bvh->Refit();
+        if (!bvh->Degraded()) return;
+        std::clog << "Rebuilding BVH... \n";
+        bvh = make_shared<PrimitiveBVH>(store);
+    }
+};
+
+
+#endif // ANIMATION_H
@@ -0,0 +1,112 @@
+#pragma once
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <new>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+#include "global.h"
+
+// Objects per block of a typed pool. Blocks never move, so objects keep their addresses.
+constexpr size_t ARENA_BLOCK = 256;
+
+// Scene-lifetime allocator. Objects are placement-constructed into one pool per type, blocks of
+// ARENA_BLOCK laid end to end, and are all destroyed together with the arena, newest first. Make
+// hands them out as shared_ptrs aliasing the arena's own control block, so they fit every interface
+// that takes a shared_ptr and need no control block of their own, while any copy, however far it
+// travels from the scene, keeps the whole arena alive. Objects of the arena passed to the constructor
+// of another are not counted, as both live exactly as long and counting would keep the arena alive
+// forever; what is read back out of an object is only as long-lived as it, so keep it through the
+// object, as PrimitiveStore::Add does. Links made after construction cannot be seen here: storing an
+// arena object in another, as in arena->Make<Scene>() then AddObject(arena->Make<Sphere>(...)), 
+// leaks the arena unless the stored pointer is passed through Link first. An arena must itself be
+// owned by a shared_ptr, e.g. from make_shared. Building is single-threaded.
+class Arena : public std::enable_shared_from_this<Arena> {
+public:
+    // Constructors
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena() {
+        for (auto pool = order.rbegin(); pool != order.rend(); ++pool) (*pool)->Clear();
+    }
+
+    // Methods
+    template <typename T, typename... Args>
+    shared_ptr<T> Make(Args&&... args) {
+        auto& pool = PoolOf<T>();
+        T* object = new (pool.Next()) T(Inner(std::forward<Args>(args))...);
+        pool.Commit();
+        objects += 1;
+        return shared_ptr<T>(shared_from_this(), object);
+    }
+    size_t Objects() const { return objects; }
+    // A pointer to keep inside another object of this arena: non-owning if it points into the arena,
+    // unchanged otherwise.
+    template <typename T>
+    shared_ptr<T> Link(const shared_ptr<T>& object) const { return Inner(object); }
+
+private:
+    // Members
+    struct PoolBase {
+        virtual ~PoolBase() = default;
+        virtual void Clear() = 0;
+    };
+    template <typename T>
+    struct Pool : PoolBase {
+        std::vector<T*> blocks;
+        size_t used = ARENA_BLOCK;      // In the last block
+
+        ~Pool() override { Clear(); }
+        void* Next() {
+            if (used == ARENA_BLOCK) {
+                blocks.push_back(static_cast<T*>(::operator new(sizeof(T) * ARENA_BLOCK, std::align_val_t(alignof(T)))));
+                used = 0;
+            }
+            return blocks.back() + used;
+        }
+        void Commit() { used += 1; }
+        void Clear() override {
+            for (size_t b = blocks.size(); b-- > 0;) {
+                size_t count = b + 1 == blocks.size() ? used : ARENA_BLOCK;
+                for (size_t i = count; i-- > 0;) blocks[b][i].~T();
+                ::operator delete(blocks[b], std::align_val_t(alignof(T)));
+            }
+            blocks.clear();
+            used = ARENA_BLOCK;
+        }
+    };
+    std::unordered_map<std::type_index, std::unique_ptr<PoolBase>> pools;
+    std::vector<PoolBase*> order;       // Pools in the order they were created
+    size_t objects = 0;
+
+    // Methods
+    template <typename T>
+    Pool<T>& PoolOf() {
+        auto& pool = pools[std::type_index(typeid(T))];
+        if (pool == nullptr) {
+            pool = std::make_unique<Pool<T>>();
+            order.push_back(pool.get());
+        }
+        return static_cast<Pool<T>&>(*pool);
+    }
+    // A constructor argument, with pointers into this arena made non-owning.
+    template <typename U>
+    decltype(auto) Inner(U&& arg) const {
+        using Decayed = std::decay_t<U>;
+        if constexpr (IsSharedPtr<Decayed>::value) {
+            auto self = weak_from_this();
+            bool ours = !arg.owner_before(self) && !self.owner_before(arg);
+            return ours ? Decayed(shared_ptr<void>(), arg.get()) : Decayed(std::forward<U>(arg));
+        } else {
+            return std::forward<U>(arg);
+        }
+    }
+    template <typename U> struct IsSharedPtr : std::false_type {};
+    template <typename U> struct IsSharedPtr<shared_ptr<U>> : std::true_type {};
+};
+
+
+#endif // ARENA_H
@@ -45,6 +45,24 @@ public:
         }
         return true;
     }
+    // Slab test with the reciprocal direction hoisted out by the caller, used by the flat BVH traversal.
+    // The exit distance is widened by a few ulps and touching counts as a hit, so rays through a 
+    // primitive's vertex still reach it when that vertex is a corner of the box.
+    bool Intersect(const Ray& ray, const Vector3& inv_dir, Interval ray_t) const {
+        for (int axis = 0; axis < 3; axis += 1) {
+            const Interval& intrv = (*this)[axis];
+            auto t0 = (intrv._min - ray.org[axis]) * inv_dir[axis];
+            auto t1 = (intrv._max - ray.org[axis]) * inv_dir[axis];
+
+            if (t0 > t1) std::swap(t0, t1);
+            t1 *= 1 + 4 * std::numeric_limits<double>::epsilon();
+            if (t0 > ray_t._min) ray_t._min = t0;
+            if (t1 < ray_t._max) ray_t._max = t1;
+            if (ray_t._min > ray_t._max)
+                return false;
+        }
+        return true;
+    }
     int MaxAxis() const {
         if (x.size > y.size) return (x.size > z.size) ? 0 : 2;
         else return (y.size > z.size) ? 1 : 2;
@@ -0,0 +1,66 @@
+#pragma once
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <vector>
+
+#include "global.h"
+
+// Contiguous array that either owns its elements or views memory owned elsewhere, typically a
+// mapped scene cache. Reads always go through one pointer, so both cases cost the same.
+template <typename T>
+class Buffer {
+public:
+    // Constructors
+    Buffer() = default;
+    Buffer(const Buffer& other) { *this = other; }
+    Buffer& operator=(const Buffer& other) {
+        owned = other.owned;
+        viewing = other.viewing;
+        ptr = viewing ? other.ptr : owned.data();
+        count = other.count;
+        return *this;
+    }
+
+    // Methods
+    void push_back(const T& value) { Own(); owned.push_back(value); Sync(); }
+    template <typename... Args>
+    T& emplace_back(Args&&... args) { Own(); owned.emplace_back(std::forward<Args>(args)...); Sync(); return owned.back(); }
+    void reserve(size_t n) { Own(); owned.reserve(n); Sync(); }
+    void resize(size_t n) { Own(); owned.resize(n); Sync(); }
+    void clear() { owned.clear(); viewing = false; Sync(); }
+    void swap(Buffer& other) { Buffer temp = other; other = *this; *this = temp; }
+    void swap(vector<T>& other) { Own(); owned.swap(other); Sync(); }
+    // Point at external memory, which must outlive the buffer.
+    void View(const T* data, size_t n) { owned.clear(); viewing = true; ptr = data; count = n; }
+
+    const T& operator[](size_t i) const { return ptr[i]; }
+    T& operator[](size_t i) { Own(); return owned[i]; }
+    const T& back() const { return ptr[count-1]; }
+    const T* data() const { return ptr; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool IsView() const { return viewing; }
+
+private:
+    // Members
+    vector<T> owned;
+    const T* ptr = nullptr;
+    size_t count = 0;
+    bool viewing = false;
+
+    // Methods
+    // Copy viewed elements before the first write
+    void Own() { 
+        if (!viewing) return;
+        owned.assign(ptr, ptr + count);
+        viewing = false;
+        Sync();
+    }
+    void Sync() { ptr = owned.data(); count = owned.size(); }
+};
+
+
+#endif // BUFFER_H
@@ -3,47 +3,73 @@
 #define CAMERA_H
 
 #include <omp.h>
+#include <algorithm>
+#include <vector>
 
 #include "global.h"
 #include "shapes.h"
 #include "mathematics.h"
 #include "material.h"
+#include "environment.h"
+#include "lightbvh.h"
+#include "guiding.h"
+#include "radiancecache.h"
+#include "photonmap.h"
 
 class Camera {
 public:
     // Methods
     void RenderScene(const Shapes& scene) {
+        auto frame_buffer = RenderFrame(scene);
+        std::clog << "Drawing Frame Buffer... \n";
+        WriteFrame(frame_buffer, image_width, image_height, std::cout);
+    }
+    // Render into a buffer of linear colours, row by row from the top.
+    std::vector<Colour> RenderFrame(const Shapes& scene) {
         InitializeCamera();
+        // Whatever an earlier frame built describes its geometry, not this one's
+        photons = nullptr;
+        guide = nullptr;
+        cache = nullptr;
+        if (caustics) TracePhotons(scene, 0);
+        if (radiance_cache) FillCache(scene);
+        if (guiding) SetPassSamples(TrainGuide(scene));
         
         std::clog << "Rendering Scene... \n";
 
-        std::vector<Colour> frame_buffer(image_width * image_height);
+        // With caustics the samples are split over passes, each with a fresh photon map
+        int total_spp = pass_spp;
+        int passes = photons != nullptr ? Max(Min(caustic_passes, total_spp), 1) : 1;
+        std::vector<Colour> frame_buffer(image_width * image_height, Colour(0.0));
+        std::vector<Colour> pass_buffer(passes > 1 ? frame_buffer.size() : 0);
         int progress = 0;
-        #pragma omp parallel for shared(progress)
-        for (int y = 0; y < image_height; y += 1) {
-            #pragma omp parallel for
-            for (int x = 0; x < image_width; x += 1) {
-                auto pixel_colour = Colour(0, 0, 0);
-                for (int s = 0; s < sample_ppixel; s += 1) {
-                    Ray ray = CastRay(x, y, s);
-                    // std::clog << "Rendering pixel (" << x << ", " << y << ") sample " << s << " \n";
-                    pixel_colour += RayColour(ray, scene, max_depth);
-                    // std::clog << "Pixel Colour: " << Str(pixel_colour) << "\n";
-                }
-                frame_buffer[y * image_width + x] = pixel_colour * spp_inv;
+        for (int pass = 0; pass < passes; pass += 1) {
+            if (pass > 0) TracePhotons(scene, pass);
+            int spp = total_spp / passes + (pass < total_spp % passes);
+            SetPassSamples(spp);
+            auto& target = passes > 1 ? pass_buffer : frame_buffer;
+            #pragma omp parallel for shared(progress)
+            for (int y = 0; y < image_height; y += 1) {
+                RenderRow(y, scene, target);
+                #pragma omp critical
+                ProgressBar(double(progress)/(image_height * passes));
+                progress += 1;
             }
-            #pragma omp critical
-            ProgressBar(double(progress)/image_height);
-            progress += 1;
+            if (passes > 1)
+                for (size_t i = 0; i < frame_buffer.size(); i += 1)
+                    frame_buffer[i] += pass_buffer[i] * (double(spp) / total_spp);
         }
         ProgressBar(1.0); 
         
         std::clog << "\nRendering Complete! \n";
-        std::clog << "Drawing Frame Buffer... \n";
-
-        std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
-        for (int i = 0; i < image_width * image_height; i += 1)
-            WriteColour(frame_buffer[i], std::cout);
+        // Frame boundary: no texture lookups are in flight
+        TextureManager::Instance().Trim();
+        return frame_buffer;
+    }
+    static void WriteFrame(const std::vector<Colour>& frame_buffer, int width, int height, std::ostream& out) {
+        out << "P3\n" << width << " " << height << "\n255\n";
+        for (int i = 0; i < width * height; i += 1)
+            WriteColour(frame_buffer[i], out);
     }
 
     // Members
@@ -54,6 +80,8 @@ public:
     double aspect_ratio = 1.0;
     double verticle_fov = 90.0;
     Colour background   = Colour(0.0);
+    shared_ptr<EnvironmentLight> environment;   // Replaces background and is sampled directly when set
+    shared_ptr<LightBVH> lights;                // Emitters sampled directly at every hit when set
 
     Vector3 view_up = Vector3(0, 1, 0);
     Point3 view_des = Point3(0, 0,-1);
@@ -62,6 +90,21 @@ public:
     double focal_dist     = 10.0;
     double defocus_angle  = 0.0;
 
+    int wavefront_size    = 256;    // Paths traced and shaded together
+
+    bool guiding          = false;  // Learn where light comes from before rendering, see TrainGuide
+    double bsdf_fraction  = 0.5;    // Share of guided bounces that still sample the BSDF
+
+    bool radiance_cache   = false;  // Reuse diffuse light gathered in a pre-pass, see FillCache
+    double cache_cell     = 0.0;    // Edge of a cache cell, zero for 1/48 of the scene's diagonal
+    double cache_error    = 0.25;   // Largest relative standard error of a cell still looked up
+    int cache_spp         = 4;      // Samples per pixel of the pre-pass
+
+    bool caustics         = false;  // Gather caustics from photons traced from lights, see TracePhotons
+    int caustic_photons   = 1 << 20;// Emitted per pass
+    int caustic_passes    = 4;      // Each with a fresh photon map and a smaller radius
+    double caustic_radius = 0.0;    // Of the first pass, zero for four pixels at the focus distance
+
 private:
     // Methods
     void InitializeCamera() {
@@ -90,23 +133,334 @@ private:
         aperture_u = u * aperture_radius;
         aperture_v = v * aperture_radius;
 
-        spp_root = int(Sqrt(sample_ppixel));  // For Antialiasing
-        spp_inv = 1.0 / sample_ppixel;
+        pixel_spread = Length(pixel_du) / focal_dist;    // Angle subtended by one pixel
+
+        SetPassSamples(sample_ppixel);
+    }
+    void SetPassSamples(int spp) {
+        pass_spp = spp;
+        spp_root = int(Sqrt(spp));  // For Antialiasing
+        spp_inv = 1.0 / spp;
         sample_du = pixel_du / (spp_root+1);
         sample_dv = pixel_dv / (spp_root+1);
     }
-    Colour RayColour(const Ray& ray, const Shapes& world, int depth) {
-        Intersection isect;
-        if (RandomFloat() > roulette || 
-            !world.Intersect(ray, Interval(EPS_DEUX, POS_INF), isect))
-            return background;
-        Ray scattered;
-        Colour attenuation;
-        auto colour_emission  = isect.material->Emission(isect.u, isect.v, isect.coords);
-        if (!isect.material->Scatter(ray, isect, attenuation, scattered))
-            return colour_emission / roulette;
-        auto colour_scattered = attenuation * RayColour(scattered, world, depth-1);
-        return (colour_emission + colour_scattered) / roulette;
+    // Train the guiding field over passes of 1, 2, 4, ... samples per pixel, spending up to half the
+    // sample budget; the images of these passes are thrown away. Returns the samples left per pixel.
+    int TrainGuide(const Shapes& scene) {
+        guide = make_shared<GuidingField>(scene.BBox());
+        std::vector<Colour> discarded(image_width * image_height);
+        int spent = 0;
+        training = true;
+        for (int pass = 0, spp = 1; spent + spp <= sample_ppixel / 2; pass += 1, spp *= 2) {
+            std::clog << "Training Guide, Pass " << pass << " at " << spp << " spp... \n";
+            SetPassSamples(spp);
+            #pragma omp parallel for
+            for (int y = 0; y < image_height; y += 1)
+                RenderRow(y, scene, discarded);
+            guide->Refine(pass);
+            spent += spp;
+        }
+        training = false;
+        std::clog << "Guide Trained: " << guide->Leaves() << " regions. \n";
+        return sample_ppixel - spent;
+    }
+    // Trace a fresh caustic photon map for a pass of the render. Following Knaus and Zwicker,
+    // "Progressive Photon Mapping: A Probabilistic Approach" (2011), every pass gathers with its own
+    // radius, smaller than the last, and its image is independent of the others, so averaging the
+    // passes takes both the noise and the blur of the estimate to zero without per-pixel statistics.
+    void TracePhotons(const Shapes& scene, int pass) {
+        if (lights == nullptr) {
+            std::cerr << "ERROR: Caustics need a light hierarchy to trace photons from.\n";
+            return;
+        }
+        photon_radius = pass == 0 ? (caustic_radius > 0 ? caustic_radius : 4 * Length(pixel_du))
+                                  : PhotonMap::Shrink(photon_radius, pass);
+        photons = make_shared<PhotonMap>(scene, *lights, caustic_photons, photon_radius);
+        std::clog << "Photon Map " << pass << ": " << photons->Size() << " caustic photons, radius " 
+                  << photon_radius << ". \n";
+    }
+    // Trace the image once at cache_spp, recording the light leaving every diffuse hit into a fresh
+    // radiance cache; the image of this pass is thrown away. Later passes end their paths at the
+    // second diffuse hit onwards wherever the cache has converged.
+    void FillCache(const Shapes& scene) {
+        auto extent = scene.BBox();
+        double diagonal = Length(Vector3(extent.x.size, extent.y.size, extent.z.size));
+        cache = make_shared<RadianceCache>(cache_cell > 0 ? cache_cell : diagonal / 48, cache_error);
+        std::vector<Colour> discarded(image_width * image_height);
+        std::clog << "Filling Radiance Cache at " << cache_spp << " spp... \n";
+        filling = true;
+        SetPassSamples(cache_spp);
+        #pragma omp parallel for
+        for (int y = 0; y < image_height; y += 1)
+            RenderRow(y, scene, discarded);
+        SetPassSamples(sample_ppixel);
+        filling = false;
+        std::clog << "Radiance Cache Filled: " << cache->Cells() << " cells. \n";
+    }
+    // Trace the samples of a row in cache-sized waves, one bounce at a time. Each bounce intersects 
+    // every live path, then shades the hits grouped by material so each material's parameters and
+    // textures stay hot. Paths that stop or leave the scene add the background, as Russian roulette goes.
+    // With an environment light or a light hierarchy, every non-specular hit also casts a shadow ray 
+    // towards a sampled sky direction or emitter, and those estimates and the ones from paths that 
+    // escape to the sky or run into an emitter are combined with the power heuristic. While the guide
+    // trains, each path keeps a chain of its vertices, and everything it gathers is credited back
+    // along the chain so every vertex learns the light that arrived through its sampled direction.
+    // Filling the radiance cache works the same way with a chain of diffuse hits, each learning the
+    // light that left it; once filled, a secondary diffuse hit takes the cached light and stops.
+    // With a photon map every diffuse hit gathers its caustics from the photons, so a path that
+    // reaches an emitter through nothing but mirrors and glass since its last diffuse hit adds nothing.
+    void RenderRow(int y, const Shapes& world, std::vector<Colour>& frame_buffer) {
+        std::vector<Colour> radiance(image_width, Colour(0.0));
+        int pixels_per_wave = Max(wavefront_size / pass_spp, 1);
+        for (int x = 0; x < image_width; x += pixels_per_wave)
+            RenderWave(y, x, Min(x + pixels_per_wave, image_width), world, radiance);
+        for (int x = 0; x < image_width; x += 1)
+            frame_buffer[y * image_width + x] = radiance[x] * spp_inv;
+    }
+    void RenderWave(int y, int x_begin, int x_end, const Shapes& world, std::vector<Colour>& radiance) {
+        struct Path {
+            Ray ray;
+            Colour throughput;
+            int pixel;
+            double pdf;     // Of the BSDF sample that chose this ray, for MIS
+            Vector3 normal; // At the vertex the ray leaves, zero for camera rays
+            bool delta;     // Chosen by a delta lobe or the camera, so never light-sampled
+            int vertex;     // Last vertex recorded for training, -1 for none
+            int record;     // Last diffuse hit recorded for the radiance cache, -1 for none
+            bool diffuse;   // Last non-delta vertex was diffuse, so only delta ones have followed it
+        };
+        struct Vertex {
+            Point3 coords;
+            Vector3 wi;
+            Colour throughput;  // Of the path leaving the vertex
+            Colour gathered;    // Everything the path added to the pixel after it
+            double pdf;
+            uint32_t leaf;
+            int prev;
+        };
+        struct Record {
+            Point3 coords;
+            Vector3 normal;
+            Colour weight;      // Of the path arriving at the hit
+            Colour albedo;
+            Colour gathered;    // Everything the path added to the pixel from the hit on
+            int prev;
+        };
+        std::vector<Path> paths, next;
+        std::vector<Vertex> vertices;
+        std::vector<Record> records;
+        std::vector<Intersection> isects;
+        std::vector<Ray> rays;
+        std::vector<char> hits;
+        std::vector<uint32_t> survivors, order;
+        std::vector<double> us, vs, footprints;
+        std::vector<Point3> points;
+        std::vector<Colour> emitted, albedos;
+        paths.reserve((x_end - x_begin) * pass_spp);
+        for (int x = x_begin; x < x_end; x += 1)
+            for (int s = 0; s < pass_spp; s += 1)
+                paths.push_back(Path{CastRay(x, y, s), Colour(1.0), x, 0.0, Vector3(0.0), true, -1, -1, false});
+        auto deposit = [&](const Path& path, const Colour& value) {
+            radiance[path.pixel] += value;
+            if (training) 
+                for (int v = path.vertex; v >= 0; v = vertices[v].prev) vertices[v].gathered += value;
+            if (filling)
+                for (int r = path.record; r >= 0; r = records[r].prev) records[r].gathered += value;
+        };
+
+        for (int depth = 0; depth < max_depth && !paths.empty(); depth += 1) {
+            // Roulette first, then intersect the survivors as one batch
+            rays.clear();
+            survivors.clear();
+            for (uint32_t i = 0; i < paths.size(); i += 1) {
+                if (RandomFloat() <= roulette) {
+                    rays.push_back(paths[i].ray);
+                    survivors.push_back(i);
+                } else if (environment == nullptr) {
+                    deposit(paths[i], paths[i].throughput * background);
+                }
+            }
+            world.IntersectBatch(rays, Interval(EPS_DEUX, POS_INF), isects, hits);
+            order.clear();
+            for (uint32_t k = 0; k < survivors.size(); k += 1) {
+                const auto& path = paths[survivors[k]];
+                if (hits[k]) {
+                    order.push_back(k);
+                } else if (environment == nullptr) {
+                    deposit(path, path.throughput * background);
+                } else {
+                    double mis = path.delta ? 1.0 : PowerHeuristic(path.pdf, environment->Pdf(path.ray.dir));
+                    deposit(path, path.throughput / roulette * environment->Radiance(path.ray.dir) * mis);
+                }
+            }
+            std::sort(order.begin(), order.end(), [&isects](uint32_t a, uint32_t b) {
+                return isects[a].material < isects[b].material;
+            });
+            // Evaluate the textures of each run of hits on one material in a single call
+            us.resize(order.size());
+            vs.resize(order.size());
+            footprints.resize(order.size());
+            points.resize(order.size());
+            emitted.resize(order.size());
+            albedos.resize(order.size());
+            for (size_t j = 0; j < order.size(); j += 1) {
+                const auto& isect = isects[order[j]];
+                us[j] = isect.u;
+                vs[j] = isect.v;
+                footprints[j] = isect.footprint;
+                points[j] = isect.coords;
+            }
+            for (size_t begin = 0, end; begin < order.size(); begin = end) {
+                const auto& material = *isects[order[begin]].material;
+                for (end = begin + 1; end < order.size() && isects[order[end]].material == &material; end += 1) {}
+                if (material.IsEmissive())
+                    material.Emission(&us[begin], &vs[begin], &points[begin], &footprints[begin], &emitted[begin], end - begin);
+                if ((cache != nullptr || photons != nullptr) && material.Type() == MaterialType::Lambertian)
+                    material.Albedo(&us[begin], &vs[begin], &points[begin], &footprints[begin], &albedos[begin], end - begin);
+            }
+            next.clear();
+            for (size_t j = 0; j < order.size(); j += 1) {
+                auto path = paths[survivors[order[j]]];     // A copy, as a cache record may start here
+                const auto& isect = isects[order[j]];
+                const auto& material = *isect.material;
+                auto weight = path.throughput / roulette;
+                // Light from diffuse through specular bounces to an emitter that photons leave is
+                // what the caustic map gathers; other emitters are only found this way
+                if (material.IsEmissive() && !(photons != nullptr && path.delta && path.diffuse && 
+                                               lights->Contains(isect, path.ray.time))) {
+                    double mis = (lights == nullptr || path.delta) ? 1.0 
+                               : PowerHeuristic(path.pdf, lights->Pdf(path.ray.org, path.normal, path.ray, isect));
+                    deposit(path, weight * emitted[j] * mis);
+                }
+                if ((cache != nullptr || photons != nullptr) && material.Type() == MaterialType::Lambertian) {
+                    const auto& albedo = albedos[j];
+                    Colour cached;
+                    if (cache != nullptr && filling) {
+                        records.push_back(Record{isect.coords, isect.normal, weight, albedo, Colour(0.0), path.record});
+                        path.record = records.size() - 1;
+                    } else if (cache != nullptr && depth > 0 && !training && cache->Lookup(isect.coords, isect.normal, cached)) {
+                        deposit(path, weight * albedo * cached);
+                        continue;
+                    }
+                    if (photons != nullptr)
+                        deposit(path, weight * albedo * M_1_PI * photons->Gather(isect.coords, isect.normal));
+                }
+                auto wo = -path.ray.dir;
+                const DirectionTree* distribution = nullptr;
+                uint32_t leaf = 0;
+                if (guide != nullptr && !material.IsSpecular() && !material.IsEmissive()) {
+                    leaf = guide->Leaf(isect.coords);
+                    if (!guide->Distribution(leaf).Empty()) distribution = &guide->Distribution(leaf);
+                }
+                if (!material.IsSpecular() && !material.IsEmissive()) {
+                    if (environment != nullptr)
+                        deposit(path, weight * SampleEnvironment(wo, isect, path.ray.time, world, distribution));
+                    if (lights != nullptr)
+                        deposit(path, weight * SampleLights(wo, isect, path.ray.time, world, distribution));
+                }
+                BSDFSample sample;
+                if (distribution == nullptr ? !material.Sample(wo, isect, sample) 
+                                            : !SampleGuided(wo, isect, *distribution, sample)) continue;
+                Ray scattered(isect.coords, sample.wi, path.ray.time);
+                // Continue the ray cone from the hit, growing at the same rate
+                scattered.width = path.ray.width + path.ray.spread * isect.time * Length(path.ray.dir);
+                scattered.spread = path.ray.spread;
+                int vertex = path.vertex;
+                if (training && guide != nullptr && !sample.delta) {
+                    vertex = vertices.size();
+                    vertices.push_back(Vertex{isect.coords, sample.wi, weight * sample.weight, Colour(0.0), 
+                                              sample.pdf, leaf, path.vertex});
+                }
+                next.push_back(Path{scattered, weight * sample.weight, path.pixel, sample.pdf, isect.normal, 
+                                    sample.delta, vertex, path.record, 
+                                    sample.delta ? path.diffuse : material.Type() == MaterialType::Lambertian});
+            }
+            paths.swap(next);
+        }
+        // Incident radiance at each vertex is what was gathered after it over the throughput that
+        // carried it there; splatting it over the sampling density estimates the field.
+        for (const auto& vertex : vertices) {
+            Colour incident;
+            for (int c = 0; c < 3; c += 1)
+                incident[c] = vertex.throughput[c] > 0 ? vertex.gathered[c] / vertex.throughput[c] : 0.0;
+            guide->Record(vertex.leaf, vertex.wi, Luminance(incident) / vertex.pdf);
+        }
+        // Likewise the light leaving each diffuse hit is what was gathered from it on over the weight
+        // that reached it, and dividing out the albedo leaves what the cache stores.
+        for (const auto& record : records) {
+            Colour value;
+            for (int c = 0; c < 3; c += 1) {
+                double reflected = record.weight[c] * record.albedo[c];
+                value[c] = reflected > 0 ? record.gathered[c] / reflected : 0.0;
+            }
+            cache->Record(record.coords, record.normal, value);
+        }
+    }
+    // Mix BSDF sampling with the learned distribution; the pdf and weight cover both strategies.
+    bool SampleGuided(const Vector3& wo, const Intersection& isect, const DirectionTree& distribution, 
+                      BSDFSample& sample) const {
+        const auto& material = *isect.material;
+        if (RandomFloat() < bsdf_fraction) {
+            if (!material.Sample(wo, isect, sample)) return false;
+            if (sample.delta) return true;
+        } else {
+            sample.wi = distribution.Sample();
+            sample.f = material.Eval(wo, sample.wi, isect);
+            sample.delta = false;
+        }
+        auto cosine = Cosine(sample.wi, isect);
+        sample.pdf = ScatterPdf(wo, sample.wi, isect, &distribution);
+        if (cosine <= 0 || sample.pdf <= 0 || IsZero(sample.f)) return false;
+        sample.weight = sample.f * (cosine / sample.pdf);
+        return true;
+    }
+    double ScatterPdf(const Vector3& wo, const Vector3& wi, const Intersection& isect, 
+                      const DirectionTree* distribution) const {
+        double pdf = isect.material->Pdf(wo, wi, isect);
+        if (distribution == nullptr) return pdf;
+        return bsdf_fraction * pdf + (1 - bsdf_fraction) * distribution->Pdf(wi);
+    }
+    // Next-event estimate of the sky's direct light at a hit, weighted against BSDF sampling.
+    Colour SampleEnvironment(const Vector3& wo, const Intersection& isect, double time, const Shapes& world,
+                             const DirectionTree* distribution) const {
+        Vector3 wi;
+        double light_pdf;
+        auto light = environment->Sample(wi, light_pdf);
+        if (light_pdf <= 0) return Colour(0.0);
+        auto cosine = Cosine(wi, isect);
+        if (cosine <= 0) return Colour(0.0);
+        auto f = isect.material->Eval(wo, wi, isect);
+        if (IsZero(f)) return Colour(0.0);
+        Intersection blocker;
+        if (world.Intersect(Ray(isect.coords, wi, time), Interval(EPS_DEUX, POS_INF), blocker)) return Colour(0.0);
+        double mis = PowerHeuristic(light_pdf, ScatterPdf(wo, wi, isect, distribution));
+        return f * light * (cosine * mis / light_pdf);
+    }
+    // Next-event estimate of one emitter's direct light at a hit, chosen through the light hierarchy.
+    Colour SampleLights(const Vector3& wo, const Intersection& isect, double time, const Shapes& world,
+                        const DirectionTree* distribution) const {
+        Vector3 wi;
+        double light_pdf, distance;
+        auto light = lights->Sample(isect.coords, isect.normal, time, wi, light_pdf, distance);
+        if (light_pdf <= 0) return Colour(0.0);
+        auto cosine = Cosine(wi, isect);
+        if (cosine <= 0) return Colour(0.0);
+        auto f = isect.material->Eval(wo, wi, isect);
+        if (IsZero(f)) return Colour(0.0);
+        Intersection blocker;
+        if (world.Intersect(Ray(isect.coords, wi, time), Interval(EPS_DEUX, distance * (1 - EPS_UNIT)), blocker)) 
+            return Colour(0.0);
+        double mis = PowerHeuristic(light_pdf, ScatterPdf(wo, wi, isect, distribution));
+        return f * light * (cosine * mis / light_pdf);
+    }
+    // Foreshortening of light arriving along wi. A point in a medium has no surface to foreshorten it, 
+    // and its zero normal leaves the normal out of light selection as well.
+    static double Cosine(const Vector3& wi, const Intersection& isect) {
+        return isect.material->IsVolumetric() ? 1.0 : Dot(wi, isect.normal);
+    }
+    static double PowerHeuristic(double pdf, double other_pdf) {
+        double a = Sqr(pdf), b = Sqr(other_pdf);
+        return a + b > 0 ? a / (a + b) : 0.0;
     }
     Ray CastRay(int x, int y, int s) {
         auto pixel_centre = pixel00_centre + pixel_du*x + pixel_dv*y;
@@ -118,7 +472,9 @@ private:
                         : camera_centre;
         auto ray_direction = Normalize(pixel_sample - ray_origin);
         auto ray_time = RandomFloat();
-        return Ray(ray_origin, ray_direction, ray_time);
+        auto ray = Ray(ray_origin, ray_direction, ray_time);
+        ray.spread = pixel_spread;
+        return ray;
     }
     Ray CastRay(int x, int y) {
         auto sample_offset = Sample05();
@@ -130,7 +486,9 @@ private:
                         : camera_centre;
         auto ray_direction = Normalize(pixel_sample - ray_origin);
         auto ray_time = RandomFloat();
-        return Ray(ray_origin, ray_direction, ray_time);                                     
+        auto ray = Ray(ray_origin, ray_direction, ray_time);
+        ray.spread = pixel_spread;
+        return ray;                                     
     }
     Point3 Sample05() {
         return Point3(RandomFloat()-.5f, RandomFloat()-.5f, 0);
@@ -142,8 +500,14 @@ private:
     }
 
     // Members
-    int image_height, spp_root;
-    double spp_inv;
+    int image_height, spp_root, pass_spp;
+    double spp_inv, pixel_spread;
+    bool training = false;
+    shared_ptr<GuidingField> guide;
+    bool filling = false;
+    shared_ptr<RadianceCache> cache;
+    shared_ptr<PhotonMap> photons;
+    double photon_radius;
     Point3 camera_centre, pixel00_centre;
     Vector3 pixel_du, pixel_dv;
     Vector3 sample_du, sample_dv;
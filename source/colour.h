@@ -20,6 +20,8 @@ inline void WriteColour(const Colour& pic_colour, std::ostream& os) {
     // Write the bytes to the output stream.
     os << rbyte << " " << gbyte << " " << bbyte << '\n';
 }
+// Brightness of a linear colour as the eye sees it, by the Rec. 709 weights.
+inline double Luminance(const Colour& c) { return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z; }
 inline Colour RandomColour() { return RandomVec3(); }
 inline Colour RandomColour(double min, double max) { return RandomVec3(min, max); }
 
@@ -0,0 +1,184 @@
+#pragma once
+#ifndef COMPRESSEDBVH_H
+#define COMPRESSEDBVH_H
+
+#include <cmath>
+
+#include "global.h"
+#include "mathematics.h"
+#include "primitives.h"
+
+// Children per node of a CompressedBVH.
+constexpr int WIDE_WIDTH = 4;
+
+// Node of a CompressedBVH, one cache line. Child boxes are stored as 8-bit steps of a grid anchored
+// at the node's origin, with a power of two as the step along each axis; lower corners are rounded
+// down and upper ones up, so a decoded box always encloses the exact one.
+struct alignas(64) WideNode {
+    float    origin[3];
+    int8_t   exponent[3];                   // Step along each axis is 2^exponent
+    uint8_t  used;                          // Children in use, the first ones
+    uint8_t  count[WIDE_WIDTH];             // Leaf: number of references, zero for interior children
+    uint8_t  lo[3][WIDE_WIDTH], hi[3][WIDE_WIDTH];
+    uint32_t child[WIDE_WIDTH];             // Leaf: first reference, Interior: node
+};
+static_assert(sizeof(WideNode) == 64, "WideNode should fill exactly one cache line");
+
+// Four-wide BVH with quantised child boxes after Ylitie et al., "Efficient Incoherent Ray Traversal
+// on GPUs Through Compressed Wide BVHs" (2017), collapsed from a built PrimitiveBVH. A PrimitiveBVH
+// node takes 80 bytes, a quarter of them redundant interval sizes, and one node of this tree replaces
+// about three of them in 64 bytes, so huge scenes keep far more of their tree in cache. A moving
+// scene stores boxes enclosing the whole shutter, since there is no room for their motion.
+class CompressedBVH : public Shapes {
+public:
+    // Constructors
+    CompressedBVH(const PrimitiveBVH& bvh) 
+     : store(bvh.store), refs(bvh.refs.begin(), bvh.refs.end()), clusters(bvh.clusters.begin(), bvh.clusters.end()) {
+        if (bvh.nodes.empty()) return;
+        auto box = [&bvh](uint32_t n) {
+            return bvh.motion.empty() ? bvh.nodes[n].bounds : Union(bvh.BoundsAt(n, 0.0), bvh.BoundsAt(n, 1.0));
+        };
+        bounds = box(0);
+        if (bvh.nodes[0].count > 0) {
+            // A lone leaf still needs a node to sit in
+            nodes.emplace_back();
+            Encode(nodes[0], bounds, {0}, bvh, box);
+            return;
+        }
+        nodes.reserve(bvh.nodes.size() / 2);
+        Collapse(0, bvh, box);
+    }
+
+    // Methods
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        if (nodes.empty()) return false;
+        auto inv_dir = Vector3(1.0/ray.dir.x, 1.0/ray.dir.y, 1.0/ray.dir.z);
+        struct Entry {
+            uint32_t node;
+            double   t;     // Where the ray enters the node's box
+        } stack[128];
+        int stack_size = 0;
+        stack[stack_size++] = Entry{0, ray_time._min};
+        bool happened = false;
+        while (stack_size > 0) {
+            auto entry = stack[--stack_size];
+            if (entry.t > ray_time._max) continue;
+            const WideNode& node = nodes[entry.node];
+            // The box edges of child k lie at origin + q·step, so each axis costs one multiply-add
+            double base[3], step[3];
+            for (int axis = 0; axis < 3; axis += 1) {
+                base[axis] = (node.origin[axis] - ray.org[axis]) * inv_dir[axis];
+                step[axis] = std::ldexp(1.0, node.exponent[axis]) * inv_dir[axis];
+            }
+            double near[WIDE_WIDTH];
+            int order[WIDE_WIDTH];
+            int hits = 0;
+            for (int k = 0; k < node.used; k += 1) {
+                double t_min = ray_time._min, t_max = ray_time._max;
+                for (int axis = 0; axis < 3; axis += 1) {
+                    double t0 = base[axis] + node.lo[axis][k] * step[axis];
+                    double t1 = base[axis] + node.hi[axis][k] * step[axis];
+                    if (t0 > t1) Swap(t0, t1);
+                    t1 *= 1 + 4 * std::numeric_limits<double>::epsilon();
+                    if (t0 > t_min) t_min = t0;
+                    if (t1 < t_max) t_max = t1;
+                }
+                if (t_min > t_max) continue;
+                if (node.count[k] > 0) {
+                    if (store->IntersectLeaf(refs.data() + node.child[k], node.count[k], ray, ray_time, isect, clusters.data()))
+                        happened = true;
+                    continue;
+                }
+                // Keep the hit children sorted from far to near, so the nearest is popped first
+                int slot = hits++;
+                while (slot > 0 && near[slot-1] < t_min) {
+                    near[slot] = near[slot-1];
+                    order[slot] = order[slot-1];
+                    slot -= 1;
+                }
+                near[slot] = t_min;
+                order[slot] = k;
+            }
+            for (int h = 0; h < hits; h += 1)
+                stack[stack_size++] = Entry{node.child[order[h]], near[h]};
+        }
+        return happened;
+    }
+    Bounds3 BBox() const override { return bounds; }
+    size_t Nodes() const { return nodes.size(); }
+    // Memory held by the nodes and references, not counting the primitives themselves.
+    size_t Bytes() const { return nodes.size() * sizeof(WideNode) + refs.size() * sizeof(PrimRef); }
+
+private:
+    // Members
+    shared_ptr<PrimitiveStore> store;
+    vector<PrimRef> refs;
+    vector<SphereCluster> clusters;     // Copied from the tree, whose references point into them
+    vector<WideNode> nodes;
+    Bounds3 bounds;
+
+    // Methods
+    // Emit a node for binary interior node n and, depth first, for everything below it. Its children
+    // are found by opening the largest interior child until there are WIDE_WIDTH of them.
+    template <typename BoxOf>
+    uint32_t Collapse(uint32_t n, const PrimitiveBVH& bvh, const BoxOf& box) {
+        vector<uint32_t> children = { n + 1, bvh.nodes[n].offset };
+        while (children.size() < WIDE_WIDTH) {
+            int largest = -1;
+            double largest_area = -1;
+            for (size_t k = 0; k < children.size(); k += 1) {
+                if (bvh.nodes[children[k]].count > 0) continue;
+                double area = PrimitiveBVH::HalfArea(box(children[k]));
+                if (area > largest_area) { largest_area = area; largest = k; }
+            }
+            if (largest < 0) break;
+            uint32_t opened = children[largest];
+            children[largest] = opened + 1;
+            children.push_back(bvh.nodes[opened].offset);
+        }
+        uint32_t index = nodes.size();
+        nodes.emplace_back();
+        Encode(nodes[index], box(n), children, bvh, box);
+        for (size_t k = 0; k < children.size(); k += 1) {
+            if (bvh.nodes[children[k]].count > 0) continue;
+            uint32_t child = Collapse(children[k], bvh, box);
+            nodes[index].child[k] = child;
+        }
+        return index;
+    }
+    template <typename BoxOf>
+    static void Encode(WideNode& node, const Bounds3& parent, const vector<uint32_t>& children,
+                       const PrimitiveBVH& bvh, const BoxOf& box) {
+        node = WideNode{};
+        node.used = children.size();
+        double scale[3];
+        for (int axis = 0; axis < 3; axis += 1) {
+            // Round the origin down to a float, then take the smallest step that still reaches the top
+            double lower = parent[axis]._min, upper = parent[axis]._max;
+            float origin = float(lower);
+            if (double(origin) > lower) origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+            int exponent = int(std::ceil(std::log2(Max((upper - origin) / 255, 1e-30))));
+            exponent = Min(Max(exponent, -128), 127);
+            while (exponent < 127 && origin + 255 * std::ldexp(1.0, exponent) < upper) exponent += 1;
+            node.origin[axis] = origin;
+            node.exponent[axis] = int8_t(exponent);
+            scale[axis] = std::ldexp(1.0, -exponent);
+        }
+        for (size_t k = 0; k < children.size(); k += 1) {
+            const auto& source = bvh.nodes[children[k]];
+            auto child = box(children[k]);
+            for (int axis = 0; axis < 3; axis += 1) {
+                double lo = std::floor((child[axis]._min - node.origin[axis]) * scale[axis]);
+                double hi = std::ceil((child[axis]._max - node.origin[axis]) * scale[axis]);
+                node.lo[axis][k] = uint8_t(Min(Max(lo, 0.0), 255.0));
+                node.hi[axis][k] = uint8_t(Min(Max(hi, 0.0), 255.0));
+            }
+            if (source.count > UINT8_MAX) throw std::runtime_error("CompressedBVH leaves hold at most 255 references.");
+            node.count[k] = source.count;
+            node.child[k] = source.count > 0 ? source.offset : 0;
+        }
+    }
+};
+
+
+#endif // COMPRESSEDBVH_H
@@ -0,0 +1,74 @@
+#pragma once
+#ifndef DISTRIBUTION_H
+#define DISTRIBUTION_H
+
+#include <vector>
+
+#include "global.h"
+
+// Discrete distribution over n outcomes with Walker's alias method: after an O(n) build, drawing an
+// outcome costs one uniform number and one table lookup however skewed the weights are.
+class AliasTable {
+public:
+    // Constructors
+    AliasTable() = default;
+    AliasTable(const std::vector<double>& weights) {
+        size_t n = weights.size();
+        double total = 0.0;
+        for (double w : weights) total += Max(w, 0.0);
+        bins.resize(n);
+        if (n == 0) return;
+        // Split the outcomes by whether they over- or under-fill an average bin, then top up each
+        // small bin with the excess of a large one.
+        std::vector<uint32_t> small, large;
+        std::vector<double> scaled(n);
+        for (size_t i = 0; i < n; i += 1) {
+            bins[i].pmf = total > 0 ? Max(weights[i], 0.0) / total : 1.0 / n;
+            scaled[i] = bins[i].pmf * n;
+            (scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            bins[s].threshold = scaled[s];
+            bins[s].alias = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) { large.pop_back(); small.push_back(l); }
+        }
+        // Whatever is left is full up to rounding error
+        for (uint32_t i : large) { bins[i].threshold = 1.0; bins[i].alias = i; }
+        for (uint32_t i : small) { bins[i].threshold = 1.0; bins[i].alias = i; }
+    }
+
+    // Methods
+    size_t Size() const { return bins.size(); }
+    double Pmf(size_t i) const { return bins[i].pmf; }
+    // Draw an outcome from u in [0,1); remainder returns a fresh uniform number left over from u.
+    size_t Sample(double u, double& pmf, double& remainder) const {
+        double scaled = u * bins.size();
+        size_t i = Min(size_t(scaled), bins.size() - 1);
+        double up = scaled - i;
+        const auto& bin = bins[i];
+        if (up < bin.threshold) {
+            remainder = up / bin.threshold;
+        } else {
+            remainder = (up - bin.threshold) / (1.0 - bin.threshold);
+            i = bin.alias;
+        }
+        pmf = bins[i].pmf;
+        remainder = Min(remainder, 1.0 - EPS_QUAT);
+        return i;
+    }
+
+private:
+    // Members
+    struct Bin {
+        double   pmf = 0.0;
+        double   threshold = 1.0;   // Chance of keeping this bin rather than taking its alias
+        uint32_t alias = 0;
+    };
+    std::vector<Bin> bins;
+};
+
+
+#endif // DISTRIBUTION_H
@@ -0,0 +1,237 @@
+#pragma once
+#ifndef DYNAMICBVH_H
+#define DYNAMICBVH_H
+
+#include "global.h"
+#include "mathematics.h"
+#include "shapes.h"
+#include "scene.h"
+#include "bounds.h"
+
+// Scene that can be edited object by object, for layout tools that change a few things between
+// renders. Objects live in the leaves of a dynamic bounding volume tree in the manner of Box2D's
+// b2DynamicTree: a new leaf is paired with the sibling that adds the least surface area, found by a
+// branch-and-bound descent, and every node on the way back up is rebalanced by rotating its taller
+// child's larger subtree into its place. Adding, removing or moving an object therefore touches one
+// root-to-leaf path instead of rebuilding the tree. Leaves never move once allocated; an object's
+// handle is its leaf's index together with the generation of that slot, which is bumped every time
+// the slot is freed, so a handle kept after its object was removed is refused even once the slot
+// holds another object.
+class DynamicScene : public Shapes {
+public:
+    using Handle = uint64_t;                // Generation in the high 32 bits, leaf index in the low
+    static constexpr Handle INVALID = ~Handle(0);
+
+    // Methods
+    Handle Add(shared_ptr<Shapes> object) {
+        Index leaf = Allocate();
+        nodes[leaf].object = object;
+        nodes[leaf].bounds = object->BBox();
+        nodes[leaf].height = 0;
+        InsertLeaf(leaf);
+        count += 1;
+        return (Handle(nodes[leaf].generation) << 32) | uint32_t(leaf);
+    }
+    void Remove(Handle handle) {
+        if (!Valid(handle)) return;
+        RemoveLeaf(LeafOf(handle));
+        Free(LeafOf(handle));
+        count -= 1;
+    }
+    // Swap in a changed version of an object, e.g. a moved copy, under the same handle.
+    void Update(Handle handle, shared_ptr<Shapes> object) {
+        if (!Valid(handle)) return;
+        Index leaf = LeafOf(handle);
+        RemoveLeaf(leaf);
+        nodes[leaf].object = object;
+        nodes[leaf].bounds = object->BBox();
+        InsertLeaf(leaf);
+    }
+    // Refit an object whose shape changed in place.
+    void Update(Handle handle) { if (Valid(handle)) Update(handle, nodes[LeafOf(handle)].object); }
+    // Remove everything; slots keep their generations, so no earlier handle becomes valid again.
+    void Clear() {
+        free_list = NONE;
+        for (Index node = Index(nodes.size()) - 1; node >= 0; node -= 1) Free(node);
+        root = NONE;
+        count = 0;
+    }
+    bool Valid(Handle handle) const {
+        uint32_t leaf = uint32_t(handle);
+        return leaf < nodes.size() && nodes[leaf].height == 0 && nodes[leaf].object != nullptr && 
+               nodes[leaf].generation == uint32_t(handle >> 32);
+    }
+    shared_ptr<Shapes> Object(Handle handle) const { return Valid(handle) ? nodes[LeafOf(handle)].object : nullptr; }
+    size_t Size() const { return count; }
+    int Height() const { return root == NONE ? 0 : nodes[root].height; }
+
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        if (root == NONE) return false;
+        auto inv_dir = Vector3(1.0/ray.dir.x, 1.0/ray.dir.y, 1.0/ray.dir.z);
+        Index stack[96];
+        int stack_size = 0;
+        stack[stack_size++] = root;
+        bool happened = false;
+        while (stack_size > 0) {
+            const Node& node = nodes[stack[--stack_size]];
+            if (!node.bounds.Intersect(ray, inv_dir, ray_time)) continue;
+            if (node.height == 0) {
+                if (node.object->Intersect(ray, ray_time, isect)) {
+                    happened = true;
+                    ray_time._max = isect.time;
+                }
+                continue;
+            }
+            stack[stack_size++] = node.child[1];
+            stack[stack_size++] = node.child[0];
+        }
+        return happened;
+    }
+    Bounds3 BBox() const override { return root == NONE ? Bounds3::Empty : nodes[root].bounds; }
+
+private:
+    // Members
+    using Index = int32_t;
+    static constexpr Index NONE = -1;
+    struct Node {
+        Bounds3 bounds;
+        shared_ptr<Shapes> object;          // Leaves only
+        Index parent = NONE;                // Next free node while on the free list
+        Index child[2] = {NONE, NONE};
+        int height = -1;                    // Zero for leaves, -1 while free
+        uint32_t generation = 0;            // Times the slot has been freed
+    };
+    vector<Node> nodes;
+    Index root = NONE;
+    Index free_list = NONE;
+    size_t count = 0;
+
+    // Methods
+    static Index LeafOf(Index handle) { return Index(uint32_t(handle)); }
+    Index Allocate() {
+        if (free_list == NONE) {
+            nodes.emplace_back();
+            return Index(nodes.size() - 1);
+        }
+        Index node = free_list;
+        free_list = nodes[node].parent;
+        uint32_t generation = nodes[node].generation;
+        nodes[node] = Node();
+        nodes[node].generation = generation;
+        return node;
+    }
+    void Free(Index node) {
+        uint32_t generation = nodes[node].generation + 1;
+        nodes[node] = Node();
+        nodes[node].generation = generation;
+        nodes[node].parent = free_list;
+        free_list = node;
+    }
+    void InsertLeaf(Index leaf) {
+        if (root == NONE) {
+            root = leaf;
+            nodes[root].parent = NONE;
+            return;
+        }
+        // Descend towards the sibling whose union with the leaf costs least, stopping once pairing
+        // with the current node itself is cheaper than anything below it could be.
+        const auto bounds = nodes[leaf].bounds;
+        Index index = root;
+        while (nodes[index].height > 0) {
+            const auto& node = nodes[index];
+            double area = HalfArea(node.bounds);
+            double combined = HalfArea(Union(node.bounds, bounds));
+            double cost = 2 * combined;                 // Of a new parent for this node and the leaf
+            double inherited = 2 * (combined - area);   // Growth every ancestor pays below here
+            double child_cost[2];
+            for (int c = 0; c < 2; c += 1) {
+                const auto& child = nodes[node.child[c]];
+                double grown = HalfArea(Union(child.bounds, bounds));
+                child_cost[c] = (child.height == 0 ? grown : grown - HalfArea(child.bounds)) + inherited;
+            }
+            if (cost < child_cost[0] && cost < child_cost[1]) break;
+            index = node.child[child_cost[0] < child_cost[1] ? 0 : 1];
+        }
+        Index sibling = index;
+        Index old_parent = nodes[sibling].parent;
+        Index parent = Allocate();
+        nodes[parent].parent = old_parent;
+        nodes[parent].bounds = Union(bounds, nodes[sibling].bounds);
+        nodes[parent].height = nodes[sibling].height + 1;
+        nodes[parent].child[0] = sibling;
+        nodes[parent].child[1] = leaf;
+        nodes[sibling].parent = parent;
+        nodes[leaf].parent = parent;
+        if (old_parent == NONE) root = parent;
+        else nodes[old_parent].child[nodes[old_parent].child[0] == sibling ? 0 : 1] = parent;
+        Repair(nodes[leaf].parent);
+    }
+    void RemoveLeaf(Index leaf) {
+        if (leaf == root) {
+            root = NONE;
+            return;
+        }
+        Index parent = nodes[leaf].parent;
+        Index grandparent = nodes[parent].parent;
+        Index sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+        Free(parent);
+        nodes[leaf].parent = NONE;
+        if (grandparent == NONE) {
+            root = sibling;
+            nodes[sibling].parent = NONE;
+            return;
+        }
+        nodes[grandparent].child[nodes[grandparent].child[0] == parent ? 0 : 1] = sibling;
+        nodes[sibling].parent = grandparent;
+        Repair(grandparent);
+    }
+    // Rebalance and refit every node from index up to the root.
+    void Repair(Index index) {
+        while (index != NONE) {
+            index = Balance(index);
+            auto& node = nodes[index];
+            const auto& a = nodes[node.child[0]];
+            const auto& b = nodes[node.child[1]];
+            node.height = 1 + Max(a.height, b.height);
+            node.bounds = Union(a.bounds, b.bounds);
+            index = node.parent;
+        }
+    }
+    // If one child of a is more than one level taller than the other, rotate it up into a's place;
+    // its taller child stays below it, its shorter one moves under a. Returns the subtree's new root.
+    Index Balance(Index a) {
+        if (nodes[a].height < 2) return a;
+        for (int side = 0; side < 2; side += 1) {
+            Index c = nodes[a].child[side];        // Candidate to rise
+            Index b = nodes[a].child[1 - side];
+            if (nodes[c].height - nodes[b].height <= 1) continue;
+            Index f = nodes[c].child[0], g = nodes[c].child[1];
+            // c takes a's place
+            nodes[c].child[0] = a;
+            nodes[c].parent = nodes[a].parent;
+            nodes[a].parent = c;
+            if (nodes[c].parent == NONE) root = c;
+            else {
+                auto& above = nodes[nodes[c].parent];
+                above.child[above.child[0] == a ? 0 : 1] = c;
+            }
+            // The taller of c's children stays with c, the other replaces c under a
+            if (nodes[f].height < nodes[g].height) Swap(f, g);
+            nodes[c].child[1] = f;
+            nodes[a].child[side] = g;
+            nodes[g].parent = a;
+            nodes[a].bounds = Union(nodes[b].bounds, nodes[g].bounds);
+            nodes[a].height = 1 + Max(nodes[b].height, nodes[g].height);
+            nodes[c].bounds = Union(nodes[a].bounds, nodes[f].bounds);
+            nodes[c].height = 1 + Max(nodes[a].height, nodes[f].height);
+            return c;
+        }
+        return a;
+    }
+    static double HalfArea(const Bounds3& box) {
+        return box.x.size * box.y.size + box.y.size * box.z.size + box.z.size * box.x.size;
+    }
+};
+
+
+#endif // DYNAMICBVH_H
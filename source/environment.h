@@ -0,0 +1,102 @@
+#pragma once
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "global.h"
+#include "mathematics.h"
+#include "colour.h"
+#include "image.h"
+#include "distribution.h"
+
+// Infinitely distant light from an HDR latitude-longitude image (+y up, the same angles as a Sphere's
+// uv). Radiance is constant over each pixel, and an alias table over pixel luminance times the pixel's
+// solid angle lets the camera draw directions in proportion to the light they carry.
+class EnvironmentLight {
+public:
+    // Constructors
+    EnvironmentLight() = default;
+    EnvironmentLight(const std::string& filename, double _intensity = 1.0) : intensity(_intensity) {
+        auto imagedir = getenv("TEXTURE_IMAGES");
+        if (imagedir && Load(std::string(imagedir) + "/" + filename)) return;
+        if (Load(filename)) return;
+        if (Load("images/" + filename)) return;
+        if (Load("../images/" + filename)) return;
+        std::cerr << "ERROR: Could not load environment map '" << filename << "'.\n";
+    }
+    EnvironmentLight(const Colour& colour) : width(1), height(1), pixels{colour} { BuildDistribution(); }
+
+    // Methods
+    bool Load(const std::string& filename) {
+        int channels = 0;
+        float* data = stbi_loadf(filename.c_str(), &width, &height, &channels, 3);
+        if (data == nullptr) return false;
+        pixels.resize(size_t(width) * height);
+        for (size_t i = 0; i < pixels.size(); i += 1)
+            pixels[i] = Colour(data[3*i], data[3*i+1], data[3*i+2]);
+        stbi_image_free(data);
+        BuildDistribution();
+        return true;
+    }
+    bool Valid() const { return !pixels.empty(); }
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    // Radiance arriving from direction dir, travelling against it.
+    Colour Radiance(const Vector3& dir) const {
+        if (!Valid()) return Colour(0.0);
+        return pixels[Pixel(dir)] * intensity;
+    }
+    // Draw a unit direction towards the environment; pdf is with respect to solid angle.
+    Colour Sample(Vector3& dir, double& pdf) const {
+        if (!Valid()) { pdf = 0.0; return Colour(0.0); }
+        double pmf, u;
+        size_t i = table.Sample(RandomFloat(), pmf, u);
+        double x = (i % width + u) / width;
+        double y = (i / width + RandomFloat()) / height;
+        double theta = y * M_PI, phi = x * 2 * M_PI - M_PI;
+        double sin_theta = Sin(theta);
+        dir = Vector3(sin_theta * Cos(phi), Cos(theta), -sin_theta * Sin(phi));
+        pdf = sin_theta > 0 ? pmf * width * height / (2 * Sqr(M_PI) * sin_theta) : 0.0;
+        return pixels[i] * intensity;
+    }
+    double Pdf(const Vector3& dir) const {
+        if (!Valid()) return 0.0;
+        double sin_theta = Sqrt(Max(0.0, 1 - Sqr(dir.y) / Length2(dir)));
+        if (sin_theta <= 0) return 0.0;
+        return table.Pmf(Pixel(dir)) * width * height / (2 * Sqr(M_PI) * sin_theta);
+    }
+
+    // Members
+    double intensity = 1.0;
+
+private:
+    // Members
+    int width = 0, height = 0;
+    std::vector<Colour> pixels;
+    AliasTable table;
+
+    // Methods
+    size_t Pixel(const Vector3& dir) const {
+        auto d = Normalize(dir);
+        double u = (Atan2(-d.z, d.x) + M_PI) / (2 * M_PI);
+        double v = Acos(Max(-1.0, Min(d.y, 1.0))) / M_PI;
+        int x = Min(int(u * width), width - 1);
+        int y = Min(int(v * height), height - 1);
+        return size_t(y) * width + x;
+    }
+    // Rows near the poles cover less solid angle, so weight by sin θ at the row centre.
+    void BuildDistribution() {
+        std::vector<double> weights(pixels.size());
+        for (int y = 0; y < height; y += 1) {
+            double sin_theta = Sin(M_PI * (y + 0.5) / height);
+            for (int x = 0; x < width; x += 1) {
+                const auto& c = pixels[size_t(y) * width + x];
+                weights[size_t(y) * width + x] = Luminance(c) * sin_theta;
+            }
+        }
+        table = AliasTable(weights);
+    }
+};
+
+
+#endif // ENVIRONMENT_H
@@ -2,6 +2,7 @@
 #ifndef GLOBAL_H
 #define GLOBAL_H
 
+#include <atomic>
 #include <iostream>
 #include <cmath>
 #include <string>
@@ -54,13 +55,24 @@ template <typename T>
 inline T Max(T value1, T value2) { return std::max(value1, value2); }
 
 inline double RandomFloat(){
-    static std::random_device dev;
-    static std::mt19937 rng(dev());
-    static std::uniform_real_distribution<double> dist(0.f, 1.f); // distribution in range [0, 1]
+    // One generator per thread, so render threads neither race on nor serialise over shared state
+    static thread_local std::mt19937 rng(std::random_device{}());
+    static thread_local std::uniform_real_distribution<double> dist(0.f, 1.f); // distribution in range [0, 1)
     return dist(rng);
 }
 inline double RandomFloat(double a, double b) { return a + (b - a) * RandomFloat(); }
 inline double DegtoRad(double degrees) { return degrees * M_PI / 180.0; }
+// Add to an atomic double without a lock.
+inline void AtomicAdd(std::atomic<double>& target, double value) {
+    double current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+}
+// Finaliser of splitmix64, so the keys of neighbouring cells land far apart in a hash table.
+inline uint64_t Hash(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
 
 inline void ProgressBar(double progress) {
     int width = 80;
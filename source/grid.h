@@ -0,0 +1,294 @@
+#pragma once
+#ifndef GRID_H
+#define GRID_H
+
+#include <chrono>
+
+#include "global.h"
+#include "mathematics.h"
+#include "primitives.h"
+#include "camera.h"
+
+// Cells per primitive aimed for when sizing a grid, and for the coarser top of a two-level grid; a
+// grid's resolution along any axis, and its cells in all; the number of primitives above which a
+// top cell is cut again.
+constexpr double   GRID_DENSITY     = 4.0;
+constexpr double   GRID_TOP_DENSITY = 1.0;
+constexpr int      GRID_MAX_RES     = 256;
+constexpr int      GRID_MAX_CELLS   = 1 << 22;
+constexpr uint32_t GRID_SPLIT       = 4;
+// Thinnest a grid's box may be along any axis, as a share of its widest; flatter boxes are padded.
+constexpr double GRID_MIN_EXTENT = 1e-3;
+// A primitive wider than this many times the median width is tested by every ray instead of being
+// entered into cells, so a ground sphere does not stretch the grid over the whole horizon.
+constexpr double GRID_OUTLIER = 64.0;
+// Primitives a ray remembers having tested, so one spanning several cells is tested once.
+constexpr int GRID_MAILBOX = 16;
+
+// Uniform grid over the references of a PrimitiveStore, an alternative to the PrimitiveBVH for
+// scenes of many similar, evenly spread primitives. The resolution follows Cleary and Wyvill: the
+// scene's box is cut into about GRID_DENSITY cells per primitive, shaped like the box. With two
+// levels, the top grid is coarser and its crowded cells are cut again by a grid of their own, in the
+// manner of Kalojanov et al., "Two-Level Grids for Ray Tracing on GPUs" (2011). Rays walk the cells
+// they pass through in order with the 3D-DDA of Amanatides and Woo and stop at the first cell that
+// holds a hit, remembering recently tested primitives in a small mailbox carried on the stack. One
+// level suits evenly spread primitives best; two keep densely clustered ones from crowding cells.
+class PrimitiveGrid : public Shapes {
+public:
+    // Constructors
+    PrimitiveGrid(shared_ptr<PrimitiveStore> _store, bool two_level=true) : store(_store) {
+        const auto& store_refs = store->Refs();
+        refs.assign(store_refs.begin(), store_refs.end());
+        if (refs.empty()) return;
+        vector<Bounds3> ref_bounds(refs.size());
+        vector<double> widths(refs.size());
+        for (size_t i = 0; i < refs.size(); i += 1) {
+            ref_bounds[i] = store->BBox(refs[i]);
+            widths[i] = Max(ref_bounds[i].x.size, Max(ref_bounds[i].y.size, ref_bounds[i].z.size));
+        }
+        auto median = widths;
+        std::nth_element(median.begin(), median.begin() + median.size()/2, median.end());
+        double limit = GRID_OUTLIER * median[median.size()/2];
+
+        vector<uint32_t> members;
+        Bounds3 bounds = Bounds3::Empty;
+        for (uint32_t i = 0; i < refs.size(); i += 1) {
+            if (widths[i] > limit) { outliers.push_back(i); continue; }
+            members.push_back(i);
+            bounds = Union(bounds, ref_bounds[i]);
+        }
+        if (!members.empty())
+            Build(bounds, members, ref_bounds, two_level ? GRID_TOP_DENSITY : GRID_DENSITY, two_level);
+    }
+
+    // Methods
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        bool happened = false;
+        for (uint32_t i : outliers) {
+            if (store->Intersect(refs[i], ray, ray_time, isect)) {
+                happened = true;
+                ray_time._max = isect.time;
+            }
+        }
+        if (levels.empty()) return happened;
+        auto inv_dir = Vector3(1.0/ray.dir.x, 1.0/ray.dir.y, 1.0/ray.dir.z);
+        Mailbox mailbox;
+        return Traverse(0, ray, inv_dir, ray_time, isect, mailbox) || happened;
+    }
+    Bounds3 BBox() const override {
+        Bounds3 bounds = levels.empty() ? Bounds3::Empty : levels[0].bounds;
+        for (uint32_t i : outliers) bounds = Union(bounds, store->BBox(refs[i]));
+        return bounds;
+    }
+    size_t Cells() const { return cells.size(); }
+
+private:
+    // Members
+    struct Level {
+        Bounds3  bounds;
+        int      res[3];
+        Vector3  cell, inv_cell;    // Edge of a cell and its reciprocal
+        uint32_t first_cell;
+    };
+    struct Cell {
+        uint32_t first = 0;         // Into items
+        uint32_t count = 0;
+        uint32_t level = 0;         // Grid covering this cell; zero, the top level, for none
+    };
+    struct Mailbox {
+        uint32_t tested[GRID_MAILBOX];
+        Mailbox() { std::fill(tested, tested + GRID_MAILBOX, UINT32_MAX); }
+        // Whether the item was tested already, marking it as tested if not.
+        bool Seen(uint32_t item) {
+            auto& slot = tested[item % GRID_MAILBOX];
+            if (slot == item) return true;
+            slot = item;
+            return false;
+        }
+    };
+    shared_ptr<PrimitiveStore> store;
+    vector<PrimRef> refs;
+    vector<Level> levels;
+    vector<Cell> cells;
+    vector<uint32_t> items;         // Indices into refs, cell by cell
+    vector<uint32_t> outliers;
+
+    // Methods
+    uint32_t Build(const Bounds3& bounds, const vector<uint32_t>& members, const vector<Bounds3>& ref_bounds,
+                   double density, bool nested) {
+        uint32_t index = levels.size();
+        Level level;
+        level.bounds = bounds;
+        // Zero-width cells would turn every lookup into 0·inf, so pad flat axes about their middle
+        double widest = Max(Max(bounds.x.size, bounds.y.size), bounds.z.size);
+        double thinnest = Max(widest * GRID_MIN_EXTENT, EPS_UNIT);
+        double extent[3];
+        for (int axis = 0; axis < 3; axis += 1) {
+            auto span = bounds[axis];
+            if (!(span.size >= thinnest)) {
+                double middle = span.size >= 0 ? 0.5 * (span._min + span._max) : 0.0;
+                level.bounds[axis] = Interval(middle - 0.5 * thinnest, middle + 0.5 * thinnest);
+            }
+            extent[axis] = level.bounds[axis].size;
+        }
+        // Cleary and Wyvill's scale, backed off until rounding up thin axes no longer multiplies the
+        // cells well past the density aimed for
+        double volume = extent[0] * extent[1] * extent[2];
+        double scale = std::cbrt(density * members.size() / volume);
+        double limit = Min(double(GRID_MAX_CELLS), Max(2 * density * members.size(), 1.0));
+        int total;
+        while (true) {
+            total = 1;
+            for (int axis = 0; axis < 3; axis += 1) {
+                level.res[axis] = Min(Max(int(extent[axis] * scale), 1), GRID_MAX_RES);
+                total *= level.res[axis];
+            }
+            if (total <= limit) break;
+            scale *= 0.9;
+        }
+        for (int axis = 0; axis < 3; axis += 1) {
+            level.cell[axis] = extent[axis] / level.res[axis];
+            level.inv_cell[axis] = 1.0 / level.cell[axis];
+        }
+        level.first_cell = cells.size();
+        levels.push_back(level);
+        cells.resize(cells.size() + total);
+
+        // Count, then bin each primitive into every cell its box touches
+        vector<uint32_t> start(total + 1, 0);
+        auto span = [&](uint32_t i, int lo[3], int hi[3]) {
+            for (int axis = 0; axis < 3; axis += 1) {
+                lo[axis] = CellOf(level, axis, ref_bounds[i][axis]._min);
+                hi[axis] = CellOf(level, axis, ref_bounds[i][axis]._max);
+            }
+        };
+        for (uint32_t i : members) {
+            int lo[3], hi[3];
+            span(i, lo, hi);
+            for (int z = lo[2]; z <= hi[2]; z += 1)
+                for (int y = lo[1]; y <= hi[1]; y += 1)
+                    for (int x = lo[0]; x <= hi[0]; x += 1) start[Flatten(level, x, y, z) + 1] += 1;
+        }
+        for (int c = 0; c < total; c += 1) start[c+1] += start[c];
+        vector<uint32_t> binned(start[total]);
+        vector<uint32_t> filled(start.begin(), start.end() - 1);
+        for (uint32_t i : members) {
+            int lo[3], hi[3];
+            span(i, lo, hi);
+            for (int z = lo[2]; z <= hi[2]; z += 1)
+                for (int y = lo[1]; y <= hi[1]; y += 1)
+                    for (int x = lo[0]; x <= hi[0]; x += 1) binned[filled[Flatten(level, x, y, z)]++] = i;
+        }
+
+        for (int c = 0; c < total; c += 1) {
+            uint32_t count = start[c+1] - start[c];
+            if (nested && count > GRID_SPLIT) {
+                int x = c % level.res[0], y = (c / level.res[0]) % level.res[1], z = c / (level.res[0] * level.res[1]);
+                auto lo = Point3(level.bounds.x._min + x * level.cell.x, level.bounds.y._min + y * level.cell.y, 
+                                 level.bounds.z._min + z * level.cell.z);
+                vector<uint32_t> crowd(binned.begin() + start[c], binned.begin() + start[c+1]);
+                uint32_t child = Build(Bounds3(lo, lo + level.cell), crowd, ref_bounds, GRID_DENSITY, false);
+                cells[level.first_cell + c].level = child;
+                continue;
+            }
+            cells[level.first_cell + c].first = items.size();
+            cells[level.first_cell + c].count = count;
+            items.insert(items.end(), binned.begin() + start[c], binned.begin() + start[c+1]);
+        }
+        return index;
+    }
+    static int CellOf(const Level& level, int axis, double x) {
+        int cell = int(std::floor((x - level.bounds[axis]._min) * level.inv_cell[axis]));
+        return Min(Max(cell, 0), level.res[axis] - 1);
+    }
+    static int Flatten(const Level& level, int x, int y, int z) { return (z * level.res[1] + y) * level.res[0] + x; }
+    // Walk the cells of one level along the ray, descending into nested grids.
+    bool Traverse(uint32_t index, const Ray& ray, const Vector3& inv_dir, Interval& ray_time,
+                  Intersection& isect, Mailbox& mailbox) const {
+        const Level& level = levels[index];
+        double t_enter = ray_time._min, t_leave = ray_time._max;
+        for (int axis = 0; axis < 3; axis += 1) {
+            double t0 = (level.bounds[axis]._min - ray.org[axis]) * inv_dir[axis];
+            double t1 = (level.bounds[axis]._max - ray.org[axis]) * inv_dir[axis];
+            if (t0 > t1) Swap(t0, t1);
+            t_enter = t0 > t_enter ? t0 : t_enter;
+            t_leave = t1 < t_leave ? t1 : t_leave;
+        }
+        if (t_enter > t_leave) return false;
+
+        int cell[3], step[3], stop[3];
+        double t_next[3], t_delta[3];
+        auto entry = ray(t_enter);
+        for (int axis = 0; axis < 3; axis += 1) {
+            cell[axis] = CellOf(level, axis, entry[axis]);
+            double lower = level.bounds[axis]._min + cell[axis] * level.cell[axis];
+            if (ray.dir[axis] > 0) {
+                step[axis] = 1; stop[axis] = level.res[axis];
+                t_next[axis] = (lower + level.cell[axis] - ray.org[axis]) * inv_dir[axis];
+                t_delta[axis] = level.cell[axis] * inv_dir[axis];
+            } else if (ray.dir[axis] < 0) {
+                step[axis] = -1; stop[axis] = -1;
+                t_next[axis] = (lower - ray.org[axis]) * inv_dir[axis];
+                t_delta[axis] = -level.cell[axis] * inv_dir[axis];
+            } else {
+                step[axis] = 0; stop[axis] = -1;
+                t_next[axis] = POS_INF;
+                t_delta[axis] = POS_INF;
+            }
+        }
+        bool happened = false;
+        while (true) {
+            const Cell& current = cells[level.first_cell + Flatten(level, cell[0], cell[1], cell[2])];
+            if (current.level != 0) {
+                happened |= Traverse(current.level, ray, inv_dir, ray_time, isect, mailbox);
+            } else {
+                for (uint32_t k = current.first; k < current.first + current.count; k += 1) {
+                    uint32_t i = items[k];
+                    if (mailbox.Seen(i)) continue;
+                    if (store->Intersect(refs[i], ray, ray_time, isect)) {
+                        happened = true;
+                        ray_time._max = isect.time;
+                    }
+                }
+            }
+            // A hit inside this cell is nearer than anything the cells beyond could hold
+            int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            if (ray_time._max <= t_next[axis] || t_next[axis] > t_leave) break;
+            cell[axis] += step[axis];
+            if (cell[axis] == stop[axis]) break;
+            t_next[axis] += t_delta[axis];
+        }
+        return happened;
+    }
+};
+
+// Render a small preview of the scene through a PrimitiveBVH and through one- and two-level
+// PrimitiveGrids over the same store, and return whichever renders it fastest. Every candidate
+// renders once untimed to warm the caches, then twice more, once in each order, keeping its best.
+inline shared_ptr<Shapes> FastestAccelerator(shared_ptr<PrimitiveBVH> bvh, Camera camera) {
+    camera.image_width   = Min(camera.image_width, 128);
+    camera.sample_ppixel = 4;
+    camera.guiding = camera.radiance_cache = camera.caustics = false;
+    vector<shared_ptr<Shapes>> candidates = { bvh, make_shared<PrimitiveGrid>(bvh->SharedStore(), false),
+                                              make_shared<PrimitiveGrid>(bvh->SharedStore(), true) };
+    const char* names[] = { "BVH", "Grid", "Two-Level Grid" };
+    const size_t n = candidates.size();
+    for (const auto& candidate : candidates) camera.RenderFrame(*candidate);
+    vector<double> best(n, POS_INF);
+    for (size_t k = 0; k < 2 * n; k += 1) {
+        size_t i = k < n ? k : 2 * n - 1 - k;
+        auto start = std::chrono::steady_clock::now();
+        camera.RenderFrame(*candidates[i]);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best[i] = Min(best[i], seconds);
+    }
+    size_t fastest = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        std::clog << "Benchmark: " << names[i] << " took " << best[i] << "s. \n";
+        if (best[i] < best[fastest]) fastest = i;
+    }
+    std::clog << "Using " << names[fastest] << ". \n";
+    return candidates[fastest];
+}
+
+#endif // GRID_H
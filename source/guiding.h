@@ -0,0 +1,246 @@
+#pragma once
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include <atomic>
+
+#include "global.h"
+#include "mathematics.h"
+#include "bounds.h"
+#include "colour.h"
+#include "scene.h"
+
+// Leaves of the spatial tree split once they have seen GUIDE_SPLIT · sqrt(2^pass) samples, and a
+// direction cell is refined while it carries more than GUIDE_FLUX of its tree's energy.
+constexpr double GUIDE_SPLIT = 12000;
+constexpr double GUIDE_FLUX  = 0.01;
+constexpr int    GUIDE_DEPTH = 20;
+
+// Distribution over the sphere of directions as a quadtree on the square [0,1]^2, mapped to the
+// sphere by the equal-area cylindrical map (cos θ, φ), so a cell's area in the square is its solid
+// angle divided by 4π. Every node holds the energy of its four quadrants.
+class DirectionTree {
+public:
+    // Constructors
+    DirectionTree() : nodes(1) {}
+    DirectionTree(const DirectionTree& other) : nodes(other.nodes.size()), total(other.total) {
+        for (size_t i = 0; i < nodes.size(); i += 1) nodes[i] = other.nodes[i];
+    }
+    DirectionTree& operator=(const DirectionTree& other) {
+        nodes.resize(other.nodes.size());
+        for (size_t i = 0; i < nodes.size(); i += 1) nodes[i] = other.nodes[i];
+        total = other.total;
+        return *this;
+    }
+
+    // Methods
+    bool Empty() const { return !(total > 0); }
+    size_t Size() const { return nodes.size(); }
+    // Splat an estimate of the energy arriving along dir. Safe to call from many threads at once.
+    void Record(const Vector3& dir, double value) {
+        if (!(value > 0) || !std::isfinite(value)) return;
+        double x, y;
+        ToSquare(dir, x, y);
+        uint32_t index = 0;
+        while (true) {
+            int q = Quadrant(x, y);
+            AtomicAdd(nodes[index].sum[q], value);
+            if (nodes[index].child[q] == 0) return;
+            index = nodes[index].child[q];
+        }
+    }
+    Vector3 Sample() const {
+        double x = 0, y = 0, size = 1;
+        uint32_t index = 0;
+        while (true) {
+            const auto& node = nodes[index];
+            double sums[4];
+            double node_total = 0;
+            for (int q = 0; q < 4; q += 1) node_total += (sums[q] = node.sum[q].load(std::memory_order_relaxed));
+            int q = 0;
+            double u = RandomFloat() * node_total;
+            while (q < 3 && u >= sums[q]) { u -= sums[q]; q += 1; }
+            size /= 2;
+            x += (q & 1) * size;
+            y += (q >> 1) * size;
+            if (node.child[q] == 0) break;
+            index = node.child[q];
+        }
+        return FromSquare(x + RandomFloat() * size, y + RandomFloat() * size);
+    }
+    // Density with respect to solid angle.
+    double Pdf(const Vector3& dir) const {
+        if (Empty()) return 0.0;
+        double x, y;
+        ToSquare(dir, x, y);
+        double pdf = 1.0 / (4 * M_PI);
+        uint32_t index = 0;
+        while (true) {
+            const auto& node = nodes[index];
+            double node_total = 0;
+            for (int q = 0; q < 4; q += 1) node_total += node.sum[q].load(std::memory_order_relaxed);
+            int q = Quadrant(x, y);
+            double sum = node.sum[q].load(std::memory_order_relaxed);
+            if (!(sum > 0)) return 0.0;
+            pdf *= 4 * sum / node_total;
+            if (node.child[q] == 0) return pdf;
+            index = node.child[q];
+        }
+    }
+    // Totals per quadrant are already cumulative, so the root holds the whole energy.
+    void Finish() {
+        total = 0;
+        for (int q = 0; q < 4; q += 1) total += nodes[0].sum[q].load();
+    }
+    // Same layout with the energy spread as evenly; lets a freshly split spatial leaf keep guiding.
+    void Halve() {
+        for (auto& node : nodes)
+            for (auto& sum : node.sum) sum.store(sum.load() / 2);
+        total /= 2;
+    }
+    // New empty tree for the next pass, subdivided where this one saw more than GUIDE_FLUX of the
+    // energy and collapsed where it saw less.
+    DirectionTree Refine() const {
+        DirectionTree refined;
+        if (Empty()) return refined;
+        Refine(refined, 0, 0, total, 1);
+        return refined;
+    }
+
+private:
+    // Members
+    struct Node {
+        std::atomic<double> sum[4] = {};
+        uint32_t child[4] = {0, 0, 0, 0};   // Zero for leaves; the root is never anyone's child
+
+        Node() = default;
+        Node(const Node& other) { *this = other; }
+        Node& operator=(const Node& other) {
+            for (int q = 0; q < 4; q += 1) {
+                sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                child[q] = other.child[q];
+            }
+            return *this;
+        }
+    };
+    vector<Node> nodes;
+    double total = 0.0;
+
+    // Methods
+    // Recurse with the energy of the old node, or of its parent's quadrant spread evenly once the
+    // old tree has no deeper node.
+    void Refine(DirectionTree& refined, uint32_t target, uint32_t source, double energy, int depth) const {
+        for (int q = 0; q < 4; q += 1) {
+            bool exists = source != UINT32_MAX;
+            double quadrant = exists ? nodes[source].sum[q].load() : energy / 4;
+            if (depth >= GUIDE_DEPTH || quadrant <= GUIDE_FLUX * total) continue;
+            uint32_t child = refined.nodes.size();
+            refined.nodes.emplace_back();
+            refined.nodes[target].child[q] = child;
+            uint32_t next = (exists && nodes[source].child[q] != 0) ? nodes[source].child[q] : UINT32_MAX;
+            Refine(refined, child, next, quadrant, depth + 1);
+        }
+    }
+    // Pick the quadrant holding (x, y) and rescale the point into it.
+    static int Quadrant(double& x, double& y) {
+        int qx = x >= 0.5, qy = y >= 0.5;
+        x = 2 * x - qx;
+        y = 2 * y - qy;
+        return qx + 2 * qy;
+    }
+    static void ToSquare(const Vector3& dir, double& x, double& y) {
+        auto d = Normalize(dir);
+        x = Min(Max((d.z + 1) / 2, 0.0), 1 - EPS_QUAT);
+        y = Atan2(d.y, d.x) / (2 * M_PI);
+        if (y < 0) y += 1;
+        y = Min(Max(y, 0.0), 1 - EPS_QUAT);
+    }
+    static Vector3 FromSquare(double x, double y) {
+        double cos_theta = 2 * x - 1;
+        double sin_theta = Sqrt(Max(0.0, 1 - Sqr(cos_theta)));
+        double φ = 2 * M_PI * y;
+        return Vector3(sin_theta * Cos(φ), sin_theta * Sin(φ), cos_theta);
+    }
+};
+
+// Spatial-directional tree of Müller et al., "Practical Path Guiding for Efficient Light-Transport
+// Simulation" (2017). A kd-tree halves the scene bounds along alternating axes; each leaf pairs the
+// direction distribution learned in the previous pass, used for sampling, with one collecting
+// radiance in the current pass. Recording is lock-free, so every render thread trains it at once.
+class GuidingField {
+public:
+    // Constructors
+    GuidingField(const Bounds3& _bounds) : bounds(_bounds), nodes(1), leaves(1) {}
+
+    // Methods
+    size_t Leaves() const { return leaves.size(); }
+    uint32_t Leaf(const Point3& p) const {
+        double lo[3] = {bounds.x._min, bounds.y._min, bounds.z._min};
+        double hi[3] = {bounds.x._max, bounds.y._max, bounds.z._max};
+        uint32_t index = 0;
+        while (nodes[index].leaf == UINT32_MAX) {
+            int axis = nodes[index].axis;
+            double middle = (lo[axis] + hi[axis]) / 2;
+            if (p[axis] < middle) { hi[axis] = middle; index = nodes[index].child; }
+            else                  { lo[axis] = middle; index = nodes[index].child + 1; }
+        }
+        return nodes[index].leaf;
+    }
+    // Distribution to sample from, empty until its region has been trained.
+    const DirectionTree& Distribution(uint32_t leaf) const { return leaves[leaf].sampling; }
+    void Record(uint32_t leaf, const Vector3& dir, double value) {
+        leaves[leaf].samples.fetch_add(1, std::memory_order_relaxed);
+        leaves[leaf].building.Record(dir, value);
+    }
+    // End of a training pass, no recording may run concurrently. Split busy regions, then swap what
+    // was learned in for sampling and start collecting afresh.
+    void Refine(int pass) {
+        double threshold = GUIDE_SPLIT * Sqrt(std::pow(2.0, pass));
+        for (auto& leaf : leaves) leaf.building.Finish();
+        for (uint32_t index = 0; index < nodes.size(); index += 1) Split(index, threshold);
+        for (auto& leaf : leaves) {
+            leaf.sampling = leaf.building;
+            leaf.building = leaf.building.Refine();
+            leaf.samples = 0;
+        }
+    }
+
+private:
+    // Members
+    struct Node {
+        uint32_t child = 0;             // First of two children, the second follows
+        uint32_t leaf = 0;              // Index into leaves, UINT32_MAX for interior nodes
+        int axis = 0;                   // Split axis, cycling with depth
+    };
+    struct Region {
+        DirectionTree sampling, building;
+        std::atomic<uint64_t> samples{0};
+
+        Region() = default;
+        Region(const Region& other) : sampling(other.sampling), building(other.building), samples(other.samples.load()) {}
+    };
+    Bounds3 bounds;
+    vector<Node> nodes;
+    vector<Region> leaves;
+
+    // Methods
+    // Halve a leaf that saw too many samples; nodes appended here are visited by the caller's loop,
+    // so busy regions split as often as they need within one pass.
+    void Split(uint32_t index, double threshold) {
+        if (nodes[index].leaf == UINT32_MAX) return;
+        uint32_t leaf = nodes[index].leaf;
+        if (leaves[leaf].samples.load() < threshold) return;
+        leaves[leaf].building.Halve();
+        leaves[leaf].samples = leaves[leaf].samples.load() / 2;
+        Region copy = leaves[leaf];
+        leaves.push_back(copy);
+        uint32_t child = nodes.size();
+        int axis = nodes[index].axis;
+        nodes.push_back(Node{0, leaf, (axis + 1) % 3});
+        nodes.push_back(Node{0, uint32_t(leaves.size() - 1), (axis + 1) % 3});
+        nodes[index] = Node{child, UINT32_MAX, axis};
+    }
+};
+
+
+#endif // GUIDING_H
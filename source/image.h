@@ -12,9 +12,40 @@
 #include "../external/stb_image.h"
 #include "global.h"
 #include "mathematics.h"
+#include "mappedfile.h"
 
+#include <array>
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <vector>
+
+// Texels are stored in square tiles of 2^TEXTURE_TILE_LOG texels on a side, in Morton order within
+// each tile, so a bilinear footprint almost always falls on one or two cache lines. Tiles are also
+// the unit of eviction when textures share a memory budget.
+constexpr int TEXTURE_TILE_LOG = 5;
+constexpr int TEXTURE_TILE     = 1 << TEXTURE_TILE_LOG;
+constexpr int TEXEL_BYTES      = 3;
+constexpr size_t TILE_BYTES    = TEXTURE_TILE * TEXTURE_TILE * TEXEL_BYTES;
+
+// Pre-converted textures (.rttex) hold the whole pyramid as written by texconv: this header, the
+// level table, then every tile in memory order from the first page boundary on. Each tile starts a
+// page and is padded to tile_stride bytes, so evicting one hands back its own pages and no neighbour's.
+constexpr uint32_t TEXTURE_FILE_VERSION = 2;
+
+struct TextureFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t levels;
+    uint32_t tile_log, texel_bytes;
+    uint64_t tiles;
+    uint64_t data_offset;
+    uint64_t tile_stride;       // TILE_BYTES rounded up to the page size of the converting machine
+};
 
 class Image {
 public:
@@ -31,53 +62,276 @@ public:
 
         std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
     }
-    // Destructor
-    ~Image() {
-        delete[] b_data;
-        STBI_FREE(f_data);
-    }
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
 
     // Methods
+    // Map the converted file beside the image if it is up to date, otherwise keep the 8-bit 
+    // gamma-encoded texels as decoded and build the mip pyramid from them.
     bool Load(const std::string& _filename) {
-        auto origin_bpp = bytes_per_pixel;   // Dummy out parameter: original components per pixel
-        f_data = stbi_loadf(_filename.c_str(), &image_width, &image_height, &origin_bpp, bytes_per_pixel);
-        if (f_data == nullptr) return false;
-        bytes_per_scanline = image_width * bytes_per_pixel;
-
-        uint32_t total_bytes = image_width * image_height * bytes_per_pixel;
-        b_data = new unsigned char[total_bytes];
-        auto* b_ptr = b_data;
-        auto* f_ptr = f_data;
-        for (int i = 0; i < total_bytes; i+=1, b_ptr+=1, f_ptr+=1)
-            *b_ptr = FloattoByte(*f_ptr);
+        if (LoadConverted(_filename)) return true;
+        int width = 0, height = 0, origin_bpp = 0;
+        auto* data = stbi_load(_filename.c_str(), &width, &height, &origin_bpp, TEXEL_BYTES);
+        if (data == nullptr) return false;
+        Build(data, width, height);
+        stbi_image_free(data);
+        path = _filename;
         return true;
     }
-    const unsigned char* PixelData(int x, int y) const { 
+    // Encoded texel of the finest resident level.
+    const unsigned char* PixelData(int x, int y) const {
         static unsigned char magenta[] = { 255, 0, 255 };
-        if (b_data == nullptr) return magenta;
-        x = Interval(0, image_width -1).Clamp(x);
-        y = Interval(0, image_height-1).Clamp(y);
-        return b_data + bytes_per_scanline * y + bytes_per_pixel * x;
+        if (levels.empty()) return magenta;
+        return TexelData(0, x, y);
+    }
+    int Width()  const { return levels.empty() ? 0 : levels[0].width; }
+    int Height() const { return levels.empty() ? 0 : levels[0].height; }
+    int Levels() const { return levels.size(); }
+    // False while a TextureManager is still decoding the image in the background.
+    bool Ready() const { return ready.load(std::memory_order_acquire); }
+    void Wait() const { if (!Ready()) loaded.wait(); }
+    // Linear colour of a texel, clamped to the edges of its level.
+    Colour Texel(int level, int x, int y) const {
+        const auto* texel = TexelData(level, x, y);
+        const auto& decode = DecodeTable();
+        return Colour(decode[texel[0]], decode[texel[1]], decode[texel[2]]);
+    }
+    // Bilinear lookup at (u, v) in [0,1]^2, v pointing down the image.
+    Colour Bilinear(int level, double u, double v) const {
+        const auto& mip = levels[level];
+        auto x = u * mip.width - 0.5, y = v * mip.height - 0.5;
+        auto x0 = std::floor(x), y0 = std::floor(y);
+        auto fx = x - x0, fy = y - y0;
+        int ix = int(x0), iy = int(y0);
+        return (1-fy) * ((1-fx) * Texel(level, ix, iy)   + fx * Texel(level, ix+1, iy))
+             +    fy  * ((1-fx) * Texel(level, ix, iy+1) + fx * Texel(level, ix+1, iy+1));
+    }
+    // Blend the two levels whose texel size brackets a footprint given as a fraction of the image.
+    Colour Trilinear(double u, double v, double footprint) const {
+        auto lod = std::log2(Max(footprint * Max(Width(), Height()), 1.0));
+        int level = int(lod);
+        if (level >= Levels() - 1) return Bilinear(Levels() - 1, u, v);
+        auto blend = lod - level;
+        if (blend == 0) return Bilinear(level, u, v);
+        return (1-blend) * Bilinear(level, u, v) + blend * Bilinear(level + 1, u, v);
+    }
+    size_t ResidentBytes() const {
+        size_t resident = 0;
+        for (const auto* tile : tiles) resident += tile != nullptr ? TileFootprint() : 0;
+        return resident;
+    }
+    // Memory a resident tile holds: its whole page-aligned slot when mapped.
+    size_t TileFootprint() const { return mapping != nullptr ? stride : TILE_BYTES; }
+    bool Mapped() const { return mapping != nullptr; }
+    // Write the pyramid in the pre-converted format, which must be fully resident.
+    bool Save(const std::string& filename) const {
+        TextureFileHeader header = {};
+        std::memcpy(header.magic, "RTTEX", 6);
+        header.version = TEXTURE_FILE_VERSION;
+        header.levels = levels.size();
+        header.tile_log = TEXTURE_TILE_LOG;
+        header.texel_bytes = TEXEL_BYTES;
+        header.tiles = tiles.size();
+        size_t page = MappedFile::PageSize();
+        header.data_offset = (sizeof(header) + levels.size() * sizeof(Level) + page - 1) / page * page;
+        header.tile_stride = (TILE_BYTES + page - 1) / page * page;
+        std::ofstream file(filename, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(levels.data()), levels.size() * sizeof(Level));
+        std::vector<char> padding(header.tile_stride - TILE_BYTES, 0);
+        file.seekp(header.data_offset);
+        for (const auto* tile : tiles) {
+            if (tile == nullptr) return false;
+            file.write(reinterpret_cast<const char*>(tile), TILE_BYTES);
+            file.write(padding.data(), padding.size());
+        }
+        return bool(file);
+    }
+    // Name of the converted file that stands in for an image, e.g. earthmap.jpg -> earthmap.rttex.
+    static std::string ConvertedPath(const std::string& filename) {
+        return std::filesystem::path(filename).replace_extension(".rttex").string();
     }
-    int Width()  const { return (f_data==nullptr) ? 0 : image_width; }
-    int Height() const { return (f_data==nullptr) ? 0 : image_height; }
+
+    // Lookups stamp tiles with the current epoch, advanced by TextureManager at frame boundaries
+    static inline std::atomic<uint32_t> epoch{1};
 
 private:
     // Members
-    const int      bytes_per_pixel = 3;
-    float*         f_data = nullptr;    // Linear floating point pixel data
-    unsigned char* b_data = nullptr;    // Linear 8-bit pixel data
-    int            image_width = 0;
-    int            image_height = 0;
-    int            bytes_per_scanline = 0;
+    struct Level {
+        int width, height;
+        int tiles_x, tiles_y;
+        size_t first_tile;
+    };
+    std::vector<Level> levels;
+    std::vector<const unsigned char*> tiles;                // Every level, null where evicted
+    std::vector<std::unique_ptr<unsigned char[]>> owned;    // Decoded tiles, empty when mapped
+    shared_ptr<MappedFile> mapping;                         // Converted file the tiles point into
+    size_t stride = TILE_BYTES;                             // Between mapped tiles
+    std::unique_ptr<std::atomic<uint32_t>[]> stamps;        // Epoch of each tile's last lookup
+    std::string path;                                       // Source file
+    std::atomic<bool> ready{true};
+    std::shared_future<void> loaded;
+
+    friend class TextureManager;
 
     // Methods
-    static unsigned char FloattoByte(double _value) {
+    void Build(const unsigned char* data, int width, int height) {
+        levels.clear();
+        size_t total = 0;
+        for (int w = width, h = height; ; w = Max(w/2, 1), h = Max(h/2, 1)) {
+            int tiles_x = (w + TEXTURE_TILE - 1) / TEXTURE_TILE, tiles_y = (h + TEXTURE_TILE - 1) / TEXTURE_TILE;
+            levels.push_back(Level{w, h, tiles_x, tiles_y, total});
+            total += size_t(tiles_x) * tiles_y;
+            if (w == 1 && h == 1) break;
+        }
+        mapping = nullptr;
+        owned.resize(total);
+        tiles.resize(total);
+        for (size_t t = 0; t < total; t += 1) {
+            owned[t].reset(new unsigned char[TILE_BYTES]());
+            tiles[t] = owned[t].get();
+        }
+        ResetStamps();
+        for (int y = 0; y < height; y += 1)
+            for (int x = 0; x < width; x += 1)
+                std::copy_n(data + (size_t(y) * width + x) * TEXEL_BYTES, TEXEL_BYTES, MutableTexel(0, x, y));
+        // Each level is a 2x2 box filter of the one above, averaged in linear space
+        const auto& decode = DecodeTable();
+        for (int l = 1; l < Levels(); l += 1) {
+            #pragma omp parallel for
+            for (int y = 0; y < levels[l].height; y += 1) {
+                for (int x = 0; x < levels[l].width; x += 1) {
+                    for (int c = 0; c < TEXEL_BYTES; c += 1) {
+                        double sum = decode[MutableTexel(l-1, 2*x, 2*y)[c]]   + decode[MutableTexel(l-1, 2*x+1, 2*y)[c]]
+                                   + decode[MutableTexel(l-1, 2*x, 2*y+1)[c]] + decode[MutableTexel(l-1, 2*x+1, 2*y+1)[c]];
+                        MutableTexel(l, x, y)[c] = Encode(sum / 4);
+                    }
+                }
+            }
+        }
+    }
+    bool LoadConverted(const std::string& filename) {
+        namespace fs = std::filesystem;
+        auto converted = ConvertedPath(filename);
+        std::error_code error;
+        if (converted == filename || !fs::is_regular_file(converted, error) ||
+            (fs::exists(filename, error) && fs::last_write_time(converted, error) < fs::last_write_time(filename, error)))
+            return false;
+        if (!Map(converted)) return false;
+        path = filename;
+        return true;
+    }
+    bool Map(const std::string& converted) {
+        auto file = make_shared<MappedFile>();
+        if (!file->Open(converted)) return false;
+        TextureFileHeader header;
+        if (file->Size() < sizeof(header)) return false;
+        std::memcpy(&header, file->Data(), sizeof(header));
+        // Tiles laid out for smaller pages than ours would share pages, so such files are decoded afresh
+        size_t page = MappedFile::PageSize();
+        if (std::memcmp(header.magic, "RTTEX", 6) != 0 || header.version != TEXTURE_FILE_VERSION ||
+            header.tile_log != TEXTURE_TILE_LOG || header.texel_bytes != TEXEL_BYTES || header.levels == 0 ||
+            sizeof(header) + header.levels * sizeof(Level) > header.data_offset ||
+            header.tile_stride < TILE_BYTES || header.tile_stride % page != 0 || header.data_offset % page != 0 ||
+            header.data_offset > file->Size() ||
+            header.tiles > (file->Size() - header.data_offset) / header.tile_stride)
+            return false;
+        std::vector<Level> table(header.levels);
+        std::memcpy(table.data(), file->Data() + sizeof(header), header.levels * sizeof(Level));
+        // Every level must halve the one before and take its tiles right after it, or TileOf would index
+        // past the tiles of a damaged file
+        size_t total = 0;
+        for (size_t l = 0; l < table.size(); l += 1) {
+            const auto& level = table[l];
+            bool halved = l == 0 ? level.width > 0 && level.height > 0 :
+                level.width == Max(table[l-1].width / 2, 1) && level.height == Max(table[l-1].height / 2, 1);
+            if (!halved || level.first_tile != total ||
+                level.tiles_x != level.width / TEXTURE_TILE + (level.width % TEXTURE_TILE != 0) ||
+                level.tiles_y != level.height / TEXTURE_TILE + (level.height % TEXTURE_TILE != 0))
+                return false;
+            total += size_t(level.tiles_x) * level.tiles_y;
+        }
+        const auto& last = table.back();
+        if (last.width != 1 || last.height != 1 || total != header.tiles) return false;
+        levels = std::move(table);
+        mapping = file;
+        stride = header.tile_stride;
+        owned.clear();
+        tiles.resize(header.tiles);
+        for (size_t t = 0; t < tiles.size(); t += 1)
+            tiles[t] = reinterpret_cast<const unsigned char*>(mapping->Data() + header.data_offset + t * stride);
+        ResetStamps();
+        return true;
+    }
+    void ResetStamps() {
+        stamps.reset(new std::atomic<uint32_t>[tiles.size()]);
+        for (size_t t = 0; t < tiles.size(); t += 1) stamps[t].store(0, std::memory_order_relaxed);
+    }
+    // Swap a decoded pyramid for a converted copy of it written to filename, so its tiles can be
+    // evicted and restored without decoding the source again. The file is unlinked once mapped.
+    bool Spill(const std::string& filename) {
+        if (mapping != nullptr) return true;
+        bool mapped = Save(filename) && Map(filename);
+        std::remove(filename.c_str());
+        return mapped;
+    }
+    // Drop a tile of a mapped image, handing its pages back to the kernel.
+    void Evict(size_t tile) {
+        size_t offset = reinterpret_cast<const char*>(tiles[tile]) - mapping->Data();
+        mapping->Advise(offset, TILE_BYTES, MADV_DONTNEED);
+        tiles[tile] = nullptr;
+    }
+    // Restore the given evicted tiles of a mapped image.
+    void Reload(const std::vector<size_t>& wanted) {
+        auto header = reinterpret_cast<const TextureFileHeader*>(mapping->Data());
+        for (size_t t : wanted)
+            tiles[t] = reinterpret_cast<const unsigned char*>(mapping->Data() + header->data_offset + t * stride);
+    }
+    // Levels made of one tile are never evicted, so the coarsest level always ends the fallback.
+    bool Pinned(int level) const { return levels[level].tiles_x * levels[level].tiles_y == 1; }
+    size_t TileOf(int level, int x, int y) const {
+        return levels[level].first_tile + size_t(y >> TEXTURE_TILE_LOG) * levels[level].tiles_x + (x >> TEXTURE_TILE_LOG);
+    }
+    static size_t InnerOffset(int x, int y) {
+        return (Part1By1(x & (TEXTURE_TILE-1)) | (Part1By1(y & (TEXTURE_TILE-1)) << 1)) * TEXEL_BYTES;
+    }
+    // Texel at the requested level, or at the finest coarser level whose tile is resident.
+    const unsigned char* TexelData(int level, int x, int y) const {
+        uint32_t now = epoch.load(std::memory_order_relaxed);
+        for (;; level += 1, x >>= 1, y >>= 1) {
+            x = Interval(0, levels[level].width -1).Clamp(x);
+            y = Interval(0, levels[level].height-1).Clamp(y);
+            size_t tile = TileOf(level, x, y);
+            if (stamps[tile].load(std::memory_order_relaxed) != now) stamps[tile].store(now, std::memory_order_relaxed);
+            if (tiles[tile] != nullptr) return tiles[tile] + InnerOffset(x, y);
+        }
+    }
+    unsigned char* MutableTexel(int level, int x, int y) {
+        x = Interval(0, levels[level].width -1).Clamp(x);
+        y = Interval(0, levels[level].height-1).Clamp(y);
+        return owned[TileOf(level, x, y)].get() + InnerOffset(x, y);
+    }
+    static uint32_t Part1By1(uint32_t x) {
+        x = (x | (x << 4)) & 0x0F0F;
+        x = (x | (x << 2)) & 0x3333;
+        x = (x | (x << 1)) & 0x5555;
+        return x;
+    }
+    // Texels are gamma encoded with the same 2.2 exponent stb uses for linear float loads.
+    static const std::array<float, 256>& DecodeTable() {
+        static const auto table = [] {
+            std::array<float, 256> values;
+            for (int i = 0; i < 256; i += 1) values[i] = std::pow(i / 255.0, 2.2);
+            return values;
+        }();
+        return table;
+    }
+    static unsigned char Encode(double _value) {
         if (_value <= 0.0)
             return 0;
         if (_value >= 1.0)
             return 255;
-        return static_cast<unsigned char>(256.0 * _value);
+        return static_cast<unsigned char>(std::pow(_value, 1.0 / 2.2) * 255.0 + 0.5);
     }
 };
 
@@ -87,4 +341,4 @@ private:
     #pragma warning (pop)
 #endif
 
-#endif // IMAGE_H
\ No newline at end of file
+#endif // IMAGE_H
@@ -0,0 +1,370 @@
+#pragma once
+#ifndef LIGHTBVH_H
+#define LIGHTBVH_H
+
+#include <algorithm>
+
+#include "global.h"
+#include "mathematics.h"
+#include "bounds.h"
+#include "shapes.h"
+#include "scene.h"
+#include "primitives.h"
+#include "material.h"
+#include "distribution.h"
+
+// Hierarchy over every emissive sphere and quad of a scene, after Conty and Kulla, "Importance
+// Sampling of Many Lights with Adaptive Tree Splitting" (2018). Each node bounds its emitters'
+// positions, their total power and a cone of emission directions; a shading point descends the tree
+// choosing children in proportion to an upper bound on the light they could send it, so picking one
+// of n lights costs O(log n) and follows the lights that matter. Emissive meshes, boxes and custom
+// shapes are not sampled and are left to BSDF sampling alone.
+class LightBVH {
+public:
+    // Constructors
+    LightBVH(const PrimitiveStore& store) { Collect(store); Build(); }
+    LightBVH(const Scene& scene) {
+        PrimitiveStore store;
+        store.Add(scene);
+        Collect(store);
+        Build();
+    }
+
+    // Methods
+    size_t Size() const { return emitters.size(); }
+    // Pick an emitter for the shading point p with normal n and a point on it. Returns the radiance
+    // it sends back along wi; pdf is with respect to solid angle and includes the choice of emitter,
+    // distance is to the sampled point.
+    Colour Sample(const Point3& p, const Vector3& n, double time, Vector3& wi, double& pdf, double& distance) const {
+        pdf = 0.0;
+        if (nodes.empty() || Importance(nodes[0], p, n) <= 0) return Colour(0.0);
+        uint32_t index = 0;
+        double pmf = 1.0;
+        while (!nodes[index].leaf) {
+            double w0 = Importance(nodes[index + 1], p, n);
+            double w1 = Importance(nodes[nodes[index].child], p, n);
+            if (w0 + w1 <= 0) return Colour(0.0);
+            double p0 = w0 / (w0 + w1);
+            if (RandomFloat() < p0) { index = index + 1;             pmf *= p0; }
+            else                    { index = nodes[index].child;    pmf *= 1 - p0; }
+        }
+        const auto& emitter = emitters[nodes[index].child];
+        double u, v, shape_pdf;
+        Point3 point;
+        if (!SampleEmitter(emitter, p, time, point, u, v, shape_pdf)) return Colour(0.0);
+        wi = point - p;
+        distance = Length(wi);
+        if (distance <= 0) return Colour(0.0);
+        wi /= distance;
+        pdf = pmf * shape_pdf;
+        return emitter.material->Emission(u, v, point);
+    }
+    // Start a photon at the given time: an emitter picked in proportion to its power, a point on it and
+    // a cosine-weighted direction leaving it. Returns the flux the photon carries.
+    Colour SampleEmission(double time, Ray& ray) const {
+        if (emitters.empty()) return Colour(0.0);
+        double pmf, u, v;
+        const auto& emitter = emitters[by_power.Sample(RandomFloat(), pmf, u)];
+        Point3 point;
+        Vector3 normal;
+        double sides = 1.0;
+        if (emitter.type == PrimType::Quad) {
+            u = RandomFloat();
+            v = RandomFloat();
+            point = emitter.centre + u * emitter.u + v * emitter.v;
+            normal = RandomFloat() < 0.5 ? emitter.normal : -emitter.normal;
+            sides = 2.0;
+        } else {
+            normal = RandomVec3Unit();
+            point = emitter.centre + time * emitter.shift + emitter.radius * normal;
+            Sphere::CountUV(normal, u, v);
+        }
+        ray = Ray(point, Frame(normal).ToWorld(RandomVec3Cosine()), time);
+        return emitter.material->Emission(u, v, point) * (sides * emitter.area * M_PI / pmf);
+    }
+    // Whether isect lies on one of the emitters in the hierarchy.
+    bool Contains(const Intersection& isect, double time) const { return !nodes.empty() && Locate(0, isect, time) >= 0; }
+    // Density with which Sample would have chosen the direction of ray, leaving p with normal n, when
+    // that ray hit an emitter at isect. Zero for emitters outside the hierarchy.
+    double Pdf(const Point3& p, const Vector3& n, const Ray& ray, const Intersection& isect) const {
+        if (nodes.empty()) return 0.0;
+        int found = Locate(0, isect, ray.time);
+        if (found < 0) return 0.0;
+        const auto& emitter = emitters[found];
+        // Replay the choices along the emitter's path from the root
+        double pmf = 1.0;
+        uint32_t index = 0;
+        for (int depth = 0; !nodes[index].leaf; depth += 1) {
+            double w0 = Importance(nodes[index + 1], p, n);
+            double w1 = Importance(nodes[nodes[index].child], p, n);
+            if (w0 + w1 <= 0) return 0.0;
+            if ((emitter.trail >> depth) & 1) { pmf *= w1 / (w0 + w1); index = nodes[index].child; }
+            else                              { pmf *= w0 / (w0 + w1); index = index + 1; }
+        }
+        double distance2 = Length2(isect.coords - p);
+        switch (emitter.type) {
+            case PrimType::Quad: {
+                double cosine = Abs(Dot(Normalize(ray.dir), emitter.normal));
+                return cosine > 0 ? pmf * distance2 / (cosine * emitter.area) : 0.0;
+            }
+            default: {
+                auto centre = emitter.centre + ray.time * emitter.shift;
+                double d2 = Length2(centre - p);
+                if (d2 <= Sqr(emitter.radius)) {
+                    double cosine = Abs(Dot(Normalize(ray.dir), isect.normal));
+                    return cosine > 0 ? pmf * distance2 / (cosine * emitter.area) : 0.0;
+                }
+                double cos_max = Sqrt(Max(0.0, 1 - Sqr(emitter.radius) / d2));
+                return pmf / (2 * M_PI * (1 - cos_max));
+            }
+        }
+    }
+
+private:
+    // Members
+    struct Emitter {
+        PrimType type;              // Sphere, MovingSphere or Quad
+        Point3   centre;            // Sphere centre at time 0, or quad corner
+        Vector3  shift;             // Sphere motion over the shutter
+        Vector3  u, v, normal;      // Quad edges and unit normal
+        double   radius = 0.0;
+        double   area;
+        double   power;
+        uint64_t trail = 0;         // Branches from the root to its leaf, bit d set for the second child
+        Bounds3  bounds;
+        shared_ptr<Material> material;
+    };
+    struct Node {
+        Bounds3  bounds;
+        Vector3  axis;              // Orientation cone: every surface normal lies within theta_o
+        double   theta_o;           // of axis, and light leaves within theta_e of the normal
+        double   theta_e;
+        double   power;
+        uint32_t child;             // Second child for interior nodes (the first follows), emitter for leaves
+        bool     leaf;
+        bool     two_sided;
+    };
+    vector<Emitter> emitters;
+    vector<Node> nodes;
+    AliasTable by_power;            // Emitters in proportion to their power, for photons
+
+    // Methods
+    void Collect(const PrimitiveStore& store) {
+        auto emissive = [&store](uint32_t material) { return store.materials[material]->IsEmissive(); };
+        for (uint32_t i = 0; i < store.spheres.Size(); i += 1) {
+            if (!emissive(store.spheres.material[i])) continue;
+            Emitter emitter;
+            emitter.type = PrimType::Sphere;
+            emitter.centre = store.spheres.Centre(i);
+            emitter.radius = store.spheres.radius[i];
+            emitter.material = store.materials[store.spheres.material[i]];
+            emitters.push_back(emitter);
+        }
+        for (uint32_t i = 0; i < store.moving_spheres.Size(); i += 1) {
+            if (!emissive(store.moving_spheres.material[i])) continue;
+            Emitter emitter;
+            emitter.type = PrimType::MovingSphere;
+            emitter.centre = store.moving_spheres.Centre(i, 0.0);
+            emitter.shift = store.moving_spheres.Centre(i, 1.0) - emitter.centre;
+            emitter.radius = store.moving_spheres.radius[i];
+            emitter.material = store.materials[store.moving_spheres.material[i]];
+            emitters.push_back(emitter);
+        }
+        for (uint32_t i = 0; i < store.quads.Size(); i += 1) {
+            if (!emissive(store.quads.material[i])) continue;
+            Emitter emitter;
+            emitter.type = PrimType::Quad;
+            emitter.centre = store.quads.Pin(i);
+            emitter.u = store.quads.U(i);
+            emitter.v = store.quads.V(i);
+            emitter.normal = store.quads.Normal(i);
+            emitter.material = store.materials[store.quads.material[i]];
+            emitters.push_back(emitter);
+        }
+        for (auto& emitter : emitters) {
+            Point3 middle;
+            if (emitter.type == PrimType::Quad) {
+                emitter.area = Length(Cross(emitter.u, emitter.v));
+                emitter.bounds = Union(Bounds3(emitter.centre, emitter.centre + emitter.u + emitter.v),
+                                       Bounds3(emitter.centre + emitter.u, emitter.centre + emitter.v));
+                middle = emitter.centre + 0.5 * (emitter.u + emitter.v);
+            } else {
+                auto r_vec = Vector3(emitter.radius);
+                emitter.area = 4 * M_PI * Sqr(emitter.radius);
+                emitter.bounds = Union(Bounds3(emitter.centre - r_vec, emitter.centre + r_vec),
+                                       Bounds3(emitter.centre + emitter.shift - r_vec, emitter.centre + emitter.shift + r_vec));
+                middle = emitter.centre + 0.5 * emitter.shift;
+            }
+            // Emitters radiate from both sides, so a quad sends out twice its one-sided power
+            auto radiance = emitter.material->Emission(0.5, 0.5, middle);
+            emitter.power = Max(Luminance(radiance), 0.0) * emitter.area * M_PI * (emitter.type == PrimType::Quad ? 2 : 1);
+        }
+    }
+    void Build() {
+        if (emitters.empty()) return;
+        vector<double> power(emitters.size());
+        for (size_t i = 0; i < emitters.size(); i += 1) power[i] = emitters[i].power;
+        by_power = AliasTable(power);
+        vector<uint32_t> order(emitters.size());
+        for (uint32_t i = 0; i < order.size(); i += 1) order[i] = i;
+        nodes.reserve(2 * emitters.size() - 1);
+        Build(order.data(), order.data() + order.size(), 0, 0);
+    }
+    // Split at the median along the widest spread of centroids, the same way the other hierarchies do.
+    uint32_t Build(uint32_t* begin, uint32_t* end, uint64_t trail, int depth) {
+        uint32_t index = nodes.size();
+        nodes.emplace_back();
+        if (end - begin == 1 || depth == 63) {
+            // Depth only runs out with more emitters than memory, but keep the trail meaningful
+            auto& emitter = emitters[*begin];
+            emitter.trail = trail;
+            auto& node = nodes[index];
+            node.bounds = emitter.bounds;
+            if (emitter.type == PrimType::Quad) {
+                node.axis = emitter.normal;
+                node.theta_o = 0.0;
+            } else {
+                node.axis = Vector3(0, 0, 1);
+                node.theta_o = M_PI;
+            }
+            node.theta_e = M_PI_2;
+            node.power = emitter.power;
+            node.child = *begin;
+            node.leaf = true;
+            node.two_sided = emitter.type == PrimType::Quad;
+            return index;
+        }
+        auto centroids = Bounds3::Empty;
+        for (auto* i = begin; i != end; i += 1) {
+            const auto& bounds = emitters[*i].bounds;
+            auto centroid = Point3(bounds.x.Centroid(), bounds.y.Centroid(), bounds.z.Centroid());
+            centroids = Union(centroids, Bounds3(centroid, centroid));
+        }
+        int axis = centroids.MaxAxis();
+        auto* middle = begin + (end - begin) / 2;
+        std::nth_element(begin, middle, end, [this, axis](uint32_t a, uint32_t b) {
+            return emitters[a].bounds[axis].Centroid() < emitters[b].bounds[axis].Centroid();
+        });
+        uint32_t first = Build(begin, middle, trail, depth + 1);
+        uint32_t second = Build(middle, end, trail | (uint64_t(1) << depth), depth + 1);
+        const auto& a = nodes[first];
+        const auto& b = nodes[second];
+        Node node;
+        node.bounds = Union(a.bounds, b.bounds);
+        node.power = a.power + b.power;
+        node.child = second;
+        node.leaf = false;
+        node.two_sided = a.two_sided || b.two_sided;
+        node.theta_e = Max(a.theta_e, b.theta_e);
+        MergeCones(a.axis, a.theta_o, b.axis, b.theta_o, node.axis, node.theta_o);
+        nodes[index] = node;
+        return index;
+    }
+    // Smallest cone around both cones (Conty and Kulla, Algorithm 1).
+    static void MergeCones(const Vector3& axis_a, double theta_a, const Vector3& axis_b, double theta_b,
+                           Vector3& axis, double& theta) {
+        if (theta_b > theta_a) return MergeCones(axis_b, theta_b, axis_a, theta_a, axis, theta);
+        double theta_d = Acos(Max(-1.0, Min(Dot(axis_a, axis_b), 1.0)));
+        axis = axis_a;
+        if (Min(theta_d + theta_b, M_PI) <= theta_a) { theta = theta_a; return; }
+        theta = (theta_a + theta_d + theta_b) / 2;
+        auto rotation = Cross(axis_a, axis_b);
+        if (theta >= M_PI || Length2(rotation) < EPS_DEUX) { theta = M_PI; return; }
+        // Turn axis_a towards axis_b until the new cone just covers both
+        double theta_r = theta - theta_a;
+        auto k = Normalize(rotation);
+        axis = Normalize(axis_a * Cos(theta_r) + Cross(k, axis_a) * Sin(theta_r));
+    }
+    // Upper bound on what the node's emitters could deliver to p (Conty and Kulla, Eq. 3). The normal
+    // term is left out when n is zero.
+    static double Importance(const Node& node, const Point3& p, const Vector3& n) {
+        if (node.power <= 0) return 0.0;
+        auto centre = Point3(node.bounds.x.Centroid(), node.bounds.y.Centroid(), node.bounds.z.Centroid());
+        auto diagonal = Vector3(node.bounds.x.size, node.bounds.y.size, node.bounds.z.size);
+        auto offset = p - centre;
+        double distance2 = Length2(offset);
+        double radius2 = Length2(diagonal) / 4;
+        // Angle the bounds subtend from p, everything once p is inside
+        double theta_b = distance2 > radius2 ? Asin(Sqrt(radius2 / distance2)) : M_PI;
+        auto wi = distance2 > 0 ? offset / Sqrt(distance2) : Vector3(0, 0, 1);
+        double cos_w = Dot(node.axis, wi);
+        if (node.two_sided) cos_w = Abs(cos_w);
+        double theta_w = Acos(Max(-1.0, Min(cos_w, 1.0)));
+        double theta = Max(0.0, theta_w - node.theta_o - theta_b);
+        if (theta >= node.theta_e) return 0.0;
+        double importance = node.power * Cos(theta) / Max(distance2, radius2);
+        if (!IsZero(n * n)) {
+            double theta_i = Acos(Min(Abs(Dot(wi, n)), 1.0));
+            importance *= Cos(Max(0.0, theta_i - theta_b));
+        }
+        return Max(importance, 0.0);
+    }
+    static bool SampleEmitter(const Emitter& emitter, const Point3& p, double time,
+                              Point3& point, double& u, double& v, double& pdf) {
+        if (emitter.type == PrimType::Quad) {
+            u = RandomFloat();
+            v = RandomFloat();
+            point = emitter.centre + u * emitter.u + v * emitter.v;
+            auto offset = point - p;
+            double distance2 = Length2(offset);
+            double cosine = Abs(Dot(offset, emitter.normal)) / Sqrt(distance2);
+            if (cosine <= 0) return false;
+            pdf = distance2 / (cosine * emitter.area);
+            return true;
+        }
+        auto centre = emitter.centre + time * emitter.shift;
+        auto offset = centre - p;
+        double d2 = Length2(offset);
+        Vector3 outward;
+        if (d2 <= Sqr(emitter.radius)) {
+            // From inside every point is visible, so sample the surface uniformly
+            outward = RandomVec3Unit();
+            point = centre + emitter.radius * outward;
+            auto to_point = point - p;
+            double cosine = Abs(Dot(Normalize(to_point), outward));
+            if (cosine <= 0) return false;
+            pdf = Length2(to_point) / (cosine * emitter.area);
+        } else {
+            // Uniform over the cone of directions the sphere subtends
+            double cos_max = Sqrt(Max(0.0, 1 - Sqr(emitter.radius) / d2));
+            double cos_theta = 1 - RandomFloat() * (1 - cos_max);
+            double sin_theta = Sqrt(Max(0.0, 1 - Sqr(cos_theta)));
+            double φ = 2 * M_PI * RandomFloat();
+            Frame frame(offset / Sqrt(d2));
+            auto dir = frame.ToWorld(Vector3(sin_theta * Cos(φ), sin_theta * Sin(φ), cos_theta));
+            // Nearest crossing of the sphere along dir
+            double b = Dot(dir, offset);
+            double t = b - Sqrt(Max(0.0, Sqr(b) - d2 + Sqr(emitter.radius)));
+            point = p + t * dir;
+            outward = (point - centre) / emitter.radius;
+            pdf = 1 / (2 * M_PI * (1 - cos_max));
+        }
+        Sphere::CountUV(outward, u, v);
+        return true;
+    }
+    // Emitter whose surface holds the hit, found by descending every node whose bounds contain it.
+    int Locate(uint32_t index, const Intersection& isect, double time) const {
+        const auto& node = nodes[index];
+        const auto& bounds = node.bounds;
+        double slack = EPS_UNIT * (1 + Length(isect.coords));
+        for (int axis = 0; axis < 3; axis += 1)
+            if (isect.coords[axis] < bounds[axis]._min - slack || isect.coords[axis] > bounds[axis]._max + slack)
+                return -1;
+        if (!node.leaf) {
+            int found = Locate(index + 1, isect, time);
+            return found >= 0 ? found : Locate(node.child, isect, time);
+        }
+        const auto& emitter = emitters[node.child];
+        if (emitter.material.get() != isect.material) return -1;
+        if (emitter.type == PrimType::Quad) {
+            if (Abs(Dot(isect.coords - emitter.centre, emitter.normal)) > slack) return -1;
+        } else {
+            auto centre = emitter.centre + time * emitter.shift;
+            if (Abs(Length(isect.coords - centre) - emitter.radius) > slack + EPS_UNIT * emitter.radius) return -1;
+        }
+        return node.child;
+    }
+};
+
+
+#endif // LIGHTBVH_H
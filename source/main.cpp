@@ -3,7 +3,17 @@
 #include "shapes.h"
 #include "ray.h"
 #include "scene.h"
+#include "arena.h"
+#include "dynamicbvh.h"
 #include "bvhtree.h"
+#include "primitives.h"
+#include "grid.h"
+#include "compressedbvh.h"
+#include "scenecache.h"
+#include "outofcore.h"
+#include "lightbvh.h"
+#include "medium.h"
+#include "animation.h"
 #include "camera.h"
 #include "objects.h"
 #include "material.h"
@@ -12,11 +22,13 @@
 Point3 RandomCentre(double x, double y, double z)
 { return Point3(x,y,z) + Point3(0.9*RandomFloat(),0,0.9*RandomFloat()); }
 
-void BouncingBalls(uint32_t& minutes, uint32_t& seconds) {
+shared_ptr<PrimitiveBVH> BouncingBallsScene() {
+    // Hundreds of small spheres and materials, placed side by side instead of scattered over the heap
+    auto arena = make_shared<Arena>();
     Scene scene;
     
-    auto checker_texture = make_shared<CheckerTexture>(0.32, Colour(0.2, 0.3, 0.1), Colour(0.9, 0.9, 0.9));
-    scene.AddObject(make_shared<Sphere>(Point3(0, -1000, 0), 1000, make_shared<Lambertian>(checker_texture)));
+    auto checker_texture = arena->Make<CheckerTexture>(0.32, Colour(0.2, 0.3, 0.1), Colour(0.9, 0.9, 0.9));
+    scene.AddObject(arena->Make<Sphere>(Point3(0, -1000, 0), 1000, arena->Make<Lambertian>(checker_texture)));
 
     auto radius_small = 0.2;
     auto radius_large = 1.0;
@@ -46,19 +58,19 @@ void BouncingBalls(uint32_t& minutes, uint32_t& seconds) {
             if (random_option < 0.6) {
                 // Diffuse Sphere
                 auto albedo = RandomColour() * RandomColour();
-                MATsphere = make_shared<Lambertian>(albedo);
+                MATsphere = arena->Make<Lambertian>(albedo);
                 auto centre_next = centre + Vector3(0, RandomFloat(0,.5), 0);
-                scene.AddObject(make_shared<Sphere>(centre, centre_next, r, MATsphere));
+                scene.AddObject(arena->Make<Sphere>(centre, centre_next, r, MATsphere));
             } else if (random_option < 0.9) {
                 // Metal Sphere
                 auto albedo    = RandomColour(0.5, 1.0);
                 auto fuzziness = RandomFloat(0.0, 0.5);
-                MATsphere = make_shared<Metal>(albedo, fuzziness);
-                scene.AddObject(make_shared<Sphere>(centre, r, MATsphere));
+                MATsphere = arena->Make<Metal>(albedo, fuzziness);
+                scene.AddObject(arena->Make<Sphere>(centre, r, MATsphere));
             } else {
                 // Glass Sphere
-                MATsphere = make_shared<Dielectric>(1.5);
-                scene.AddObject(make_shared<Sphere>(centre, r, MATsphere));
+                MATsphere = arena->Make<Dielectric>(1.5);
+                scene.AddObject(arena->Make<Sphere>(centre, r, MATsphere));
             }
             ProgressBar(((z+15) * 30 + (x+15) + 1)/ 900.0);
         }
@@ -66,14 +78,29 @@ void BouncingBalls(uint32_t& minutes, uint32_t& seconds) {
 
     std::clog << "\nGenerating Scene Complete! \n";
 
-    auto MATdiffuse    = make_shared<Lambertian>(Colour(0.4, 0.2, 0.1));
-    auto MATdielectric = make_shared<Dielectric>(1.5);
-    auto MATmetalllic  = make_shared<Metal>(Colour(0.7, 0.6, 0.5), 0.0);
-    scene.AddObject(make_shared<Sphere>(Point3(-6, 1, 0), radius_large, MATdiffuse));
-    scene.AddObject(make_shared<Sphere>(Point3(-1, 1, 0), radius_large, MATdielectric));
-    scene.AddObject(make_shared<Sphere>(Point3( 4, 1, 0), radius_large, MATmetalllic));
+    auto MATdiffuse    = arena->Make<Lambertian>(Colour(0.4, 0.2, 0.1));
+    auto MATdielectric = arena->Make<Dielectric>(1.5);
+    auto MATmetalllic  = arena->Make<Metal>(Colour(0.7, 0.6, 0.5), 0.0);
+    scene.AddObject(arena->Make<Sphere>(Point3(-6, 1, 0), radius_large, MATdiffuse));
+    scene.AddObject(arena->Make<Sphere>(Point3(-1, 1, 0), radius_large, MATdielectric));
+    scene.AddObject(arena->Make<Sphere>(Point3( 4, 1, 0), radius_large, MATmetalllic));
 
-    scene = Scene(make_shared<BVHNode>(scene));
+    auto store = make_shared<PrimitiveStore>();
+    store->Add(scene);
+    return make_shared<PrimitiveBVH>(store);
+}
+
+void BouncingBalls(uint32_t& minutes, uint32_t& seconds) {
+    // Reuse the scene and BVH of an earlier run of this build; rebuilding the renderer, as any edit to
+    // BouncingBallsScene() does, changes the key and generates a new one.
+    uint64_t key = std::hash<std::string>()(__DATE__ " " __TIME__);
+    auto world = SceneCache::Load("bouncing_balls.rtscene", key);
+    if (world == nullptr) {
+        world = BouncingBallsScene();
+        SceneCache::Save("bouncing_balls.rtscene", *world, key);
+    } else {
+        std::clog << "Using the cached scene in 'bouncing_balls.rtscene'.\n";
+    }
 
     Camera camera;
     camera.aspect_ratio  = 1.778;
@@ -89,8 +116,11 @@ void BouncingBalls(uint32_t& minutes, uint32_t& seconds) {
     camera.defocus_angle = 0.60;
     camera.focal_dist    = 9.0;
 
+    // Spheres on an even lattice may trace faster through a grid
+    auto accelerator = FastestAccelerator(world, camera);
+
     auto start = std::chrono::system_clock::now();
-    camera.RenderScene(scene);
+    camera.RenderScene(*accelerator);
     auto stop = std::chrono::system_clock::now();
     minutes = std::chrono::duration_cast<std::chrono::minutes>(stop - start).count();
     seconds = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() - 60*minutes;
@@ -170,6 +200,7 @@ void TestSquares(uint32_t& minutes, uint32_t& seconds) {
     camera.image_width   = 512;
     camera.sample_ppixel = 64;
     camera.background    = Colour(0.7, 0.8, 1.0);
+    camera.radiance_cache = true;
     camera.roulette      = 0.8;
 
     camera.verticle_fov  = 80;
@@ -198,6 +229,7 @@ void SingleLight(uint32_t& minutes, uint32_t& seconds) {
     camera.image_width   = 512;
     camera.sample_ppixel = 1024;
     camera.background    = Colour(0.0);
+    camera.lights        = make_shared<LightBVH>(scene);
     camera.roulette      = 0.8;
 
     camera.verticle_fov  = 20;
@@ -235,11 +267,265 @@ void CornellBox(uint32_t& minutes, uint32_t& seconds) {
     auto trans2  = Translate(Vector3(130, 0, 65));
     scene.AddObject(CreateBox(Point3(0, 0, 0), Point3(165, 165, 165), white, trans2*rotate2));
 
+    auto store = make_shared<PrimitiveStore>();
+    store->Add(scene);
+    scene = Scene(make_shared<PrimitiveBVH>(store));
+
     Camera camera;
     camera.aspect_ratio  = 1.0;
     camera.image_width   = 800;
     camera.sample_ppixel = 10000;
     camera.background    = Colour(0.0);
+    camera.lights        = make_shared<LightBVH>(*store);
+    camera.guiding       = true;
+    camera.roulette      = 0.8;
+
+    camera.verticle_fov  = 40;
+    camera.view_up       = Vector3(0,1,0);
+    camera.view_pos      = Point3(278,278,-800);
+    camera.view_des      = Point3(278,278,0);
+    camera.defocus_angle = 0.0;
+
+    auto start = std::chrono::system_clock::now();
+    camera.RenderScene(scene);
+    auto stop = std::chrono::system_clock::now();
+    minutes = std::chrono::duration_cast<std::chrono::minutes>(stop - start).count();
+    seconds = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() - 60*minutes;
+}
+
+void MeshModel(uint32_t& minutes, uint32_t& seconds) {
+    // OBJ or binary PLY model, e.g. MESH_FILE=../models/bunny.ply
+    auto filename = getenv("MESH_FILE");
+    if (filename == nullptr) {
+        std::clog << "Set MESH_FILE to an OBJ or PLY model.\n";
+        return;
+    }
+    auto model = LoadMesh(filename, make_shared<Lambertian>(Colour(.73, .71, .68)));
+    if (model == nullptr) return;
+
+    auto store = make_shared<PrimitiveStore>();
+    store->AddMesh(model);
+    store->AddSphere(Point3(0, -1000, 0), 1000 - model->BBox().y._min, 
+                     make_shared<Lambertian>(make_shared<CheckerTexture>(0.32, Colour(0.2, 0.3, 0.1), Colour(0.9))));
+    // Large meshes are bound by memory traffic, so trace a quantised four-wide copy of the tree
+    auto bvh = make_shared<CompressedBVH>(PrimitiveBVH(store));
+    std::clog << "BVH: " << bvh->Nodes() << " nodes, " << bvh->Bytes() / 1024 << " KiB. \n";
+
+    auto bounds = model->BBox();
+    auto centre = Point3(bounds.x.Centroid(), bounds.y.Centroid(), bounds.z.Centroid());
+    auto extent = Max(bounds.x.size, Max(bounds.y.size, bounds.z.size));
+
+    Camera camera;
+    camera.aspect_ratio  = 1.778;
+    camera.image_width   = 512;
+    camera.sample_ppixel = 64;
+    camera.background    = Colour(0.7, 0.8, 1.0);
+    camera.roulette      = 0.8;
+
+    camera.verticle_fov  = 30;
+    camera.view_up       = Vector3(0,1,0);
+    camera.view_pos      = centre + Vector3(0.5, 0.4, 2.0) * extent;
+    camera.view_des      = centre;
+    camera.defocus_angle = 0.0;
+
+    auto start = std::chrono::system_clock::now();
+    camera.RenderScene(*bvh);
+    auto stop = std::chrono::system_clock::now();
+    minutes = std::chrono::duration_cast<std::chrono::minutes>(stop - start).count();
+    seconds = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() - 60*minutes;
+}
+
+void StreamedBalls(uint32_t& minutes, uint32_t& seconds) {
+    // Same scene as BouncingBalls, traced from treelets paged in from disk under a small budget.
+    auto world = OutOfCoreScene::Open("bouncing_balls.rtooc", size_t(16) << 20);
+    if (world == nullptr) {
+        if (!OutOfCoreScene::Write("bouncing_balls.rtooc", BouncingBallsScene()->Store(), 64)) return;
+        world = OutOfCoreScene::Open("bouncing_balls.rtooc", size_t(16) << 20);
+        if (world == nullptr) return;
+    }
+
+    Camera camera;
+    camera.aspect_ratio  = 1.778;
+    camera.image_width   = 512;
+    camera.sample_ppixel = 64;
+    camera.background    = Colour(0.7, 0.8, 1.0);
+    camera.roulette      = 0.8;
+
+    camera.verticle_fov  = 20;
+    camera.view_up       = Vector3(0,1,0);
+    camera.view_pos      = Point3(12,2,3);
+    camera.view_des      = Point3(0,0,0);
+    camera.defocus_angle = 0.60;
+    camera.focal_dist    = 9.0;
+
+    auto start = std::chrono::system_clock::now();
+    camera.RenderScene(*world);
+    auto stop = std::chrono::system_clock::now();
+    std::clog << "Treelet page-ins: " << world->PageIns() << " of " << world->Treelets() << " treelets.\n";
+    minutes = std::chrono::duration_cast<std::chrono::minutes>(stop - start).count();
+    seconds = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() - 60*minutes;
+}
+
+void SkyLitBalls(uint32_t& minutes, uint32_t& seconds) {
+    // Matte and metal balls on a ground plane, lit only by a measured sky, e.g. SKY_FILE=../images/sky.hdr
+    auto filename = getenv("SKY_FILE");
+    auto sky = make_shared<EnvironmentLight>(filename != nullptr ? filename : "sky.hdr");
+    Scene scene;
+    scene.AddObject(make_shared<Sphere>(Point3(0,-1000, 0), 1000, make_shared<Lambertian>(Colour(0.5))));
+    scene.AddObject(make_shared<Sphere>(Point3(-2, 1, 0), 1, make_shared<Lambertian>(Colour(0.6, 0.2, 0.2))));
+    scene.AddObject(make_shared<Sphere>(Point3( 0, 1, 0), 1, make_shared<Metal>(Colour(0.9, 0.8, 0.6), 0.2)));
+    scene.AddObject(make_shared<Sphere>(Point3( 2, 1, 0), 1, make_shared<Dielectric>(1.5)));
+
+    Camera camera;
+    camera.aspect_ratio  = 1.778;
+    camera.image_width   = 512;
+    camera.sample_ppixel = 16;
+    camera.background    = Colour(0.7, 0.8, 1.0);
+    if (sky->Valid()) camera.environment = sky;
+    else std::clog << "Set SKY_FILE to an HDR environment map; lighting with a plain sky instead.\n";
+    camera.roulette      = 0.8;
+
+    camera.verticle_fov  = 30;
+    camera.view_up       = Vector3(0,1,0);
+    camera.view_pos      = Point3(0,2,10);
+    camera.view_des      = Point3(0,1,0);
+    camera.defocus_angle = 0.0;
+
+    auto start = std::chrono::system_clock::now();
+    camera.RenderScene(scene);
+    auto stop = std::chrono::system_clock::now();
+    minutes = std::chrono::duration_cast<std::chrono::minutes>(stop - start).count();
+    seconds = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() - 60*minutes;
+}
+
+void LightWall(uint32_t& minutes, uint32_t& seconds) {
+    // A wall of small coloured emitters lighting a few balls, sampled through the light hierarchy.
+    Scene scene;
+    scene.AddObject(make_shared<Sphere>(Point3(0,-1000, 0), 1000, make_shared<Lambertian>(Colour(0.5))));
+    scene.AddObject(make_shared<Sphere>(Point3(-2, 1, 2), 1, make_shared<Lambertian>(Colour(0.7))));
+    scene.AddObject(make_shared<Sphere>(Point3( 0, 1, 2), 1, make_shared<Metal>(Colour(0.9), 0.1)));
+    scene.AddObject(make_shared<Sphere>(Point3( 2, 1, 2), 1, make_shared<Dielectric>(1.5)));
+    for (int i = 0; i < 64; i += 1) {
+        for (int j = 0; j < 32; j += 1) {
+            auto led = make_shared<Light>(RandomColour(0.0, 4.0));
+            scene.AddObject(make_shared<Quad>(Point3(-8 + 0.25*i, 0.25*j, -2), Vector3(0.2,0,0), Vector3(0,0.2,0), led));
+        }
+    }
+    auto store = make_shared<PrimitiveStore>();
+    store->Add(scene);
+    scene = Scene(make_shared<PrimitiveBVH>(store));
+
+    Camera camera;
+    camera.aspect_ratio  = 1.778;
+    camera.image_width   = 512;
+    camera.sample_ppixel = 64;
+    camera.background    = Colour(0.0);
+    camera.lights        = make_shared<LightBVH>(*store);
+    camera.caustics      = true;
+    camera.roulette      = 0.8;
+
+    camera.verticle_fov  = 40;
+    camera.view_up       = Vector3(0,1,0);
+    camera.view_pos      = Point3(0,3,12);
+    camera.view_des      = Point3(0,2,0);
+    camera.defocus_angle = 0.0;
+
+    auto start = std::chrono::system_clock::now();
+    camera.RenderScene(scene);
+    auto stop = std::chrono::system_clock::now();
+    minutes = std::chrono::duration_cast<std::chrono::minutes>(stop - start).count();
+    seconds = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() - 60*minutes;
+}
+
+void OrbitingBalls(uint32_t& minutes, uint32_t& seconds) {
+    // Two seconds of balls circling a glass sphere and a card turning over a checkered floor. The
+    // floor and its texture are set up once; each frame refits the BVH around the moving objects.
+    auto store = make_shared<PrimitiveStore>();
+    Animation animation(store);
+
+    auto checker_texture = make_shared<CheckerTexture>(0.32, Colour(0.2, 0.3, 0.1), Colour(0.9, 0.9, 0.9));
+    animation.Add(make_shared<Sphere>(Point3(0,-1000, 0), 1000, make_shared<Lambertian>(checker_texture)), {});
+    animation.Add(make_shared<Sphere>(Point3(0, 1, 0), 1, make_shared<Dielectric>(1.5)), {});
+    for (int i = 0; i < 8; i += 1) {
+        auto ball = make_shared<Sphere>(Point3(3, 0.4, 0), 0.4, make_shared<Lambertian>(RandomColour() * RandomColour()));
+        animation.Add(ball, {Keyframe{0,  Vector3(0, 0.6*(i%2), 0), 45.0*i}, 
+                             Keyframe{48, Vector3(0, 0.6*(i%2), 0), 45.0*i + 360}});
+    }
+    auto card = make_shared<Quad>(Point3(-0.75, 0, 0), Vector3(1.5, 0, 0), Vector3(0, 1.5, 0), 
+                                  make_shared<Metal>(Colour(0.8, 0.6, 0.5), 0.05));
+    animation.Add(card, {Keyframe{0,  Vector3(0, 2.5, -5), 0}, 
+                         Keyframe{24, Vector3(0, 2.5, -5), 180, 1.5},
+                         Keyframe{48, Vector3(0, 2.5, -5), 360}});
+
+    Camera camera;
+    camera.aspect_ratio  = 1.778;
+    camera.image_width   = 384;
+    camera.sample_ppixel = 16;
+    camera.background    = Colour(0.7, 0.8, 1.0);
+    camera.roulette      = 0.8;
+
+    camera.verticle_fov  = 30;
+    camera.view_up       = Vector3(0,1,0);
+    camera.view_pos      = Point3(0,4,12);
+    camera.view_des      = Point3(0,1,0);
+    camera.defocus_angle = 0.0;
+
+    auto start = std::chrono::system_clock::now();
+    animation.Render(camera, 0, 47, "orbit_");
+    auto stop = std::chrono::system_clock::now();
+    minutes = std::chrono::duration_cast<std::chrono::minutes>(stop - start).count();
+    seconds = std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() - 60*minutes;
+}
+
+void FoggyRoom(uint32_t& minutes, uint32_t& seconds) {
+    // The Cornell box in thin fog, with a plume of smoke rising from the short block. Both are volumes
+    // in the same BVH as the walls; the plume's density is sampled on a lattice.
+    Scene scene;
+
+    auto red   = make_shared<Lambertian>(Colour(.65, .05, .05));
+    auto white = make_shared<Lambertian>(Colour(.73, .71, .68));
+    auto green = make_shared<Lambertian>(Colour(.12, .45, .15));
+    auto light = make_shared<Light>(Colour(30.0));
+
+    scene.AddObject(make_shared<Quad>(Point3( 555,   0,   0), Vector3(   0, 555,   0), Vector3(   0,   0, 555), green));
+    scene.AddObject(make_shared<Quad>(Point3(   0,   0,   0), Vector3(   0, 555,   0), Vector3(   0,   0, 555), red));
+    scene.AddObject(make_shared<Quad>(Point3( 343, 554, 332), Vector3(-130,   0,   0), Vector3(   0,   0,-105), light));
+    scene.AddObject(make_shared<Quad>(Point3(   0,   0,   0), Vector3( 555,   0,   0), Vector3(   0,   0, 555), white));
+    scene.AddObject(make_shared<Quad>(Point3( 555, 555, 555), Vector3(-555,   0,   0), Vector3(   0,   0,-555), white));
+    scene.AddObject(make_shared<Quad>(Point3(   0,   0, 555), Vector3( 555,   0,   0), Vector3(   0, 555,   0), white));
+
+    scene.AddObject(CreateBox(Point3(0, 0, 0), Point3(165, 330, 165), white, Translate(Vector3(265, 0, 295))*RotateY(15.0)));
+    scene.AddObject(CreateBox(Point3(0, 0, 0), Point3(165, 165, 165), white, Translate(Vector3(130, 0, 65))*RotateY(-18.0)));
+
+    // Fog filling the room
+    scene.AddObject(make_shared<Volume>(CreateBox(Point3(1, 1, 1), Point3(554, 553, 554), white), 0.0008, Colour(0.9)));
+    // A plume that widens and fades as it rises, twisting about its axis
+    int n = 48;
+    vector<float> plume(n * n * n);
+    for (int z = 0; z < n; z += 1)
+        for (int y = 0; y < n; y += 1)
+            for (int x = 0; x < n; x += 1) {
+                double u = double(x)/(n-1), h = double(y)/(n-1), w = double(z)/(n-1);
+                double r = Length(Vector3(u - 0.5 - 0.15*Sin(6*h), 0, w - 0.5 - 0.15*Cos(6*h)));
+                double radius = 0.12 + 0.3*h;
+                double swirl = 0.6 + 0.4*Sin(20*u + 4*h) * Sin(17*w - 3*h);
+                plume[(z*n + y)*n + x] = float(Max(0.0, 1 - r/radius) * (1 - h) * swirl);
+            }
+    auto plume_box = Bounds3(Point3(80, 165, 20), Point3(340, 480, 280));
+    scene.AddObject(make_shared<Volume>(CreateBox(Point3(80, 165, 20), Point3(340, 480, 280), white),
+                                        make_shared<Medium>(plume_box, n, n, n, plume, 0.05),
+                                        make_shared<Isotropic>(Colour(0.8))));
+
+    auto store = make_shared<PrimitiveStore>();
+    store->Add(scene);
+    scene = Scene(make_shared<PrimitiveBVH>(store));
+
+    Camera camera;
+    camera.aspect_ratio  = 1.0;
+    camera.image_width   = 600;
+    camera.sample_ppixel = 1024;
+    camera.background    = Colour(0.0);
+    camera.lights        = make_shared<LightBVH>(*store);
     camera.roulette      = 0.8;
 
     camera.verticle_fov  = 40;
@@ -264,6 +550,12 @@ int main() {
         case 5: TestSquares(minutes, seconds);      break;
         case 6: SingleLight(minutes, seconds);      break;
         case 7: CornellBox(minutes, seconds);       break;
+        case 8: MeshModel(minutes, seconds);        break;
+        case 9: StreamedBalls(minutes, seconds);    break;
+        case 10: SkyLitBalls(minutes, seconds);     break;
+        case 11: LightWall(minutes, seconds);       break;
+        case 12: OrbitingBalls(minutes, seconds);   break;
+        case 13: FoggyRoom(minutes, seconds);       break;
         default: std::clog << "Invalid choice.\n";  break;
     }
     std::clog << "Render complete: \n";
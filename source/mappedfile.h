@@ -0,0 +1,61 @@
+#pragma once
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "global.h"
+
+// Read-only memory mapping of a whole file. Pages are shared with every other process mapping the
+// same file and are faulted in lazily by the kernel.
+class MappedFile {
+public:
+    // Constructors & Destructor
+    MappedFile() = default;
+    MappedFile(const std::string& filename) { Open(filename); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    // Methods
+    bool Open(const std::string& filename) {
+        Close();
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) { close(fd); return false; }
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) return false;
+        data = static_cast<const char*>(mapped);
+        size = info.st_size;
+        return true;
+    }
+    void Close() {
+        if (data != nullptr) munmap(const_cast<char*>(data), size);
+        data = nullptr;
+        size = 0;
+    }
+    // Hint the kernel about the coming access pattern of a byte range.
+    void Advise(size_t offset, size_t length, int advice) const {
+        if (data == nullptr) return;
+        size_t page = PageSize();
+        size_t begin = offset / page * page;
+        madvise(const_cast<char*>(data) + begin, Min(length + offset - begin, size - begin), advice);
+    }
+    bool IsOpen() const { return data != nullptr; }
+    static size_t PageSize() { return sysconf(_SC_PAGESIZE); }
+    const char* Data() const { return data; }
+    size_t Size() const { return size; }
+
+private:
+    // Members
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+
+#endif // MAPPEDFILE_H
@@ -2,88 +2,246 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <algorithm>
+#include <variant>
+
 #include "global.h"
 #include "ray.h"
 #include "mathematics.h"
 #include "shapes.h"
 #include "texture.h"
 
-class Material {
-public:
-    // Deconstructor
-    virtual ~Material() = default;
+enum class MaterialType : uint8_t { Lambertian, Metal, Dielectric, Light, Isotropic };
 
-    // Methods
-    virtual bool Scatter(const Ray& ray_in, const Intersection& isect, Colour& attenuation, Ray& scattered) 
-    const { return false; }
-    virtual Colour Emission(double u, double v, const Point3& p) 
-    const { return Colour(0.0); }
+// Result of Material::Sample. weight is f·cos(θi)/pdf, the factor a path throughput is multiplied by;
+// delta lobes (mirror, glass) have no finite f or pdf, so they leave both at zero and set delta.
+struct BSDFSample {
+    Vector3 wi;
+    Colour f;
+    Colour weight;
+    double pdf;
+    bool delta;
 };
 
-
-class Lambertian : public Material {
+// Every material is one of a closed set of parameter blocks held in a tagged union. Shading switches
+// on the tag, so the compiler can inline each case; Lambertian, Metal, Dielectric, Light and Isotropic
+// below only construct the right block. Emissive and specular flags let callers skip work up front;
+// specular means the material has only delta lobes, so Eval and Pdf are zero everywhere. Volumetric
+// materials are phase functions for points inside a medium, which scatter over the whole sphere and
+// have no surface normal, so no cosine applies to them.
+class Material {
 public:
-    // Constructor
-    Lambertian(const Colour& _albedo) : texture(make_shared<SolidColour>(_albedo)) {}
-    Lambertian(shared_ptr<Texture> _texture) : texture(_texture) {}
+    // Parameter Blocks
+    struct LambertianBSDF {
+        shared_ptr<Texture> texture;
+        TextureProgram program;     // Texture compiled for evaluation
+    };
+    struct MetalBSDF {
+        Colour albedo;
+        double fuzziness;
+    };
+    struct DielectricBSDF {
+        double refractive_index;
+    };
+    struct LightEmitter {
+        shared_ptr<Texture> texture;
+        TextureProgram program;
+    };
+    struct IsotropicPhase {
+        shared_ptr<Texture> texture;    // Single-scattering albedo
+        TextureProgram program;
+    };
 
     // Methods
-    bool Scatter(const Ray& ray_in, const Intersection& isect, Colour& attenuation, Ray& scattered)
-    const override {
-        auto random_dir = isect.normal + RandomVec3Unit();
-        Unitize(random_dir);
-        scattered = Ray(isect.coords, random_dir, ray_in.time);
-        attenuation = texture->Value(isect.u, isect.v, isect.coords);
-        return true;
-    }
-
-    // Members
-    shared_ptr<Texture> texture;
-};
+    MaterialType Type() const { return type; }
+    bool IsEmissive() const { return emissive; }
+    bool IsSpecular() const { return specular; }
+    bool IsVolumetric() const { return volumetric; }
+    template <typename Block>
+    const Block& Params() const { return *std::get_if<Block>(&params); }
 
-class Metal : public Material {
-public:
-    // Constructor
-    Metal(const Colour& _albedo, double _fuzziness)
-     : albedo(_albedo), fuzziness(_fuzziness < 1 ? _fuzziness : 1) {}
-
-    // Methods
-    bool Scatter(const Ray& ray_in, const Intersection& isect, Colour& attenuation, Ray& scattered)
-    const override {
-        auto reflect_dir = Reflect(-ray_in.dir, isect.normal) + RandomVec3Unit() * fuzziness;
-        Unitize(reflect_dir);
-        scattered = Ray(isect.coords, reflect_dir, ray_in.time);
-        attenuation = albedo;
-        return Dot(scattered.dir, isect.normal) > 0;
+    // Draw an incident direction wi for the outgoing direction wo (both unit and pointing away from the
+    // surface). False when the path is absorbed.
+    bool Sample(const Vector3& wo, const Intersection& isect, BSDFSample& sample) const {
+        Frame frame(isect.normal);
+        auto wo_local = frame.ToLocal(wo);
+        switch (type) {
+            case MaterialType::Lambertian: {
+                auto wi_local = RandomVec3Cosine();
+                if (wi_local.z <= 0) return false;
+                auto albedo = Params<LambertianBSDF>().program.Value(isect.u, isect.v, isect.coords, isect.footprint);
+                sample.wi = frame.ToWorld(wi_local);
+                sample.f = albedo * M_1_PI;
+                sample.pdf = wi_local.z * M_1_PI;
+                sample.weight = albedo;
+                sample.delta = false;
+                return true;
+            }
+            case MaterialType::Metal: {
+                const auto& metal = Params<MetalBSDF>();
+                if (wo_local.z <= 0) return false;
+                double alpha = GGXAlpha(metal.fuzziness);
+                if (alpha == 0) {
+                    sample.wi = Reflect(wo, isect.normal);
+                    sample.f = Colour(0.0);
+                    sample.pdf = 0.0;
+                    sample.weight = Schlick(metal.albedo, wo_local.z);
+                    sample.delta = true;
+                    return true;
+                }
+                auto wm = SampleGGXVNDF(wo_local, alpha);
+                auto wi_local = Reflect(wo_local, wm);
+                if (wi_local.z <= 0) return false;
+                auto fresnel = Schlick(metal.albedo, Dot(wo_local, wm));
+                double lambda_o = GGXLambda(wo_local, alpha), lambda_i = GGXLambda(wi_local, alpha);
+                double d = GGXD(wm, alpha);
+                sample.wi = frame.ToWorld(wi_local);
+                sample.f = fresnel * (d / ((1 + lambda_o + lambda_i) * 4 * wo_local.z * wi_local.z));
+                sample.pdf = d / ((1 + lambda_o) * 4 * wo_local.z);
+                sample.weight = fresnel * ((1 + lambda_o) / (1 + lambda_o + lambda_i));
+                sample.delta = false;
+                return true;
+            }
+            case MaterialType::Dielectric: {
+                double refractive_index = Params<DielectricBSDF>().refractive_index;
+                double eta = isect.outside ? refractive_index : (1.0 / refractive_index);
+                Vector3 transmit_dir;
+                double cos_theta = Min(wo_local.z, 1.0);
+                if (!Refract(wo, transmit_dir, isect.normal, eta) || RandomFloat() < Fresnel(cos_theta, eta))
+                    sample.wi = Reflect(wo, isect.normal);
+                else
+                    sample.wi = transmit_dir;
+                sample.f = Colour(0.0);
+                sample.pdf = 0.0;
+                sample.weight = Colour(1.0, 1.0, 1.0);
+                sample.delta = true;
+                return true;
+            }
+            case MaterialType::Light: return false;
+            case MaterialType::Isotropic: {
+                sample.wi = RandomVec3Unit();
+                sample.weight = Params<IsotropicPhase>().program.Value(isect.u, isect.v, isect.coords, isect.footprint);
+                sample.f = sample.weight * (0.25 * M_1_PI);
+                sample.pdf = 0.25 * M_1_PI;
+                sample.delta = false;
+                return true;
+            }
+        }
+        return false;
+    }
+    // BSDF value f(wo, wi), without the cosine. Zero for delta lobes, which only Sample can reach.
+    Colour Eval(const Vector3& wo, const Vector3& wi, const Intersection& isect) const {
+        if (volumetric) 
+            return Params<IsotropicPhase>().program.Value(isect.u, isect.v, isect.coords, isect.footprint) * (0.25 * M_1_PI);
+        Frame frame(isect.normal);
+        auto wo_local = frame.ToLocal(wo), wi_local = frame.ToLocal(wi);
+        if (wo_local.z <= 0 || wi_local.z <= 0) return Colour(0.0);
+        switch (type) {
+            case MaterialType::Lambertian:
+                return Params<LambertianBSDF>().program.Value(isect.u, isect.v, isect.coords, isect.footprint) * M_1_PI;
+            case MaterialType::Metal: {
+                const auto& metal = Params<MetalBSDF>();
+                double alpha = GGXAlpha(metal.fuzziness);
+                if (alpha == 0) return Colour(0.0);
+                auto wm = Normalize(wo_local + wi_local);
+                double g2 = 1 / (1 + GGXLambda(wo_local, alpha) + GGXLambda(wi_local, alpha));
+                return Schlick(metal.albedo, Dot(wo_local, wm)) * 
+                       (GGXD(wm, alpha) * g2 / (4 * wo_local.z * wi_local.z));
+            }
+            default: return Colour(0.0);
+        }
+    }
+    // Solid angle density with which Sample picks wi given wo. Zero for delta lobes.
+    double Pdf(const Vector3& wo, const Vector3& wi, const Intersection& isect) const {
+        if (volumetric) return 0.25 * M_1_PI;
+        Frame frame(isect.normal);
+        auto wo_local = frame.ToLocal(wo), wi_local = frame.ToLocal(wi);
+        if (wo_local.z <= 0 || wi_local.z <= 0) return 0.0;
+        switch (type) {
+            case MaterialType::Lambertian: return wi_local.z * M_1_PI;
+            case MaterialType::Metal: {
+                double alpha = GGXAlpha(Params<MetalBSDF>().fuzziness);
+                if (alpha == 0) return 0.0;
+                auto wm = Normalize(wo_local + wi_local);
+                return GGXD(wm, alpha) / ((1 + GGXLambda(wo_local, alpha)) * 4 * wo_local.z);
+            }
+            default: return 0.0;
+        }
+    }
+    Colour Emission(double u, double v, const Point3& p) const {
+        if (!emissive) return Colour(0.0);
+        return Params<LightEmitter>().program.Value(u, v, p, 0.0);
+    }
+    // Reflectance of a batch of shading points, for diffuse, metal and volumetric materials.
+    void Albedo(const double* u, const double* v, const Point3* p, const double* footprint, 
+                Colour* out, size_t n) const {
+        switch (type) {
+            case MaterialType::Lambertian: Params<LambertianBSDF>().program.Value(u, v, p, footprint, out, n); break;
+            case MaterialType::Isotropic:  Params<IsotropicPhase>().program.Value(u, v, p, footprint, out, n); break;
+            case MaterialType::Metal:      std::fill(out, out + n, Params<MetalBSDF>().albedo); break;
+            default:                       std::fill(out, out + n, Colour(1.0)); break;
+        }
+    }
+    // Emission of a batch of points.
+    void Emission(const double* u, const double* v, const Point3* p, const double* footprint, 
+                  Colour* out, size_t n) const {
+        if (emissive) Params<LightEmitter>().program.Value(u, v, p, footprint, out, n);
+        else std::fill(out, out + n, Colour(0.0));
     }
 
-    // Members
-    Colour albedo;
-    double fuzziness;
-};
+protected:
+    // Constructors
+    Material(LambertianBSDF block) 
+     : params(std::move(block)), type(MaterialType::Lambertian), emissive(false), specular(false), volumetric(false) {}
+    Material(MetalBSDF block) 
+     : params(block), type(MaterialType::Metal), emissive(false), specular(GGXAlpha(block.fuzziness) == 0), 
+       volumetric(false) {}
+    Material(DielectricBSDF block) 
+     : params(std::move(block)), type(MaterialType::Dielectric), emissive(false), specular(true), volumetric(false) {}
+    Material(LightEmitter block) 
+     : params(std::move(block)), type(MaterialType::Light), emissive(true), specular(false), volumetric(false) {}
+    Material(IsotropicPhase block) 
+     : params(std::move(block)), type(MaterialType::Isotropic), emissive(false), specular(false), volumetric(true) {}
 
-class Dielectric : public Material {
-public:
-    // Constructor
-    Dielectric(double _refractive_index) : refractive_index(_refractive_index) {}
+private:
+    // Members
+    std::variant<LambertianBSDF, MetalBSDF, DielectricBSDF, LightEmitter, IsotropicPhase> params;
+    MaterialType type;
+    bool emissive;
+    bool specular;
+    bool volumetric;
 
     // Methods
-    bool Scatter(const Ray& ray_in, const Intersection& isect, Colour& attenuation, Ray& scattered)
-    const override {
-        double eta = isect.outside ? refractive_index : (1.0 / refractive_index);
-        attenuation = Colour(1.0, 1.0, 1.0);
-        Vector3 transmit_dir;
-        double cos_theta = Min(Dot(-ray_in.dir, isect.normal), 1.0);
-        if (!Refract(-ray_in.dir, transmit_dir, isect.normal, eta) ||
-            RandomFloat() < Fresnel(cos_theta, eta)) 
-            scattered = Ray(isect.coords, Reflect(-ray_in.dir, isect.normal), ray_in.time);
-        else
-            scattered = Ray(isect.coords, transmit_dir, ray_in.time);
-        return true;
+    // Fuzziness maps straight to GGX roughness; below the cutoff the lobe is treated as a mirror.
+    static double GGXAlpha(double fuzziness) { return fuzziness < 1e-3 ? 0.0 : fuzziness; }
+    // Trowbridge-Reitz distribution of microfacet normals, in the local frame
+    static double GGXD(const Vector3& wm, double alpha) {
+        double a2 = Sqr(alpha);
+        return a2 / (M_PI * Sqr(Sqr(wm.z) * (a2 - 1) + 1));
+    }
+    // Smith masking auxiliary, G1(w) = 1 / (1 + Λ(w))
+    static double GGXLambda(const Vector3& w, double alpha) {
+        double cos2 = Sqr(w.z);
+        if (cos2 <= 0) return POS_INF;
+        return (Sqrt(1 + Sqr(alpha) * (1 - cos2) / cos2) - 1) / 2;
+    }
+    // Sample a microfacet normal from the distribution of normals visible from wo (Heitz, "Sampling
+    // the GGX Distribution of Visible Normals", 2018).
+    static Vector3 SampleGGXVNDF(const Vector3& wo, double alpha) {
+        auto vh = Normalize(Vector3(alpha * wo.x, alpha * wo.y, wo.z));
+        double len2 = Sqr(vh.x) + Sqr(vh.y);
+        auto t1 = len2 > 0 ? Vector3(-vh.y, vh.x, 0) / Sqrt(len2) : Vector3(1, 0, 0);
+        auto t2 = Cross(vh, t1);
+        double r = Sqrt(RandomFloat()), φ = 2 * M_PI * RandomFloat();
+        double p1 = r * Cos(φ), p2 = r * Sin(φ);
+        double s = 0.5 * (1 + vh.z);
+        p2 = (1 - s) * Sqrt(1 - Sqr(p1)) + s * p2;
+        auto nh = p1 * t1 + p2 * t2 + Sqrt(Max(0.0, 1 - Sqr(p1) - Sqr(p2))) * vh;
+        return Normalize(Vector3(alpha * nh.x, alpha * nh.y, Max(0.0, nh.z)));
+    }
+    static Colour Schlick(const Colour& f0, double cos_theta) {
+        return f0 + (Colour(1.0) - f0) * std::pow(1 - Min(Max(cos_theta, 0.0), 1.0), 5);
     }
-
-private:
-    // Methods
     static double Fresnel(double cos_i, double eta) {
         // wi outward n // etat / etai
         auto sin2i = 1 - Sqr(cos_i);
@@ -95,25 +253,41 @@ private:
         auto fr_perp = (cos_i - eta * cos_r) / (cos_i + eta * cos_r);
         return (Sqr(fr_parl) + Sqr(fr_perp)) / 2;
     }
+};
 
-    // Members
-    double refractive_index;
+
+class Lambertian : public Material {
+public:
+    // Constructor
+    Lambertian(const Colour& _albedo) : Lambertian(make_shared<SolidColour>(_albedo)) {}
+    Lambertian(shared_ptr<Texture> _texture) : Material(LambertianBSDF{_texture, TextureProgram(_texture)}) {}
 };
 
-class Light : public Material {
+class Metal : public Material {
+public:
+    // Constructor
+    Metal(const Colour& _albedo, double _fuzziness)
+     : Material(MetalBSDF{_albedo, _fuzziness < 1 ? _fuzziness : 1}) {}
+};
+
+class Dielectric : public Material {
 public:
     // Constructor
-    Light(shared_ptr<Texture> _texture) : texture(_texture) {}
-    Light(const Colour& _colour) : texture(make_shared<SolidColour>(_colour)) {}
+    Dielectric(double _refractive_index) : Material(DielectricBSDF{_refractive_index}) {}
+};
 
-    // Methods
-    Colour Emission(double u, double v, const Point3& p) const override {
-        return texture->Value(u, v, p);
-    }
+class Light : public Material {
+public:
+    // Constructor
+    Light(shared_ptr<Texture> _texture) : Material(LightEmitter{_texture, TextureProgram(_texture)}) {}
+    Light(const Colour& _colour) : Light(make_shared<SolidColour>(_colour)) {}
+};
 
-private:
-    // Members
-    shared_ptr<Texture> texture;
+class Isotropic : public Material {
+public:
+    // Constructor
+    Isotropic(shared_ptr<Texture> _texture) : Material(IsotropicPhase{_texture, TextureProgram(_texture)}) {}
+    Isotropic(const Colour& _albedo) : Isotropic(make_shared<SolidColour>(_albedo)) {}
 };
 
 
@@ -0,0 +1,202 @@
+#pragma once
+#ifndef MEDIUM_H
+#define MEDIUM_H
+
+#include <cmath>
+
+#include "global.h"
+#include "mathematics.h"
+#include "bounds.h"
+#include "shapes.h"
+#include "scene.h"
+#include "material.h"
+
+// Cells per axis of a heterogeneous medium's majorant grid, at most.
+constexpr int MAJORANT_RES = 16;
+
+// Extinction of a participating medium: the chance per unit length that light collides with it.
+// It is either constant, or interpolated trilinearly from a lattice of samples whose corners are the
+// corners of a box, and zero outside it. A lattice keeps a coarse grid holding the largest density
+// in each cell, its majorant, and collisions are found by delta tracking (Woodcock et al., 1965)
+// against that piecewise-constant bound as in Szirmay-Kalos et al., "Free Path Sampling in High
+// Resolution Inhomogeneous Participating Media" (2011): tentative collisions are drawn with the
+// cell's majorant and kept in proportion to the density there. Empty cells are stepped over without
+// a single sample, and a tight bound in each cell wastes few rejections.
+class Medium {
+public:
+    // Constructors
+    Medium(double _density) : density(_density) {}
+    // Samples run along x first, then y, then z, nx·ny·nz of them with at least two per axis.
+    Medium(const Bounds3& _bounds, int nx, int ny, int nz, vector<float> _samples, double _scale = 1.0)
+        : density(_scale), bounds(_bounds), size{nx, ny, nz}, samples(std::move(_samples)) {
+        if (nx < 2 || ny < 2 || nz < 2 || samples.size() != size_t(nx) * ny * nz) {
+            std::cerr << "ERROR: Medium needs nx·ny·nz samples, at least two along each axis.\n";
+            samples.clear();
+            density = 0.0;
+            return;
+        }
+        for (int axis = 0; axis < 3; axis += 1) {
+            res[axis] = Min(MAJORANT_RES, size[axis] - 1);
+            cell[axis] = bounds[axis].size / res[axis];
+        }
+        // Trilinear interpolation never exceeds the lattice points around it, so the largest of those
+        // touching a cell bounds the density anywhere inside
+        majorants.assign(res[0] * res[1] * res[2], 0.0);
+        int lo[3][MAJORANT_RES], hi[3][MAJORANT_RES];
+        for (int axis = 0; axis < 3; axis += 1)
+            for (int c = 0; c < res[axis]; c += 1) {
+                double scale = double(size[axis] - 1) / res[axis];
+                lo[axis][c] = int(std::floor(c * scale));
+                hi[axis][c] = Min(int(std::ceil((c + 1) * scale)), size[axis] - 1);
+            }
+        for (int z = 0; z < res[2]; z += 1)
+            for (int y = 0; y < res[1]; y += 1)
+                for (int x = 0; x < res[0]; x += 1) {
+                    float largest = 0.0f;
+                    for (int k = lo[2][z]; k <= hi[2][z]; k += 1)
+                        for (int j = lo[1][y]; j <= hi[1][y]; j += 1)
+                            for (int i = lo[0][x]; i <= hi[0][x]; i += 1) largest = Max(largest, Sample(i, j, k));
+                    majorants[(z * res[1] + y) * res[0] + x] = largest * density;
+                }
+    }
+
+    // Methods
+    bool Homogeneous() const { return samples.empty(); }
+    double Density(const Point3& p) const {
+        if (samples.empty()) return density;
+        int index[3];
+        double frac[3];
+        for (int axis = 0; axis < 3; axis += 1) {
+            double g = (p[axis] - bounds[axis]._min) / bounds[axis].size * (size[axis] - 1);
+            if (!(g >= 0 && g <= size[axis] - 1)) return 0.0;
+            index[axis] = Min(int(g), size[axis] - 2);
+            frac[axis] = g - index[axis];
+        }
+        double value = 0.0;
+        for (int corner = 0; corner < 8; corner += 1) {
+            int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+            double weight = (dx ? frac[0] : 1 - frac[0]) * (dy ? frac[1] : 1 - frac[1]) * (dz ? frac[2] : 1 - frac[2]);
+            value += weight * Sample(index[0] + dx, index[1] + dy, index[2] + dz);
+        }
+        return value * density;
+    }
+    // Distance t along ray, within [t_min, t_max], of its first real collision with the medium; false
+    // if the ray gets through.
+    bool SampleCollision(const Ray& ray, double t_min, double t_max, double& t) const {
+        double length = Length(ray.dir);
+        if (samples.empty()) {
+            if (density <= 0) return false;
+            t = t_min - std::log(1 - RandomFloat()) / (density * length);
+            return t < t_max;
+        }
+        auto inv_dir = Vector3(1.0/ray.dir.x, 1.0/ray.dir.y, 1.0/ray.dir.z);
+        for (int axis = 0; axis < 3; axis += 1) {
+            double t0 = (bounds[axis]._min - ray.org[axis]) * inv_dir[axis];
+            double t1 = (bounds[axis]._max - ray.org[axis]) * inv_dir[axis];
+            if (t0 > t1) Swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+        }
+        if (!(t_min < t_max)) return false;
+
+        // Walk the majorant cells the ray crosses, in the manner of PrimitiveGrid
+        int current[3], step[3], stop[3];
+        double t_next[3], t_delta[3];
+        auto entry = ray(t_min);
+        for (int axis = 0; axis < 3; axis += 1) {
+            int c = int(std::floor((entry[axis] - bounds[axis]._min) / cell[axis]));
+            current[axis] = Min(Max(c, 0), res[axis] - 1);
+            double lower = bounds[axis]._min + current[axis] * cell[axis];
+            if (ray.dir[axis] > 0) {
+                step[axis] = 1; stop[axis] = res[axis];
+                t_next[axis] = (lower + cell[axis] - ray.org[axis]) * inv_dir[axis];
+                t_delta[axis] = cell[axis] * inv_dir[axis];
+            } else if (ray.dir[axis] < 0) {
+                step[axis] = -1; stop[axis] = -1;
+                t_next[axis] = (lower - ray.org[axis]) * inv_dir[axis];
+                t_delta[axis] = -cell[axis] * inv_dir[axis];
+            } else {
+                step[axis] = 0; stop[axis] = -1;
+                t_next[axis] = POS_INF;
+                t_delta[axis] = POS_INF;
+            }
+        }
+        double t_enter = t_min;
+        while (true) {
+            int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+            double t_leave = Min(t_next[axis], t_max);
+            double majorant = majorants[(current[2] * res[1] + current[1]) * res[0] + current[0]];
+            if (majorant > 0) {
+                // Free flights are memoryless, so each cell starts afresh from where the ray enters it
+                t = t_enter;
+                while (true) {
+                    t -= std::log(1 - RandomFloat()) / (majorant * length);
+                    if (t >= t_leave) break;
+                    if (RandomFloat() * majorant < Density(ray(t))) return true;
+                }
+            }
+            if (t_leave >= t_max) return false;
+            t_enter = t_leave;
+            current[axis] += step[axis];
+            if (current[axis] == stop[axis]) return false;
+            t_next[axis] += t_delta[axis];
+        }
+    }
+
+private:
+    // Members
+    double density;                 // Of a homogeneous medium, or the factor on every lattice sample
+    Bounds3 bounds;
+    int size[3] = {0, 0, 0};        // Lattice samples along each axis
+    int res[3] = {0, 0, 0};         // Majorant cells along each axis
+    double cell[3] = {0.0, 0.0, 0.0};
+    vector<float> samples;
+    vector<double> majorants;
+
+    // Methods
+    float Sample(int x, int y, int z) const { return samples[(size_t(z) * size[1] + y) * size[0] + x]; }
+};
+
+// Participating medium filling a convex shape, after the constant medium of Ray Tracing: The Next
+// Week, which it extends to media of varying density. To the rest of the renderer it is one more
+// shape: where a ray crossing the boundary collides with the medium counts as its hit, with the
+// phase function as its material and no normal, and a ray that gets through hits nothing. Shadow
+// rays are thereby blocked with the probability that the medium absorbs or scatters their light.
+class Volume : public Shapes {
+public:
+    // Constructors
+    Volume(shared_ptr<Shapes> _boundary, shared_ptr<Medium> _medium, shared_ptr<Material> _phase)
+        : boundary(_boundary), medium(_medium), phase(_phase) {}
+    Volume(shared_ptr<Shapes> _boundary, double density, const Colour& albedo)
+        : Volume(_boundary, make_shared<Medium>(density), make_shared<Isotropic>(albedo)) {}
+
+    // Methods
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        // Where the line of the ray enters and leaves the boundary, which may be behind its origin
+        Intersection enter, leave;
+        if (!boundary->Intersect(ray, Interval::Universe, enter)) return false;
+        if (!boundary->Intersect(ray, Interval(enter.time + EPS_UNIT, POS_INF), leave)) return false;
+        double t_min = Max(enter.time, ray_time._min), t_max = Min(leave.time, ray_time._max);
+        if (t_min >= t_max) return false;
+        double t;
+        if (!medium->SampleCollision(ray, t_min, t_max, t)) return false;
+        isect.time = t;
+        isect.coords = ray(t);
+        isect.normal = Vector3(0.0);
+        isect.outside = true;
+        isect.material = phase.get();
+        isect.u = isect.v = 0.0;
+        isect.footprint = 0.0;
+        return true;
+    }
+    Bounds3 BBox() const override { return boundary->BBox(); }
+
+private:
+    // Members
+    shared_ptr<Shapes> boundary;
+    shared_ptr<Medium> medium;
+    shared_ptr<Material> phase;
+};
+
+
+#endif // MEDIUM_H
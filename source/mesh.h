@@ -0,0 +1,605 @@
+#pragma once
+#ifndef MESH_H
+#define MESH_H
+
+#include <omp.h>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <sstream>
+#include <unordered_map>
+
+#include "global.h"
+#include "mathematics.h"
+#include "shapes.h"
+#include "bounds.h"
+#include "mappedfile.h"
+
+// Triangles MeshView::IntersectTriangles tests side by side.
+constexpr int TRIANGLE_LANES = 4;
+
+// Non-owning view of indexed triangle buffers, pointing into a TriangleMesh or a mapped scene cache.
+struct MeshView {
+    const uint32_t* indices = nullptr;     // Three vertex indices per triangle
+    const float*    positions = nullptr;   // xyz per vertex
+    const float*    normals = nullptr;     // xyz per vertex, or null
+    const float*    uvs = nullptr;         // uv per vertex, or null
+    uint32_t triangles = 0, vertices = 0;
+
+    // Methods
+    Point3 Position(uint32_t vertex) const 
+    { return Point3(positions[3*vertex], positions[3*vertex+1], positions[3*vertex+2]); }
+    Vector3 Normal(uint32_t vertex) const 
+    { return Vector3(normals[3*vertex], normals[3*vertex+1], normals[3*vertex+2]); }
+    Bounds3 TriangleBBox(uint32_t tri) const {
+        auto p0 = Position(indices[3*tri]), p1 = Position(indices[3*tri+1]), p2 = Position(indices[3*tri+2]);
+        return Union(Bounds3(p0, p1), Bounds3(p2, p2));
+    }
+    // Watertight ray-triangle test (Woop, Benthin and Wald 2013). Vertices are sheared into a ray
+    // space where the direction is +z, so edges shared by two triangles are evaluated identically 
+    // and rays cannot slip through them.
+    bool IntersectTriangle(uint32_t tri, const Ray& ray, Interval ray_time, Intersection& isect) const {
+        return IntersectTriangles(&tri, 1, ray, ray_time, isect);
+    }
+    // The same test on up to TRIANGLE_LANES triangles side by side, as SphereCluster does for spheres:
+    // the shear is set up once per ray, vertices are gathered lane by lane, and the edge functions and 
+    // distances of every lane are found in one vectorised pass. Only the nearest lane gets a full hit
+    // record. Single triangles go through here too, so every path shears edges the same way.
+    bool IntersectTriangles(const uint32_t* tris, int n, const Ray& ray, Interval ray_time, Intersection& isect) const {
+        int kz = Abs(ray.dir.x) > Abs(ray.dir.y) ? (Abs(ray.dir.x) > Abs(ray.dir.z) ? 0 : 2)
+                                                 : (Abs(ray.dir.y) > Abs(ray.dir.z) ? 1 : 2);
+        int kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+        if (ray.dir[kz] < 0) Swap(kx, ky);
+        const double Sx = ray.dir[kx] / ray.dir[kz], Sy = ray.dir[ky] / ray.dir[kz], Sz = 1.0 / ray.dir[kz];
+        const double ox = ray.org[kx], oy = ray.org[ky], oz = ray.org[kz];
+        const double t_min = ray_time._min, t_max = ray_time._max;
+
+        // Vertices in ray space, lane by lane; unused lanes hold a degenerate triangle
+        alignas(64) double ax[TRIANGLE_LANES] = {}, ay[TRIANGLE_LANES] = {}, az[TRIANGLE_LANES] = {};
+        alignas(64) double bx[TRIANGLE_LANES] = {}, by[TRIANGLE_LANES] = {}, bz[TRIANGLE_LANES] = {};
+        alignas(64) double cx[TRIANGLE_LANES] = {}, cy[TRIANGLE_LANES] = {}, cz[TRIANGLE_LANES] = {};
+        for (int k = 0; k < n; k += 1) {
+            const float* a = positions + 3 * indices[3*tris[k]];
+            const float* b = positions + 3 * indices[3*tris[k]+1];
+            const float* c = positions + 3 * indices[3*tris[k]+2];
+            ax[k] = a[kx] - ox; ay[k] = a[ky] - oy; az[k] = a[kz] - oz;
+            bx[k] = b[kx] - ox; by[k] = b[ky] - oy; bz[k] = b[kz] - oz;
+            cx[k] = c[kx] - ox; cy[k] = c[ky] - oy; cz[k] = c[kz] - oz;
+        }
+        alignas(64) double u_lane[TRIANGLE_LANES], v_lane[TRIANGLE_LANES], w_lane[TRIANGLE_LANES];
+        alignas(64) double t_lane[TRIANGLE_LANES];
+        #pragma omp simd aligned(ax, ay, az, bx, by, bz, cx, cy, cz, u_lane, v_lane, w_lane, t_lane:64)
+        for (int k = 0; k < TRIANGLE_LANES; k += 1) {
+            double Ax = ax[k] - Sx * az[k], Ay = ay[k] - Sy * az[k];
+            double Bx = bx[k] - Sx * bz[k], By = by[k] - Sy * bz[k];
+            double Cx = cx[k] - Sx * cz[k], Cy = cy[k] - Sy * cz[k];
+            double U = Cx * By - Cy * Bx;
+            double V = Ax * Cy - Ay * Cx;
+            double W = Bx * Ay - By * Ax;
+            bool inside = !((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0));
+            double det = U + V + W;
+            double T = U * Sz * az[k] + V * Sz * bz[k] + W * Sz * cz[k];
+            double t = T / (det != 0 ? det : 1.0);
+            bool valid = k < n && inside && det != 0 && t > t_min && t < t_max;
+            u_lane[k] = U; v_lane[k] = V; w_lane[k] = W;
+            t_lane[k] = valid ? t : POS_INF;
+        }
+        int nearest = 0;
+        for (int k = 1; k < TRIANGLE_LANES; k += 1) 
+            if (t_lane[k] < t_lane[nearest]) nearest = k;
+        if (t_lane[nearest] == POS_INF) return false;
+
+        uint32_t tri = tris[nearest];
+        uint32_t i0 = indices[3*tri], i1 = indices[3*tri+1], i2 = indices[3*tri+2];
+        double t = t_lane[nearest];
+        double det_inv = 1.0 / (u_lane[nearest] + v_lane[nearest] + w_lane[nearest]);
+        double b0 = u_lane[nearest] * det_inv, b1 = v_lane[nearest] * det_inv, b2 = w_lane[nearest] * det_inv;
+        auto geometric_normal = Normalize(Cross(Position(i1) - Position(i0), Position(i2) - Position(i0)));
+        isect.SetOutward(ray, geometric_normal);
+        if (normals != nullptr) {
+            auto shading = Normalize(b0 * Normal(i0) + b1 * Normal(i1) + b2 * Normal(i2));
+            isect.normal = Dot(shading, isect.normal) < 0 ? -shading : shading;
+        }
+        // Texture units per unit length from the ratio of the uv and world areas of the triangle
+        double uv_area = 1.0;
+        if (uvs != nullptr) {
+            isect.u = b0 * uvs[2*i0]   + b1 * uvs[2*i1]   + b2 * uvs[2*i2];
+            isect.v = b0 * uvs[2*i0+1] + b1 * uvs[2*i1+1] + b2 * uvs[2*i2+1];
+            uv_area = Abs((uvs[2*i1] - uvs[2*i0]) * (uvs[2*i2+1] - uvs[2*i0+1]) - 
+                          (uvs[2*i2] - uvs[2*i0]) * (uvs[2*i1+1] - uvs[2*i0+1]));
+        } else {
+            isect.u = b1;
+            isect.v = b2;
+        }
+        isect.coords = ray(t);
+        isect.time = t;
+        isect.SetFootprint(ray, Sqrt(uv_area / Max(Length(Cross(Position(i1) - Position(i0), Position(i2) - Position(i0))), EPS_QUAT)));
+        return true;
+    }
+};
+
+// Indexed triangle mesh. Vertex attributes live in flat single-precision buffers shared by all 
+// triangles, so memory stays close to the size of the raw data. Add it to a PrimitiveStore to get
+// one BVH reference per triangle; the Shapes interface alone tests every triangle.
+class TriangleMesh : public Shapes {
+public:
+    // Constructors
+    TriangleMesh() = default;
+    TriangleMesh(vector<uint32_t> _indices, vector<float> _positions, shared_ptr<Material> _material)
+     : indices(std::move(_indices)), positions(std::move(_positions)), material(_material) {}
+
+    // Methods
+    size_t Triangles() const { return indices.size() / 3; }
+    size_t Vertices() const { return positions.size() / 3; }
+    MeshView View() const {
+        MeshView view;
+        view.indices = indices.data();
+        view.positions = positions.data();
+        view.normals = normals.empty() ? nullptr : normals.data();
+        view.uvs = uvs.empty() ? nullptr : uvs.data();
+        view.triangles = Triangles();
+        view.vertices = Vertices();
+        return view;
+    }
+    Point3 Position(uint32_t vertex) const { return View().Position(vertex); }
+    Bounds3 TriangleBBox(uint32_t tri) const { return View().TriangleBBox(tri); }
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        bool happened = false;
+        auto view = View();
+        uint32_t tris[TRIANGLE_LANES];
+        for (uint32_t first = 0; first < Triangles(); first += TRIANGLE_LANES) {
+            int n = Min<size_t>(TRIANGLE_LANES, Triangles() - first);
+            for (int k = 0; k < n; k += 1) tris[k] = first + k;
+            if (view.IntersectTriangles(tris, n, ray, ray_time, isect)) {
+                happened = true;
+                ray_time._max = isect.time;
+                isect.material = material.get();
+            }
+        }
+        return happened;
+    }
+    Bounds3 BBox() const override {
+        auto bounds = Bounds3::Empty;
+        for (uint32_t vertex = 0; vertex < Vertices(); vertex += 1) 
+            bounds = Union(bounds, Bounds3(Position(vertex), Position(vertex)));
+        return bounds;
+    }
+    // Bake a transform into the vertex buffers.
+    void ApplyTransform(const Transform& transform) {
+        transform.ApplyPoints(positions.data(), Vertices());
+        if (normals.empty()) return;
+        transform.ApplyNormals(normals.data(), Vertices());
+        #pragma omp parallel for simd if(Vertices() > TRANSFORM_GRAIN) schedule(static)
+        for (int64_t vertex = 0; vertex < int64_t(Vertices()); vertex += 1) {
+            float x = normals[3*vertex], y = normals[3*vertex+1], z = normals[3*vertex+2];
+            float length_inv = 1.0f / std::sqrt(x * x + y * y + z * z);
+            normals[3*vertex] = x * length_inv; normals[3*vertex+1] = y * length_inv; normals[3*vertex+2] = z * length_inv;
+        }
+    }
+
+    // Members
+    vector<uint32_t> indices;     // Three vertex indices per triangle
+    vector<float>    positions;   // xyz per vertex
+    vector<float>    normals;     // xyz per vertex, or empty
+    vector<float>    uvs;         // uv per vertex, or empty
+    shared_ptr<Material> material;
+};
+
+
+// Mesh Loading
+// Both loaders map the file and decode it on all threads: OBJ in newline-aligned chunks whose 
+// relative indices are resolved after a prefix sum, binary PLY record by record.
+
+struct OBJCorner { int64_t v, vt, vn; };
+
+constexpr int64_t OBJ_MISSING  = std::numeric_limits<int64_t>::min();
+constexpr int64_t OBJ_RELATIVE = int64_t(1) << 40;   // Offset marking indices relative to a chunk
+
+inline const char* SkipBlank(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p += 1;
+    return p;
+}
+inline const char* SkipLine(const char* p, const char* end) {
+    while (p < end && *p != '\n') p += 1;
+    return p < end ? p + 1 : end;
+}
+inline const char* ParseNumber(const char* p, const char* end, float& value) {
+    p = SkipBlank(p, end);
+    if (p < end && *p == '+') p += 1;
+    auto result = std::from_chars(p, end, value);
+    return result.ec == std::errc() ? result.ptr : nullptr;
+}
+inline const char* ParseNumber(const char* p, const char* end, long& value) {
+    if (p < end && *p == '+') p += 1;
+    auto result = std::from_chars(p, end, value);
+    return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+struct OBJChunk {
+    vector<float> positions, texcoords, normals;
+    vector<OBJCorner> corners;
+    bool failed = false;
+
+    // Encode an OBJ index as absolute, or relative to the start of this chunk if negative.
+    static int64_t Encode(long index, size_t count) {
+        if (index > 0) return index - 1;
+        return int64_t(count) + index - OBJ_RELATIVE;
+    }
+    void Parse(const char* p, const char* end) {
+        vector<OBJCorner> polygon;
+        while (p < end && !failed) {
+            p = SkipBlank(p, end);
+            if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+                float x, y, z;
+                const char* q = ParseNumber(p + 2, end, x);
+                if (q) q = ParseNumber(q, end, y);
+                if (q) q = ParseNumber(q, end, z);
+                if (!q) { failed = true; break; }
+                positions.insert(positions.end(), {x, y, z});
+                p = q;
+            } else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+                float u, v = 0;
+                const char* q = ParseNumber(p + 3, end, u);
+                if (!q) { failed = true; break; }
+                const char* r = ParseNumber(q, end, v);
+                texcoords.insert(texcoords.end(), {u, r ? v : 0.0f});
+                p = r ? r : q;
+            } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+                float x, y, z;
+                const char* q = ParseNumber(p + 3, end, x);
+                if (q) q = ParseNumber(q, end, y);
+                if (q) q = ParseNumber(q, end, z);
+                if (!q) { failed = true; break; }
+                normals.insert(normals.end(), {x, y, z});
+                p = q;
+            } else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+                polygon.clear();
+                p += 2;
+                while (true) {
+                    p = SkipBlank(p, end);
+                    if (p >= end || *p == '\n' || *p == '#') break;
+                    long v = 0, vt = 0, vn = 0;
+                    p = ParseNumber(p, end, v);
+                    if (!p) { failed = true; return; }
+                    if (p < end && *p == '/') {
+                        p += 1;
+                        if (p < end && *p != '/') { p = ParseNumber(p, end, vt); if (!p) { failed = true; return; } }
+                        if (p < end && *p == '/') { p = ParseNumber(p + 1, end, vn); if (!p) { failed = true; return; } }
+                    }
+                    polygon.push_back({Encode(v, positions.size()/3),
+                                       vt ? Encode(vt, texcoords.size()/2) : OBJ_MISSING,
+                                       vn ? Encode(vn, normals.size()/3)   : OBJ_MISSING});
+                }
+                for (size_t k = 2; k < polygon.size(); k += 1) 
+                    corners.insert(corners.end(), {polygon[0], polygon[k-1], polygon[k]});
+            }
+            p = SkipLine(p, end);
+        }
+    }
+};
+
+inline shared_ptr<TriangleMesh> LoadOBJ(const std::string& filename) {
+    MappedFile file(filename);
+    if (!file.IsOpen()) {
+        std::cerr << "ERROR: Could not open mesh file '" << filename << "'.\n";
+        return nullptr;
+    }
+    file.Advise(0, file.Size(), MADV_SEQUENTIAL);
+    const char* begin = file.Data();
+    const char* end = begin + file.Size();
+
+    // Split at line boundaries, a few chunks per thread to even out the load
+    int chunk_count = Max<size_t>(1, Min<size_t>(omp_get_max_threads() * 4, file.Size() / (1 << 16)));
+    vector<const char*> cuts(chunk_count + 1, end);
+    cuts[0] = begin;
+    for (int c = 1; c < chunk_count; c += 1) {
+        const char* p = begin + file.Size() * c / chunk_count;
+        cuts[c] = Max(cuts[c-1], SkipLine(p - 1, end));
+    }
+    vector<OBJChunk> chunks(chunk_count);
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < chunk_count; c += 1) 
+        chunks[c].Parse(cuts[c], cuts[c+1]);
+
+    vector<size_t> base_v(chunk_count+1, 0), base_vt(chunk_count+1, 0), base_vn(chunk_count+1, 0), base_c(chunk_count+1, 0);
+    for (int c = 0; c < chunk_count; c += 1) {
+        if (chunks[c].failed) {
+            std::cerr << "ERROR: Malformed OBJ file '" << filename << "'.\n";
+            return nullptr;
+        }
+        base_v[c+1]  = base_v[c]  + chunks[c].positions.size() / 3;
+        base_vt[c+1] = base_vt[c] + chunks[c].texcoords.size() / 2;
+        base_vn[c+1] = base_vn[c] + chunks[c].normals.size() / 3;
+        base_c[c+1]  = base_c[c]  + chunks[c].corners.size();
+    }
+    auto mesh = make_shared<TriangleMesh>();
+    vector<float> texcoords(2 * base_vt[chunk_count]), normals(3 * base_vn[chunk_count]);
+    vector<OBJCorner> corners(base_c[chunk_count]);
+    mesh->positions.resize(3 * base_v[chunk_count]);
+    bool in_range = true, direct = true, all_vt = true, all_vn = true;
+    #pragma omp parallel for reduction(&&:in_range, direct, all_vt, all_vn)
+    for (int c = 0; c < chunk_count; c += 1) {
+        auto& chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), mesh->positions.begin() + 3*base_v[c]);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords.begin() + 2*base_vt[c]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + 3*base_vn[c]);
+        auto resolve = [](int64_t index, size_t base, size_t total, bool& valid) -> int64_t {
+            if (index == OBJ_MISSING) return index;
+            if (index < 0) index += OBJ_RELATIVE + base;
+            valid = valid && index >= 0 && size_t(index) < total;
+            return index;
+        };
+        for (size_t k = 0; k < chunk.corners.size(); k += 1) {
+            auto corner = chunk.corners[k];
+            corner.v  = resolve(corner.v,  base_v[c],  base_v[chunk_count],  in_range);
+            corner.vt = resolve(corner.vt, base_vt[c], base_vt[chunk_count], in_range);
+            corner.vn = resolve(corner.vn, base_vn[c], base_vn[chunk_count], in_range);
+            all_vt = all_vt && corner.vt != OBJ_MISSING;
+            all_vn = all_vn && corner.vn != OBJ_MISSING;
+            direct = direct && (corner.vt == OBJ_MISSING || corner.vt == corner.v) 
+                            && (corner.vn == OBJ_MISSING || corner.vn == corner.v);
+            corners[base_c[c] + k] = corner;
+        }
+        vector<float>().swap(chunk.positions);
+        vector<OBJCorner>().swap(chunk.corners);
+    }
+    if (!in_range) {
+        std::cerr << "ERROR: Face index out of range in OBJ file '" << filename << "'.\n";
+        return nullptr;
+    }
+    mesh->indices.resize(corners.size());
+    if (direct) {
+        // Attributes share the position indices, keep the buffers as they are
+        #pragma omp parallel for
+        for (size_t k = 0; k < corners.size(); k += 1) mesh->indices[k] = corners[k].v;
+        if (all_vt && texcoords.size() / 2 == mesh->Vertices()) mesh->uvs.swap(texcoords);
+        if (all_vn && normals.size() / 3 == mesh->Vertices()) mesh->normals.swap(normals);
+        return mesh;
+    }
+    // Distinct position/uv/normal triples become distinct vertices
+    struct CornerHash {
+        size_t operator()(const OBJCorner& c) const 
+        { return std::hash<int64_t>()(c.v) ^ (std::hash<int64_t>()(c.vt) * 31) ^ (std::hash<int64_t>()(c.vn) * 131); }
+    };
+    struct CornerEqual {
+        bool operator()(const OBJCorner& a, const OBJCorner& b) const 
+        { return a.v == b.v && a.vt == b.vt && a.vn == b.vn; }
+    };
+    std::unordered_map<OBJCorner, uint32_t, CornerHash, CornerEqual> vertex_ids;
+    vertex_ids.reserve(mesh->Vertices() * 2);
+    vector<float> positions;
+    positions.reserve(mesh->positions.size());
+    for (size_t k = 0; k < corners.size(); k += 1) {
+        auto inserted = vertex_ids.emplace(corners[k], uint32_t(positions.size() / 3));
+        if (inserted.second) {
+            const auto& c = corners[k];
+            positions.insert(positions.end(), {mesh->positions[3*c.v], mesh->positions[3*c.v+1], mesh->positions[3*c.v+2]});
+            if (all_vt) mesh->uvs.insert(mesh->uvs.end(), {texcoords[2*c.vt], texcoords[2*c.vt+1]});
+            if (all_vn) mesh->normals.insert(mesh->normals.end(), {normals[3*c.vn], normals[3*c.vn+1], normals[3*c.vn+2]});
+        }
+        mesh->indices[k] = inserted.first->second;
+    }
+    mesh->positions.swap(positions);
+    return mesh;
+}
+
+struct PLYProperty {
+    std::string name;
+    int size = 0;          // Byte size of a scalar, or of the list entries
+    int count_size = 0;    // Byte size of the list length, zero for scalars
+    bool is_float = false, is_signed = false;
+    bool count_is_float = false, count_is_signed = false;
+};
+
+inline int PLYTypeSize(const std::string& type, bool& is_float, bool& is_signed) {
+    is_float  = type == "float" || type == "float32" || type == "double" || type == "float64";
+    is_signed = type == "char" || type == "int8" || type == "short" || type == "int16" || type == "int" || type == "int32";
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") return 1;
+    if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") return 2;
+    if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" || type == "float32") return 4;
+    if (type == "double" || type == "float64") return 8;
+    return 0;
+}
+inline double PLYRead(const char* p, int size, bool is_float, bool is_signed, bool swap_bytes) {
+    unsigned char bytes[8];
+    std::memcpy(bytes, p, size);
+    for (int k = 0; swap_bytes && k < size/2; k += 1) Swap(bytes[k], bytes[size-1-k]);
+    if (is_float) {
+        if (size == 4) { float f; std::memcpy(&f, bytes, 4); return f; }
+        double d; std::memcpy(&d, bytes, 8); return d;
+    }
+    switch (size) {
+        case 1: return is_signed ? double(int8_t(bytes[0])) : double(bytes[0]);
+        case 2: { uint16_t u; std::memcpy(&u, bytes, 2); return is_signed ? double(int16_t(u)) : double(u); }
+        default: { uint32_t u; std::memcpy(&u, bytes, 4); return is_signed ? double(int32_t(u)) : double(u); }
+    }
+}
+// A scalar, or one entry of a list
+inline double PLYRead(const char* p, const PLYProperty& prop, bool swap_bytes) {
+    return PLYRead(p, prop.size, prop.is_float, prop.is_signed, swap_bytes);
+}
+// The length of a list, whose type need not match that of its entries (`list uchar int`)
+inline double PLYReadCount(const char* p, const PLYProperty& prop, bool swap_bytes) {
+    return PLYRead(p, prop.count_size, prop.count_is_float, prop.count_is_signed, swap_bytes);
+}
+
+inline shared_ptr<TriangleMesh> LoadPLY(const std::string& filename) {
+    MappedFile file(filename);
+    if (!file.IsOpen()) {
+        std::cerr << "ERROR: Could not open mesh file '" << filename << "'.\n";
+        return nullptr;
+    }
+    const char* begin = file.Data();
+    const char* end = begin + file.Size();
+    auto fail = [&](const char* reason) -> shared_ptr<TriangleMesh> {
+        std::cerr << "ERROR: " << reason << " in PLY file '" << filename << "'.\n";
+        return nullptr;
+    };
+
+    // Header
+    struct PLYElement { std::string name; size_t count; vector<PLYProperty> props; };
+    vector<PLYElement> elements;
+    bool swap_bytes = false, binary = false;
+    const char* p = begin;
+    while (p < end) {
+        const char* line_end = SkipLine(p, end);
+        std::istringstream line(std::string(p, line_end));
+        std::string keyword;
+        line >> keyword;
+        p = line_end;
+        if (keyword == "format") {
+            std::string format;
+            line >> format;
+            const uint16_t probe = 1;
+            bool host_little = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+            binary = format == "binary_little_endian" || format == "binary_big_endian";
+            swap_bytes = (format == "binary_big_endian") == host_little;
+        } else if (keyword == "element") {
+            PLYElement element;
+            line >> element.name >> element.count;
+            elements.push_back(element);
+        } else if (keyword == "property" && !elements.empty()) {
+            PLYProperty prop;
+            std::string type;
+            line >> type;
+            if (type == "list") {
+                std::string count_type, entry_type;
+                line >> count_type >> entry_type >> prop.name;
+                prop.count_size = PLYTypeSize(count_type, prop.count_is_float, prop.count_is_signed);
+                prop.size = PLYTypeSize(entry_type, prop.is_float, prop.is_signed);
+            } else {
+                line >> prop.name;
+                prop.size = PLYTypeSize(type, prop.is_float, prop.is_signed);
+            }
+            if (prop.size == 0) return fail("Unknown property type");
+            elements.back().props.push_back(prop);
+        } else if (keyword == "end_header") {
+            break;
+        }
+    }
+    if (!binary) return fail("Only binary encodings are supported");
+
+    // Indices are checked while still doubles, as converting one out of range is undefined
+    double vertex_count = 0;
+    for (const auto& element : elements) 
+        if (element.name == "vertex") vertex_count = double(Min(element.count, size_t(UINT32_MAX)));
+    auto ToIndex = [vertex_count](double value, uint32_t& index) {
+        if (!(value >= 0 && value < vertex_count)) return false;
+        index = uint32_t(value);
+        return true;
+    };
+
+    auto mesh = make_shared<TriangleMesh>();
+    for (const auto& element : elements) {
+        size_t stride = 0;
+        bool fixed_size = true;
+        for (const auto& prop : element.props) {
+            fixed_size = fixed_size && prop.count_size == 0;
+            stride += prop.size;
+        }
+        if (element.name == "vertex") {
+            if (!fixed_size) return fail("List property on vertices");
+            if (size_t(end - p) < stride * element.count) return fail("Truncated vertex data");
+            int slot[8] = {-1, -1, -1, -1, -1, -1, -1, -1};    // x y z nx ny nz u v
+            size_t offset[8] = {};
+            static const char* names[8][3] = {
+                {"x", "x", "x"}, {"y", "y", "y"}, {"z", "z", "z"}, {"nx", "nx", "nx"}, {"ny", "ny", "ny"}, 
+                {"nz", "nz", "nz"}, {"u", "s", "texture_u"}, {"v", "t", "texture_v"}};
+            size_t at = 0;
+            for (size_t k = 0; k < element.props.size(); k += 1) {
+                for (int a = 0; a < 8; a += 1) {
+                    const auto& name = element.props[k].name;
+                    if (name == names[a][0] || name == names[a][1] || name == names[a][2]) { slot[a] = k; offset[a] = at; }
+                }
+                at += element.props[k].size;
+            }
+            if (slot[0] < 0 || slot[1] < 0 || slot[2] < 0) return fail("Missing vertex positions");
+            bool has_normals = slot[3] >= 0 && slot[4] >= 0 && slot[5] >= 0;
+            bool has_uvs = slot[6] >= 0 && slot[7] >= 0;
+            mesh->positions.resize(3 * element.count);
+            if (has_normals) mesh->normals.resize(3 * element.count);
+            if (has_uvs) mesh->uvs.resize(2 * element.count);
+            #pragma omp parallel for
+            for (size_t i = 0; i < element.count; i += 1) {
+                const char* record = p + i * stride;
+                for (int a = 0; a < 3; a += 1) {
+                    const auto& prop = element.props[slot[a]];
+                    mesh->positions[3*i+a] = PLYRead(record + offset[a], prop, swap_bytes);
+                    if (!has_normals) continue;
+                    const auto& nprop = element.props[slot[3+a]];
+                    mesh->normals[3*i+a] = PLYRead(record + offset[3+a], nprop, swap_bytes);
+                }
+                for (int a = 0; has_uvs && a < 2; a += 1) {
+                    const auto& prop = element.props[slot[6+a]];
+                    mesh->uvs[2*i+a] = PLYRead(record + offset[6+a], prop, swap_bytes);
+                }
+            }
+            p += stride * element.count;
+        } else if (element.name == "face") {
+            int list = -1;
+            for (size_t k = 0; k < element.props.size(); k += 1) 
+                if (element.props[k].name == "vertex_indices" || element.props[k].name == "vertex_index") list = k;
+            if (list < 0 || element.props.size() != 1) return fail("Unsupported face layout");
+            const auto& prop = element.props[list];
+            // All-triangle files have fixed-size records and decode in parallel
+            size_t record = prop.count_size + 3 * prop.size;
+            bool triangles = size_t(end - p) >= record * element.count;
+            bool in_range = true;
+            if (triangles) {
+                mesh->indices.resize(3 * element.count);
+                #pragma omp parallel for reduction(&&:triangles, in_range)
+                for (size_t i = 0; i < element.count; i += 1) {
+                    const char* q = p + i * record;
+                    triangles = triangles && PLYReadCount(q, prop, swap_bytes) == 3;
+                    for (int k = 0; triangles && k < 3; k += 1) 
+                        in_range = ToIndex(PLYRead(q + prop.count_size + k * prop.size, prop, swap_bytes), mesh->indices[3*i+k]) && in_range;
+                }
+            }
+            if (triangles && !in_range) return fail("Face index out of range");
+            if (triangles) {
+                p += record * element.count;
+            } else {
+                mesh->indices.clear();
+                for (size_t i = 0; i < element.count; i += 1) {
+                    if (p + prop.count_size > end) return fail("Truncated face data");
+                    double count = PLYReadCount(p, prop, swap_bytes);
+                    p += prop.count_size;
+                    if (!(count >= 0 && count <= double(end - p) / prop.size)) return fail("Truncated face data");
+                    size_t n = size_t(count);
+                    uint32_t first = 0, previous = 0, next = 0;
+                    if (n > 0 && !ToIndex(PLYRead(p, prop, swap_bytes), first)) return fail("Face index out of range");
+                    if (n > 1 && !ToIndex(PLYRead(p + prop.size, prop, swap_bytes), previous)) return fail("Face index out of range");
+                    for (size_t k = 2; k < n; k += 1) {
+                        if (!ToIndex(PLYRead(p + k * prop.size, prop, swap_bytes), next)) return fail("Face index out of range");
+                        mesh->indices.insert(mesh->indices.end(), {first, previous, next});
+                        previous = next;
+                    }
+                    p += n * prop.size;
+                }
+            }
+        } else {
+            if (!fixed_size) break;     // Trailing elements we cannot size are not needed
+            p += stride * element.count;
+        }
+    }
+    for (auto index : mesh->indices) 
+        if (index >= mesh->Vertices()) return fail("Face index out of range");
+    return mesh;
+}
+
+inline shared_ptr<TriangleMesh> LoadMesh(const std::string& filename, shared_ptr<Material> material,
+                                         const Transform& transform=Transform()) {
+    auto extension = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    shared_ptr<TriangleMesh> mesh;
+    if (extension == "obj") mesh = LoadOBJ(filename);
+    else if (extension == "ply") mesh = LoadPLY(filename);
+    else std::cerr << "ERROR: Unknown mesh format '" << filename << "'.\n";
+    if (mesh == nullptr) return nullptr;
+    mesh->material = material;
+    if (!transform.IsIdentity()) mesh->ApplyTransform(transform);
+    return mesh;
+}
+
+
+#endif // MESH_H
@@ -0,0 +1,425 @@
+#pragma once
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <mutex>
+
+#include "global.h"
+#include "primitives.h"
+#include "scenecache.h"
+#include "mappedfile.h"
+
+// Treelet blocks start on page boundaries so each one can be faulted in and dropped on its own.
+constexpr uint64_t OUT_OF_CORE_PAGE = 4096;
+
+struct TreeletRecord {
+    uint64_t offset, size;  // Byte range of the block in the file
+};
+
+struct OutOfCoreNode {
+    Bounds3  bounds;
+    uint32_t offset;        // Leaf: treelet, Interior: second child
+    uint16_t leaf;
+    uint16_t axis;
+};
+
+// Scene split into treelets, each a self-contained PrimitiveBVH image stored as a block of one
+// memory-mapped file. Only a small top-level tree and the material table stay resident; blocks are
+// decoded in place when a ray first reaches them and released in clock order, an approximation of
+// least recently used, once the resident blocks exceed the budget, so scenes far larger than memory
+// can be rendered. Finding a resident treelet takes no lock; the lock is held only while a decoded
+// treelet is installed and others are evicted to make room for it.
+class OutOfCoreScene : public Shapes {
+public:
+    // Methods
+    // Source of a scene too large to hold at once: each call returns the next part of it as a store
+    // of its own, and nullptr once there is none left.
+    using Chunks = std::function<shared_ptr<const PrimitiveStore>()>;
+
+    // Split a scene into treelets of at most treelet_size primitives and write them to one file. Each
+    // chunk is partitioned and written as it arrives and only the bounds of its treelets are kept, so
+    // the scene never has to fit in memory; the top-level tree is built over those bounds at the end.
+    // Treelets never span chunks, so chunks that are compact in space, like one mesh each, work best.
+    static bool Write(const std::string& filename, const Chunks& next, uint32_t treelet_size = 1 << 16) {
+        treelet_size = Max(treelet_size, 1u);
+        vector<shared_ptr<Material>> materials;
+        std::unordered_map<const Material*, uint32_t> material_ids;
+        vector<TreeletRecord> treelets;
+        vector<Bounds3> treelet_bounds;
+        // The top-level image is only sized once every block is known, so blocks are staged in a file of
+        // their own and copied in behind it
+        auto temporary = filename + ".tmp", staging = filename + ".blocks";
+        std::fstream blocks(staging, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+        bool valid = bool(blocks);
+        uint64_t offset = 0;
+        while (valid) {
+            auto store = next();
+            if (store == nullptr) break;
+            if (!store->shapes.empty()) {
+                std::cerr << "ERROR: Out-of-core scenes cannot hold shapes outside the primitive store.\n";
+                valid = false;
+                break;
+            }
+            CacheImage probe;
+            if (!SceneCache::AddMaterials(store->materials, probe)) { valid = false; break; }
+            for (const auto& material : store->materials)
+                if (material_ids.emplace(material.get(), materials.size()).second) materials.push_back(material);
+
+            vector<PrimRef> refs(store->refs.begin(), store->refs.end());
+            vector<Bounds3> ref_bounds(refs.size());
+            vector<Point3>  ref_centroids(refs.size());
+            for (size_t i = 0; i < refs.size(); i += 1) {
+                ref_bounds[i] = store->BBox(refs[i]);
+                ref_centroids[i] = Centroid(ref_bounds[i]);
+            }
+            vector<uint32_t> order(refs.size());
+            for (uint32_t i = 0; i < order.size(); i += 1) order[i] = i;
+            vector<OutOfCoreNode> nodes;
+            vector<std::pair<uint32_t, uint32_t>> ranges;
+            if (!refs.empty())
+                Partition(order, ref_bounds, ref_centroids, 0, order.size(), treelet_size, nodes, ranges);
+            for (const auto& [first, last] : ranges) {
+                auto block = Block(*store, material_ids, refs, order, first, last);
+                blocks.seekp(offset);
+                blocks.write(block.data(), block.size());
+                treelets.push_back(TreeletRecord{offset, block.size()});
+                Bounds3 bounds = Bounds3::Empty;
+                for (uint32_t i = first; i < last; i += 1) bounds = Union(bounds, ref_bounds[order[i]]);
+                treelet_bounds.push_back(bounds);
+                offset = Align(offset + block.size());
+            }
+            valid = bool(blocks);
+        }
+
+        // One treelet per leaf of the top-level tree
+        vector<uint32_t> order(treelets.size());
+        vector<Point3> centroids(treelets.size());
+        for (uint32_t t = 0; t < order.size(); t += 1) {
+            order[t] = t;
+            centroids[t] = Centroid(treelet_bounds[t]);
+        }
+        vector<OutOfCoreNode> nodes;
+        vector<std::pair<uint32_t, uint32_t>> ranges;
+        if (!treelets.empty()) Partition(order, treelet_bounds, centroids, 0, order.size(), 1, nodes, ranges);
+        for (auto& node : nodes) if (node.leaf) node.offset = order[ranges[node.offset].first];
+        auto Top = [&]() {
+            CacheImage top;
+            SceneCache::AddMaterials(materials, top);
+            top.Add("ooc.nodes", nodes.data(), nodes.size());
+            top.Add("ooc.treelets", treelets.data(), treelets.size());
+            return top.Serialize();
+        };
+        // Offsets do not change the size of the image, so they can be moved past it afterwards
+        uint64_t base = Align(Top().size());
+        for (auto& record : treelets) record.offset += base;
+        auto top = Top();
+
+        std::ofstream file(temporary, std::ios::binary);
+        file.write(top.data(), top.size());
+        file.seekp(base);
+        blocks.seekg(0);
+        vector<char> buffer(size_t(1) << 20);
+        while (valid && file) {
+            blocks.read(buffer.data(), buffer.size());
+            if (blocks.gcount() == 0) break;
+            file.write(buffer.data(), blocks.gcount());
+        }
+        blocks.close();
+        file.close();
+        std::remove(staging.c_str());
+        if (!valid || !file || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::cerr << "ERROR: Could not write out-of-core scene '" << filename << "'.\n";
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+    // Write a scene already held in memory as a single chunk.
+    static bool Write(const std::string& filename, const PrimitiveStore& store, uint32_t treelet_size = 1 << 16) {
+        bool given = false;
+        return Write(filename, [&]() {
+            if (given) return shared_ptr<const PrimitiveStore>();
+            given = true;
+            return shared_ptr<const PrimitiveStore>(shared_ptr<const PrimitiveStore>(), &store);
+        }, treelet_size);
+    }
+    // Map a file written by Write; at most resident_budget bytes of treelets are kept decoded.
+    static shared_ptr<OutOfCoreScene> Open(const std::string& filename, size_t resident_budget) {
+        auto scene = shared_ptr<OutOfCoreScene>(new OutOfCoreScene());
+        scene->mapping = make_shared<MappedFile>();
+        scene->budget = resident_budget;
+        if (!scene->mapping->Open(filename)) return nullptr;
+        const char* data = scene->mapping->Data();
+        CacheHeader header;
+        bool valid = scene->mapping->Size() >= sizeof(header);
+        if (valid) std::memcpy(&header, data, sizeof(header));
+        valid = valid && header.file_size <= scene->mapping->Size() && scene->top.Parse(data, header.file_size) &&
+                SceneCache::ReadMaterials(scene->top, scene->materials);
+        size_t node_count = 0;
+        scene->nodes = valid ? scene->top.Find<OutOfCoreNode>("ooc.nodes", node_count) : nullptr;
+        scene->treelets = valid ? scene->top.Find<TreeletRecord>("ooc.treelets", scene->treelet_count) : nullptr;
+        valid = scene->nodes != nullptr && scene->treelets != nullptr;
+        for (size_t t = 0; valid && t < scene->treelet_count; t += 1)
+            valid = scene->treelets[t].offset + scene->treelets[t].size <= scene->mapping->Size();
+        // As in SceneCache::Validate, children follow their parent, so one forward pass finds every
+        // depth and keeps traversal within its stack
+        vector<uint8_t> depth(valid ? node_count : 0, 0);
+        for (size_t n = 0; valid && n < node_count; n += 1) {
+            const auto& node = scene->nodes[n];
+            if (node.leaf) {
+                valid = node.offset < scene->treelet_count;
+                continue;
+            }
+            valid = node.axis <= 2 && node.offset > n + 1 && node.offset < node_count && depth[n] + 1 < 64;
+            if (!valid) break;
+            depth[n + 1] = Max(depth[n + 1], uint8_t(depth[n] + 1));
+            depth[node.offset] = Max(depth[node.offset], uint8_t(depth[n] + 1));
+        }
+        if (!valid) {
+            std::cerr << "ERROR: Out-of-core scene '" << filename << "' is invalid or outdated.\n";
+            return nullptr;
+        }
+        if (node_count == 0) scene->nodes = nullptr;
+        scene->resident.reset(new Resident[scene->treelet_count]);
+        return scene;
+    }
+
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        bool happened = false;
+        Traverse(ray, ray_time, [&](uint32_t treelet) {
+            auto bvh = Acquire(treelet);
+            if (bvh != nullptr && bvh->Intersect(ray, ray_time, isect)) {
+                happened = true;
+                ray_time._max = isect.time;
+            }
+            return ray_time;
+        });
+        return happened;
+    }
+    Bounds3 BBox() const override { return nodes == nullptr ? Bounds3::Empty : nodes[0].bounds; }
+    // Trace many rays at once: rays are first queued on every treelet they reach, then each treelet
+    // is acquired once and its whole queue is traced, so a page-in is shared by all rays that need it.
+    void IntersectBatch(const vector<Ray>& rays, Interval ray_time,
+                        vector<Intersection>& isects, vector<char>& hits) const override {
+        isects.assign(rays.size(), Intersection());
+        hits.assign(rays.size(), 0);
+        vector<std::pair<uint32_t, uint32_t>> queued;     // Treelet and ray
+        for (uint32_t i = 0; i < rays.size(); i += 1)
+            Traverse(rays[i], ray_time, [&](uint32_t treelet) { queued.emplace_back(treelet, i); return ray_time; });
+        // Group the queue by treelet, already resident ones first so they are drained before anything
+        // loaded for this batch can evict them
+        vector<char> loaded(treelet_count, 0);
+        for (const auto& entry : queued) loaded[entry.first] = std::atomic_load(&resident[entry.first].bvh) != nullptr;
+        std::sort(queued.begin(), queued.end(), [&loaded](const auto& a, const auto& b) {
+            return loaded[a.first] != loaded[b.first] ? loaded[a.first] > loaded[b.first] : a < b;
+        });
+        vector<double> nearest(rays.size(), ray_time._max);
+        for (size_t begin = 0, end; begin < queued.size(); begin = end) {
+            uint32_t treelet = queued[begin].first;
+            for (end = begin; end < queued.size() && queued[end].first == treelet; end += 1) {}
+            auto bvh = Acquire(treelet);
+            if (bvh == nullptr) continue;
+            for (size_t k = begin; k < end; k += 1) {
+                uint32_t i = queued[k].second;
+                if (bvh->Intersect(rays[i], Interval(ray_time._min, nearest[i]), isects[i])) {
+                    hits[i] = 1;
+                    nearest[i] = isects[i].time;
+                }
+            }
+        }
+    }
+    size_t Treelets() const { return treelet_count; }
+    size_t PageIns() const { std::lock_guard<std::mutex> lock(mutex); return page_ins; }
+    size_t ResidentBytes() const { std::lock_guard<std::mutex> lock(mutex); return resident_bytes; }
+
+private:
+    // Members
+    struct Resident {
+        shared_ptr<PrimitiveBVH> bvh;               // Only read and written through std::atomic_load/store
+        std::atomic<bool> referenced{false};        // Set on every use, cleared as the clock hand passes
+    };
+    shared_ptr<MappedFile> mapping;
+    CacheImage top;
+    vector<shared_ptr<Material>> materials;
+    const OutOfCoreNode* nodes = nullptr;
+    const TreeletRecord* treelets = nullptr;
+    size_t treelet_count = 0;
+    size_t budget = 0;
+
+    mutable std::unique_ptr<Resident[]> resident;
+    mutable std::mutex mutex;                       // Guards everything below
+    mutable size_t hand = 0;                        // Next treelet the clock looks at
+    mutable size_t resident_bytes = 0;
+    mutable size_t page_ins = 0;
+
+    // Constructors
+    OutOfCoreScene() = default;
+
+    // Methods
+    static uint64_t Align(uint64_t offset) { return (offset + OUT_OF_CORE_PAGE - 1) / OUT_OF_CORE_PAGE * OUT_OF_CORE_PAGE; }
+    static Point3 Centroid(const Bounds3& bounds) { return Point3(bounds.x.Centroid(), bounds.y.Centroid(), bounds.z.Centroid()); }
+    static uint32_t Partition(vector<uint32_t>& order, const vector<Bounds3>& ref_bounds, const vector<Point3>& ref_centroids,
+                              uint32_t start, uint32_t end, uint32_t treelet_size,
+                              vector<OutOfCoreNode>& nodes, vector<std::pair<uint32_t, uint32_t>>& ranges) {
+        uint32_t index = nodes.size();
+        nodes.emplace_back();
+        Bounds3 bounds = Bounds3::Empty;
+        for (uint32_t i = start; i < end; i += 1)
+            bounds = Union(bounds, ref_bounds[order[i]]);
+        nodes[index].bounds = bounds;
+        if (end - start <= treelet_size) {
+            nodes[index].offset = ranges.size();
+            nodes[index].leaf = 1;
+            nodes[index].axis = 0;
+            ranges.emplace_back(start, end);
+            return index;
+        }
+        int axis = bounds.MaxAxis();
+        uint32_t mid = start + (end - start)/2;
+        std::nth_element(order.begin()+start, order.begin()+mid, order.begin()+end,
+                         [&](uint32_t o1, uint32_t o2) {
+            return ref_centroids[o1][axis] < ref_centroids[o2][axis];
+        });
+        Partition(order, ref_bounds, ref_centroids, start, mid, treelet_size, nodes, ranges);
+        uint32_t second = Partition(order, ref_bounds, ref_centroids, mid, end, treelet_size, nodes, ranges);
+        nodes[index].offset = second;
+        nodes[index].leaf = 0;
+        nodes[index].axis = axis;
+        return index;
+    }
+    // Copy a range of primitives into a store of their own, build its BVH and serialise it. Triangles
+    // are regrouped per source mesh with only the vertices they use.
+    static vector<char> Block(const PrimitiveStore& store, const std::unordered_map<const Material*, uint32_t>& material_ids,
+                              const vector<PrimRef>& refs, const vector<uint32_t>& order, uint32_t start, uint32_t end) {
+        auto block = make_shared<PrimitiveStore>();
+        std::unordered_map<uint32_t, vector<uint32_t>> mesh_triangles;
+        for (uint32_t i = start; i < end; i += 1) {
+            PrimRef ref = refs[order[i]];
+            if (ref.type == PrimType::Triangle) mesh_triangles[store.MeshOf(ref.index)].push_back(ref.index);
+            else block->AddCopy(store, ref);
+        }
+        for (auto& [m, triangles] : mesh_triangles) {
+            const auto& view = store.mesh_views[m];
+            auto mesh = make_shared<TriangleMesh>();
+            mesh->material = store.materials[store.mesh_material[m]];
+            std::unordered_map<uint32_t, uint32_t> remap;
+            for (uint32_t triangle : triangles) {
+                uint32_t tri = triangle - store.mesh_first[m];
+                for (int k = 0; k < 3; k += 1) {
+                    uint32_t vertex = view.indices[3*tri + k];
+                    auto found = remap.find(vertex);
+                    if (found == remap.end()) {
+                        found = remap.emplace(vertex, remap.size()).first;
+                        mesh->positions.insert(mesh->positions.end(), view.positions + 3*vertex, view.positions + 3*vertex + 3);
+                        if (view.normals) mesh->normals.insert(mesh->normals.end(), view.normals + 3*vertex, view.normals + 3*vertex + 3);
+                        if (view.uvs) mesh->uvs.insert(mesh->uvs.end(), view.uvs + 2*vertex, view.uvs + 2*vertex + 2);
+                    }
+                    mesh->indices.push_back(found->second);
+                }
+            }
+            block->AddMesh(mesh);
+        }
+        PrimitiveBVH bvh(block);
+        // Block materials are numbered locally, the map leads back to the shared table
+        vector<uint32_t> material_map;
+        for (const auto& material : block->materials)
+            material_map.push_back(material_ids.at(material.get()));
+        CacheImage image;
+        SceneCache::Encode(bvh, image);
+        image.Add("material.map", material_map.data(), material_map.size());
+        return image.Serialize();
+    }
+    // Walk the top-level tree near child first, handing each treelet reached to visit, which returns
+    // the ray interval narrowed by any hit.
+    template <typename Visitor>
+    void Traverse(const Ray& ray, Interval ray_time, Visitor&& visit) const {
+        if (nodes == nullptr) return;
+        auto inv_dir = Vector3(1.0/ray.dir.x, 1.0/ray.dir.y, 1.0/ray.dir.z);
+        bool dir_neg[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+        uint32_t stack[64];
+        int stack_size = 0;
+        uint32_t current = 0;
+        while (true) {
+            const OutOfCoreNode& node = nodes[current];
+            if (node.bounds.Intersect(ray, inv_dir, ray_time)) {
+                if (node.leaf) {
+                    ray_time = visit(node.offset);
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+    }
+    // Return a treelet, decoding it from the mapping if needed. Callers hold their own reference, so
+    // evicting a treelet that another thread is still tracing only returns its pages to the kernel.
+    shared_ptr<PrimitiveBVH> Acquire(uint32_t treelet) const {
+        auto& slot = resident[treelet];
+        auto bvh = std::atomic_load(&slot.bvh);
+        if (bvh != nullptr) {
+            slot.referenced.store(true, std::memory_order_relaxed);
+            return bvh;
+        }
+        bvh = Load(treelet);
+        if (bvh == nullptr) return nullptr;
+        std::lock_guard<std::mutex> lock(mutex);
+        // Two threads may decode the same treelet at once; the first to get here installs its copy
+        auto installed = std::atomic_load(&slot.bvh);
+        if (installed != nullptr) return installed;
+        const auto& record = treelets[treelet];
+        while (resident_bytes > 0 && resident_bytes + record.size > budget) EvictNext();
+        std::atomic_store(&slot.bvh, bvh);
+        slot.referenced.store(true, std::memory_order_relaxed);
+        resident_bytes += record.size;
+        page_ins += 1;
+        return bvh;
+    }
+    // Decode a treelet from the mapping, without holding the lock.
+    shared_ptr<PrimitiveBVH> Load(uint32_t treelet) const {
+        const auto& record = treelets[treelet];
+        mapping->Advise(record.offset, record.size, MADV_WILLNEED);
+        CacheImage block;
+        size_t map_count = 0;
+        const uint32_t* material_map = nullptr;
+        if (block.Parse(mapping->Data() + record.offset, record.size))
+            material_map = block.Find<uint32_t>("material.map", map_count);
+        vector<shared_ptr<Material>> block_materials;
+        for (size_t i = 0; material_map != nullptr && i < map_count; i += 1) {
+            if (material_map[i] >= materials.size()) { material_map = nullptr; break; }
+            block_materials.push_back(materials[material_map[i]]);
+        }
+        auto bvh = material_map != nullptr ? SceneCache::Decode(block, mapping, block_materials) : nullptr;
+        if (bvh == nullptr) std::cerr << "ERROR: Treelet " << treelet << " of out-of-core scene is corrupt.\n";
+        return bvh;
+    }
+    // Advance the clock hand to the next resident treelet not used since the hand last passed it, and
+    // evict that one. Called with the lock held and at least one treelet resident.
+    void EvictNext() const {
+        while (true) {
+            size_t treelet = hand;
+            hand = (hand + 1) % treelet_count;
+            auto& slot = resident[treelet];
+            if (std::atomic_load(&slot.bvh) == nullptr) continue;
+            if (slot.referenced.exchange(false, std::memory_order_relaxed)) continue;
+            const auto& record = treelets[treelet];
+            std::atomic_store(&slot.bvh, shared_ptr<PrimitiveBVH>());
+            resident_bytes -= record.size;
+            mapping->Advise(record.offset, record.size, MADV_DONTNEED);
+            return;
+        }
+    }
+};
+
+
+#endif // OUTOFCORE_H
@@ -0,0 +1,146 @@
+#pragma once
+#ifndef PHOTONMAP_H
+#define PHOTONMAP_H
+
+#include <omp.h>
+
+#include "global.h"
+#include "mathematics.h"
+#include "shapes.h"
+#include "material.h"
+#include "lightbvh.h"
+
+// Bounces a photon may take through mirrors and glass before it is given up.
+constexpr int PHOTON_DEPTH = 16;
+// Radius reduction of progressive passes, α of Knaus and Zwicker; smaller shrinks faster.
+constexpr double PHOTON_ALPHA = 2.0 / 3.0;
+
+// Photon that reached a diffuse surface through at least one specular bounce. Floats are plenty for
+// a position compared against a search radius, and keep the photon within 36 bytes.
+struct Photon {
+    float coords[3];
+    float wi[3];        // Back towards where it came from
+    float power[3];
+};
+
+// Caustic photon map after Jensen, "Global Illumination using Photon Maps" (1996). Photons leave the
+// emitters of a LightBVH, follow mirrors and glass only, and are kept where they land on a diffuse
+// surface, so the map holds exactly the paths from a light through specular bounces to a diffuse
+// surface, which a path traced from the camera almost never finds. They are binned into a hashed grid
+// of cubes one search diameter wide, sorted so each bin is contiguous; a lookup scans the eight bins
+// the search sphere can touch. Tracing runs in parallel, each thread keeping its own photons.
+class PhotonMap {
+public:
+    // Constructors
+    PhotonMap(const Shapes& world, const LightBVH& lights, size_t emitted, double _radius)
+        : radius(_radius), cell_size(2 * _radius) {
+        std::vector<std::vector<Photon>> found(omp_get_max_threads());
+        double scale = 1.0 / Max(emitted, size_t(1));
+        #pragma omp parallel
+        {
+            auto& mine = found[omp_get_thread_num()];
+            #pragma omp for schedule(dynamic, 1024)
+            for (int64_t i = 0; i < int64_t(emitted); i += 1)
+                Trace(world, lights, scale, mine);
+        }
+        size_t count = 0;
+        for (const auto& list : found) count += list.size();
+        size_t size = 1;
+        while (size < 2 * count) size <<= 1;
+        mask = size - 1;
+        // Counting sort by bin
+        starts.assign(size + 1, 0);
+        for (const auto& list : found)
+            for (const auto& photon : list) starts[Slot(photon.coords) + 1] += 1;
+        for (size_t slot = 0; slot < size; slot += 1) starts[slot + 1] += starts[slot];
+        photons.resize(count);
+        std::vector<uint32_t> next(starts.begin(), starts.end() - 1);
+        for (const auto& list : found)
+            for (const auto& photon : list) photons[next[Slot(photon.coords)]++] = photon;
+    }
+
+    // Methods
+    size_t Size() const { return photons.size(); }
+    double Radius() const { return radius; }
+    // Caustic irradiance at p on a surface facing n: the flux of the photons within the radius that
+    // arrived from the front, over the area of the disc they were gathered from.
+    Colour Gather(const Point3& p, const Vector3& n) const {
+        if (photons.empty()) return Colour(0.0);
+        int64_t lo[3], hi[3];
+        for (int axis = 0; axis < 3; axis += 1) {
+            lo[axis] = int64_t(std::floor((p[axis] - radius) / cell_size));
+            hi[axis] = int64_t(std::floor((p[axis] + radius) / cell_size));
+        }
+        // Two bins may share a slot, which must then be scanned only once
+        size_t visited[8];
+        int visits = 0;
+        double flux[3] = {0.0, 0.0, 0.0};
+        double radius2 = Sqr(radius);
+        for (int64_t x = lo[0]; x <= hi[0]; x += 1)
+            for (int64_t y = lo[1]; y <= hi[1]; y += 1)
+                for (int64_t z = lo[2]; z <= hi[2]; z += 1) {
+                    size_t slot = Hash(Key(x, y, z)) & mask;
+                    if (std::find(visited, visited + visits, slot) != visited + visits) continue;
+                    visited[visits++] = slot;
+                    for (uint32_t i = starts[slot]; i < starts[slot + 1]; i += 1) {
+                        const auto& photon = photons[i];
+                        double distance2 = Sqr(photon.coords[0] - p.x) + Sqr(photon.coords[1] - p.y)
+                                         + Sqr(photon.coords[2] - p.z);
+                        if (distance2 > radius2) continue;
+                        if (photon.wi[0] * n.x + photon.wi[1] * n.y + photon.wi[2] * n.z <= 0) continue;
+                        for (int c = 0; c < 3; c += 1) flux[c] += photon.power[c];
+                    }
+                }
+        return Colour(flux[0], flux[1], flux[2]) / (M_PI * radius2);
+    }
+    // Radius of progressive pass `pass` given that of the one before, shrunk so that the bias goes to
+    // zero while each pass still gathers a growing share of photons (Knaus and Zwicker, Eq. 16).
+    static double Shrink(double previous, int pass) { return previous * Sqrt((pass + PHOTON_ALPHA) / (pass + 1)); }
+
+private:
+    // Members
+    double radius, cell_size;
+    std::vector<Photon> photons;
+    std::vector<uint32_t> starts;       // Of each slot in photons, and one past the last
+    size_t mask;
+
+    // Methods
+    void Trace(const Shapes& world, const LightBVH& lights, double scale, std::vector<Photon>& out) const {
+        Ray ray;
+        auto power = lights.SampleEmission(RandomFloat(), ray) * scale;
+        bool specular = false;
+        for (int depth = 0; depth < PHOTON_DEPTH && !IsZero(power); depth += 1) {
+            Intersection isect;
+            if (!world.Intersect(ray, Interval(EPS_DEUX, POS_INF), isect)) return;
+            const auto& material = *isect.material;
+            if (!material.IsSpecular()) {
+                if (specular && material.Type() == MaterialType::Lambertian) {
+                    Photon photon;
+                    for (int axis = 0; axis < 3; axis += 1) {
+                        photon.coords[axis] = float(isect.coords[axis]);
+                        photon.wi[axis] = float(-ray.dir[axis]);
+                        photon.power[axis] = float(power[axis]);
+                    }
+                    out.push_back(photon);
+                }
+                return;
+            }
+            BSDFSample sample;
+            if (!material.Sample(-ray.dir, isect, sample)) return;
+            power = power * sample.weight;
+            ray = Ray(isect.coords, sample.wi, ray.time);
+            specular = true;
+        }
+    }
+    size_t Slot(const float coords[3]) const {
+        return Hash(Key(int64_t(std::floor(coords[0] / cell_size)), int64_t(std::floor(coords[1] / cell_size)),
+                        int64_t(std::floor(coords[2] / cell_size)))) & mask;
+    }
+    // 21 bits per axis, wrapping.
+    static uint64_t Key(int64_t x, int64_t y, int64_t z) {
+        return ((uint64_t(x) & 0x1FFFFF) << 42) | ((uint64_t(y) & 0x1FFFFF) << 21) | (uint64_t(z) & 0x1FFFFF);
+    }
+};
+
+
+#endif // PHOTONMAP_H
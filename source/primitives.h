@@ -0,0 +1,739 @@
+#pragma once
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include <algorithm>
+#include <typeinfo>
+#include <unordered_map>
+
+#include "global.h"
+#include "mathematics.h"
+#include "shapes.h"
+#include "scene.h"
+#include "bounds.h"
+#include "mesh.h"
+#include "buffer.h"
+
+enum class PrimType : uint32_t { Sphere, MovingSphere, Quad, Shape, SphereCluster, Triangle, Box };
+
+// Number of spheres a cluster tests per ray, eight doubles fill one AVX-512 or two AVX2 registers.
+constexpr int CLUSTER_WIDTH = 8;
+// A refitted PrimitiveBVH asks to be rebuilt once the surface areas of its nodes have grown by this
+// factor on average since it was built.
+constexpr double REFIT_LIMIT = 1.5;
+
+// Up to CLUSTER_WIDTH spheres laid out lane by lane. Stationary spheres carry a zero shift, so one
+// branch-free kernel serves both kinds.
+struct alignas(64) SphereCluster {
+    double x[CLUSTER_WIDTH], y[CLUSTER_WIDTH], z[CLUSTER_WIDTH];
+    double dx[CLUSTER_WIDTH], dy[CLUSTER_WIDTH], dz[CLUSTER_WIDTH];
+    double radius[CLUSTER_WIDTH];
+    uint32_t material[CLUSTER_WIDTH];
+    int count;
+};
+
+// A Box as the store keeps it: corners in its own frame, the inverse transform taking scene points
+// into that frame, and its box in the scene.
+struct OrientedBox {
+    double lo[3], hi[3];
+    double rows[3][3], shift[3];
+    Bounds3 bounds;
+    uint32_t material;
+};
+
+// A primitive addressed by kind and slot in the matching array of the store.
+struct PrimRef {
+    PrimType type;
+    uint32_t index;
+};
+
+// Contiguous structure-of-arrays storage for every primitive kind. Leaves of the PrimitiveBVH refer 
+// to primitives by (type, index) so intersection dispatches through a switch instead of a vtable.
+class PrimitiveStore {
+public:
+    // Methods
+    uint32_t AddMaterial(shared_ptr<Material> material) {
+        auto found = material_ids.find(material.get());
+        if (found != material_ids.end()) return found->second;
+        uint32_t id = materials.size();
+        materials.push_back(material);
+        material_ids[material.get()] = id;
+        return id;
+    }
+    PrimRef AddSphere(const Point3& centre, double radius, shared_ptr<Material> material) {
+        spheres.Push(centre, Max(radius, EPS_DEUX), AddMaterial(material));
+        return refs.emplace_back(PrimRef{PrimType::Sphere, uint32_t(spheres.Size()-1)});
+    }
+    PrimRef AddSphere(const Point3& centre1, const Point3& centre2, double radius, shared_ptr<Material> material) {
+        moving_spheres.Push(centre1, centre2 - centre1, Max(radius, EPS_DEUX), AddMaterial(material));
+        return refs.emplace_back(PrimRef{PrimType::MovingSphere, uint32_t(moving_spheres.Size()-1)});
+    }
+    PrimRef AddQuad(const Quad& quad, shared_ptr<Material> material) {
+        quads.Push(quad.pin, quad.vec_u, quad.vec_v, quad.vec_w, quad.normal, quad.constant, 
+                   AddMaterial(material));
+        return refs.emplace_back(PrimRef{PrimType::Quad, uint32_t(quads.Size()-1)});
+    }
+    PrimRef AddBox(const Box& box, shared_ptr<Material> material) {
+        OrientedBox oriented;
+        for (int axis = 0; axis < 3; axis += 1) {
+            oriented.lo[axis] = box.lo[axis];
+            oriented.hi[axis] = box.hi[axis];
+            oriented.shift[axis] = box.shift[axis];
+            for (int k = 0; k < 3; k += 1) oriented.rows[axis][k] = box.rows[axis][k];
+        }
+        oriented.bounds = box.bbox;
+        oriented.material = AddMaterial(material);
+        boxes.push_back(oriented);
+        return refs.emplace_back(PrimRef{PrimType::Box, uint32_t(boxes.size()-1)});
+    }
+    // One reference per triangle, numbered globally across all meshes.
+    void AddMesh(shared_ptr<TriangleMesh> mesh) {
+        uint32_t first = mesh_first.empty() ? 0 : mesh_first.back() + mesh_views.back().triangles;
+        meshes.push_back(mesh);
+        mesh_views.push_back(mesh->View());
+        mesh_first.push_back(first);
+        mesh_material.push_back(AddMaterial(shared_ptr<Material>(mesh, mesh->material.get())));
+        refs.reserve(refs.size() + mesh->Triangles());
+        for (uint32_t tri = 0; tri < mesh->Triangles(); tri += 1) 
+            refs.push_back(PrimRef{PrimType::Triangle, first + tri});
+    }
+    // Copy a sphere, quad or box out of another store, e.g. when splitting a scene into blocks.
+    PrimRef AddCopy(const PrimitiveStore& other, PrimRef ref) {
+        uint32_t i = ref.index;
+        switch (ref.type) {
+            case PrimType::Sphere:
+                return AddSphere(other.spheres.Centre(i), other.spheres.radius[i], other.materials[other.spheres.material[i]]);
+            case PrimType::MovingSphere: {
+                const auto& moving = other.moving_spheres;
+                return AddSphere(moving.Centre(i, 0.0), moving.Centre(i, 1.0), moving.radius[i], 
+                                 other.materials[moving.material[i]]);
+            }
+            case PrimType::Quad: {
+                const auto& quad = other.quads;
+                quads.Push(quad.Pin(i), quad.U(i), quad.V(i), quad.W(i), quad.Normal(i), quad.constant[i],
+                           AddMaterial(other.materials[quad.material[i]]));
+                return refs.emplace_back(PrimRef{PrimType::Quad, uint32_t(quads.Size()-1)});
+            }
+            case PrimType::Box: {
+                auto box = other.boxes[i];
+                box.material = AddMaterial(other.materials[box.material]);
+                boxes.push_back(box);
+                return refs.emplace_back(PrimRef{PrimType::Box, uint32_t(boxes.size()-1)});
+            }
+            default: throw std::runtime_error("PrimitiveStore::AddCopy only copies spheres, quads and boxes.");
+        }
+    }
+    PrimRef AddShape(shared_ptr<Shapes> object) {
+        shapes.push_back(object);
+        return refs.emplace_back(PrimRef{PrimType::Shape, uint32_t(shapes.size()-1)});
+    }
+    // Flatten an object graph: known kinds go to their arrays, nested scenes are expanded, 
+    // anything else is kept behind its virtual interface. Materials are kept through the shape that
+    // holds them, which may not count its own reference, as in an Arena.
+    void Add(shared_ptr<Shapes> object) {
+        const auto& kind = typeid(*object);
+        auto held = [&object](const shared_ptr<Material>& material) { return shared_ptr<Material>(object, material.get()); };
+        if (kind == typeid(Sphere)) {
+            auto sphere = std::static_pointer_cast<Sphere>(object);
+            if (sphere->moving) 
+                AddSphere(sphere->centre0, sphere->centre0 + sphere->shift, sphere->radius, held(sphere->material));
+            else 
+                AddSphere(sphere->centre0, sphere->radius, held(sphere->material));
+        } else if (kind == typeid(Quad)) {
+            auto quad = std::static_pointer_cast<Quad>(object);
+            AddQuad(*quad, held(quad->material));
+        } else if (kind == typeid(Box)) {
+            auto box = std::static_pointer_cast<Box>(object);
+            AddBox(*box, held(box->material));
+        } else if (kind == typeid(TriangleMesh)) {
+            AddMesh(std::static_pointer_cast<TriangleMesh>(object));
+        } else if (kind == typeid(Scene)) {
+            Add(*std::static_pointer_cast<Scene>(object));
+        } else {
+            AddShape(object);
+        }
+    }
+    void Add(const Scene& scene) { for (const auto& object : scene.objects) Add(object); }
+
+    // Clusters belong to the tree that packed them, which passes its own to resolve their references.
+    Bounds3 BBox(PrimRef ref, const SphereCluster* clusters = nullptr) const {
+        uint32_t i = ref.index;
+        switch (ref.type) {
+            case PrimType::Sphere: {
+                auto r_vec = Vector3(spheres.radius[i]);
+                return Bounds3(spheres.Centre(i) - r_vec, spheres.Centre(i) + r_vec);
+            }
+            case PrimType::MovingSphere: {
+                auto r_vec = Vector3(moving_spheres.radius[i]);
+                auto centre1 = moving_spheres.Centre(i, 0.0), centre2 = moving_spheres.Centre(i, 1.0);
+                return Union(Bounds3(centre1 - r_vec, centre1 + r_vec), Bounds3(centre2 - r_vec, centre2 + r_vec));
+            }
+            case PrimType::Quad: {
+                auto pin = quads.Pin(i), vec_u = quads.U(i), vec_v = quads.V(i);
+                return Union(Bounds3(pin, pin + vec_u + vec_v), Bounds3(pin + vec_u, pin + vec_v));
+            }
+            case PrimType::SphereCluster: {
+                auto bounds = Bounds3::Empty;
+                const auto& cluster = clusters[i];
+                for (int k = 0; k < cluster.count; k += 1) {
+                    auto r_vec = Vector3(cluster.radius[k]);
+                    auto centre1 = Point3(cluster.x[k], cluster.y[k], cluster.z[k]);
+                    auto centre2 = centre1 + Vector3(cluster.dx[k], cluster.dy[k], cluster.dz[k]);
+                    bounds = Union(bounds, Union(Bounds3(centre1 - r_vec, centre1 + r_vec), 
+                                                 Bounds3(centre2 - r_vec, centre2 + r_vec)));
+                }
+                return bounds;
+            }
+            case PrimType::Triangle: {
+                uint32_t m = MeshOf(i);
+                return mesh_views[m].TriangleBBox(i - mesh_first[m]);
+            }
+            case PrimType::Box: return boxes[i].bounds;
+            default: return shapes[i]->BBox();
+        }
+    }
+    // Bounds at one instant of the shutter; only moving spheres differ from the box above.
+    Bounds3 BBox(PrimRef ref, double time, const SphereCluster* clusters = nullptr) const {
+        uint32_t i = ref.index;
+        switch (ref.type) {
+            case PrimType::MovingSphere: {
+                auto r_vec = Vector3(moving_spheres.radius[i]);
+                auto centre = moving_spheres.Centre(i, time);
+                return Bounds3(centre - r_vec, centre + r_vec);
+            }
+            case PrimType::SphereCluster: {
+                auto bounds = Bounds3::Empty;
+                const auto& cluster = clusters[i];
+                for (int k = 0; k < cluster.count; k += 1) {
+                    auto r_vec = Vector3(cluster.radius[k]);
+                    auto centre = Point3(cluster.x[k] + time * cluster.dx[k], cluster.y[k] + time * cluster.dy[k],
+                                         cluster.z[k] + time * cluster.dz[k]);
+                    bounds = Union(bounds, Bounds3(centre - r_vec, centre + r_vec));
+                }
+                return bounds;
+            }
+            default: return BBox(ref, clusters);
+        }
+    }
+    bool HasMotion() const { return moving_spheres.Size() > 0; }
+    bool Intersect(PrimRef ref, const Ray& ray, Interval ray_time, Intersection& isect, 
+                   const SphereCluster* clusters = nullptr) const {
+        uint32_t i = ref.index;
+        switch (ref.type) {
+            case PrimType::Sphere: {
+                if (!Sphere::HitSphere(spheres.Centre(i), spheres.radius[i], ray, ray_time, isect)) 
+                    return false;
+                isect.material = materials[spheres.material[i]].get();
+                return true;
+            }
+            case PrimType::MovingSphere: {
+                auto centre = moving_spheres.Centre(i, ray.time);
+                if (!Sphere::HitSphere(centre, moving_spheres.radius[i], ray, ray_time, isect)) 
+                    return false;
+                isect.material = materials[moving_spheres.material[i]].get();
+                return true;
+            }
+            case PrimType::Quad: {
+                double t, alpha, beta;
+                if (!Quad::HitPlane(quads.Pin(i), quads.U(i), quads.V(i), quads.W(i), quads.Normal(i),
+                                    quads.constant[i], ray, ray_time, t, alpha, beta))
+                    return false;
+                if (alpha < 0 || alpha > 1 || beta < 0 || beta > 1) 
+                    return false;
+                isect.u = alpha;
+                isect.v = beta;
+                isect.coords = ray(t);
+                isect.time = t;
+                isect.material = materials[quads.material[i]].get();
+                isect.SetOutward(ray, quads.Normal(i));
+                isect.SetFootprint(ray, Sqrt(Length(quads.W(i))));
+                return true;
+            }
+            case PrimType::SphereCluster: return IntersectCluster(clusters[i], ray, ray_time, isect);
+            case PrimType::Triangle: {
+                uint32_t m = MeshOf(i);
+                if (!mesh_views[m].IntersectTriangle(i - mesh_first[m], ray, ray_time, isect)) 
+                    return false;
+                isect.material = materials[mesh_material[m]].get();
+                return true;
+            }
+            case PrimType::Box: {
+                const auto& box = boxes[i];
+                const Vector3 rows[3] = { Vector3(box.rows[0][0], box.rows[0][1], box.rows[0][2]),
+                                          Vector3(box.rows[1][0], box.rows[1][1], box.rows[1][2]),
+                                          Vector3(box.rows[2][0], box.rows[2][1], box.rows[2][2]) };
+                if (!Box::HitBox(Point3(box.lo[0], box.lo[1], box.lo[2]), Point3(box.hi[0], box.hi[1], box.hi[2]), rows,
+                                 Vector3(box.shift[0], box.shift[1], box.shift[2]), ray, ray_time, isect))
+                    return false;
+                isect.material = materials[box.material].get();
+                return true;
+            }
+            default: return shapes[i]->Intersect(ray, ray_time, isect);
+        }
+    }
+    static bool IsSphere(PrimRef ref) { return ref.type == PrimType::Sphere || ref.type == PrimType::MovingSphere; }
+    // Test a leaf's references, narrowing ray_time with every hit. Runs of triangles from one mesh go 
+    // to its lane kernel TRIANGLE_LANES at a time.
+    bool IntersectLeaf(const PrimRef* leaf, uint32_t count, const Ray& ray, Interval& ray_time, Intersection& isect,
+                       const SphereCluster* clusters = nullptr) const {
+        bool happened = false;
+        for (uint32_t i = 0; i < count; ) {
+            if (leaf[i].type != PrimType::Triangle) {
+                if (Intersect(leaf[i], ray, ray_time, isect, clusters)) {
+                    happened = true;
+                    ray_time._max = isect.time;
+                }
+                i += 1;
+                continue;
+            }
+            uint32_t m = MeshOf(leaf[i].index);
+            uint32_t first = mesh_first[m], last = first + mesh_views[m].triangles;
+            uint32_t tris[TRIANGLE_LANES];
+            int n = 0;
+            while (i < count && n < TRIANGLE_LANES && leaf[i].type == PrimType::Triangle && 
+                   leaf[i].index >= first && leaf[i].index < last)
+                tris[n++] = leaf[i++].index - first;
+            if (mesh_views[m].IntersectTriangles(tris, n, ray, ray_time, isect)) {
+                happened = true;
+                ray_time._max = isect.time;
+                isect.material = materials[mesh_material[m]].get();
+            }
+        }
+        return happened;
+    }
+    const Buffer<PrimRef>& Refs() const { return refs; }
+    size_t Size() const { return refs.size(); }
+    // Every fixed-layout array, in a stable order, for serialisation.
+    template <typename Visitor>
+    void VisitBuffers(Visitor&& visit) {
+        visit("sphere.x", spheres.x); visit("sphere.y", spheres.y); visit("sphere.z", spheres.z);
+        visit("sphere.radius", spheres.radius); visit("sphere.material", spheres.material);
+        visit("moving.x", moving_spheres.x);   visit("moving.y", moving_spheres.y);   visit("moving.z", moving_spheres.z);
+        visit("moving.dx", moving_spheres.dx); visit("moving.dy", moving_spheres.dy); visit("moving.dz", moving_spheres.dz);
+        visit("moving.radius", moving_spheres.radius); visit("moving.material", moving_spheres.material);
+        visit("quad.px", quads.px); visit("quad.py", quads.py); visit("quad.pz", quads.pz);
+        visit("quad.ux", quads.ux); visit("quad.uy", quads.uy); visit("quad.uz", quads.uz);
+        visit("quad.vx", quads.vx); visit("quad.vy", quads.vy); visit("quad.vz", quads.vz);
+        visit("quad.wx", quads.wx); visit("quad.wy", quads.wy); visit("quad.wz", quads.wz);
+        visit("quad.nx", quads.nx); visit("quad.ny", quads.ny); visit("quad.nz", quads.nz);
+        visit("quad.constant", quads.constant); visit("quad.material", quads.material);
+        visit("boxes", boxes);
+        visit("refs", refs);
+    }
+
+private:
+    // Members
+    struct SphereArray {
+        Buffer<double> x, y, z, radius;
+        Buffer<uint32_t> material;
+
+        void Push(const Point3& c, double r, uint32_t m) {
+            x.push_back(c.x); y.push_back(c.y); z.push_back(c.z);
+            radius.push_back(r); material.push_back(m);
+        }
+        Point3 Centre(uint32_t i) const { return Point3(x[i], y[i], z[i]); }
+        size_t Size() const { return x.size(); }
+    } spheres;
+    struct MovingSphereArray {
+        Buffer<double> x, y, z, dx, dy, dz, radius;
+        Buffer<uint32_t> material;
+
+        void Push(const Point3& c, const Vector3& d, double r, uint32_t m) {
+            x.push_back(c.x);  y.push_back(c.y);  z.push_back(c.z);
+            dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+            radius.push_back(r); material.push_back(m);
+        }
+        Point3 Centre(uint32_t i, double time) const 
+        { return Point3(x[i] + time*dx[i], y[i] + time*dy[i], z[i] + time*dz[i]); }
+        size_t Size() const { return x.size(); }
+    } moving_spheres;
+    struct QuadArray {
+        Buffer<double> px, py, pz, ux, uy, uz, vx, vy, vz, wx, wy, wz, nx, ny, nz, constant;
+        Buffer<uint32_t> material;
+
+        void Push(const Point3& p, const Vector3& u, const Vector3& v, const Vector3& w, 
+                  const Vector3& n, double d, uint32_t m) {
+            px.push_back(p.x); py.push_back(p.y); pz.push_back(p.z);
+            ux.push_back(u.x); uy.push_back(u.y); uz.push_back(u.z);
+            vx.push_back(v.x); vy.push_back(v.y); vz.push_back(v.z);
+            wx.push_back(w.x); wy.push_back(w.y); wz.push_back(w.z);
+            nx.push_back(n.x); ny.push_back(n.y); nz.push_back(n.z);
+            constant.push_back(d); material.push_back(m);
+        }
+        Point3  Pin(uint32_t i)    const { return Point3(px[i], py[i], pz[i]); }
+        Vector3 U(uint32_t i)      const { return Vector3(ux[i], uy[i], uz[i]); }
+        Vector3 V(uint32_t i)      const { return Vector3(vx[i], vy[i], vz[i]); }
+        Vector3 W(uint32_t i)      const { return Vector3(wx[i], wy[i], wz[i]); }
+        Vector3 Normal(uint32_t i) const { return Vector3(nx[i], ny[i], nz[i]); }
+        size_t Size() const { return px.size(); }
+    } quads;
+    Buffer<OrientedBox> boxes;
+    vector<shared_ptr<TriangleMesh>> meshes;
+    vector<MeshView> mesh_views;
+    vector<uint32_t> mesh_first;        // Global number of each mesh's first triangle
+    vector<uint32_t> mesh_material;
+    vector<shared_ptr<Shapes>> shapes;
+    vector<shared_ptr<Material>> materials;
+    std::unordered_map<const Material*, uint32_t> material_ids;
+    Buffer<PrimRef> refs;
+    shared_ptr<void> backing;           // Keeps viewed memory alive
+
+    friend class SceneCache;
+    friend class OutOfCoreScene;
+    friend class LightBVH;
+    friend class Animation;
+    friend class PrimitiveBVH;
+
+    // Methods
+    void FillLane(SphereCluster& cluster, int k, PrimRef source) const {
+        uint32_t i = source.index;
+        Point3 centre;
+        Vector3 shift;
+        if (source.type == PrimType::Sphere) {
+            centre = spheres.Centre(i);
+            cluster.radius[k] = spheres.radius[i];
+            cluster.material[k] = spheres.material[i];
+        } else {
+            centre = moving_spheres.Centre(i, 0.0);
+            shift = moving_spheres.Centre(i, 1.0) - centre;
+            cluster.radius[k] = moving_spheres.radius[i];
+            cluster.material[k] = moving_spheres.material[i];
+        }
+        cluster.x[k]  = centre.x; cluster.y[k]  = centre.y; cluster.z[k]  = centre.z;
+        cluster.dx[k] = shift.x;  cluster.dy[k] = shift.y;  cluster.dz[k] = shift.z;
+    }
+    uint32_t MeshOf(uint32_t triangle) const {
+        if (mesh_views.size() == 1) return 0;
+        return std::upper_bound(mesh_first.begin(), mesh_first.end(), triangle) - mesh_first.begin() - 1;
+    }
+    // Solve all lanes at once with the squared direction length hoisted, then redo the full hit 
+    // record only for the nearest lane.
+    bool IntersectCluster(const SphereCluster& cluster, const Ray& ray, Interval ray_time, Intersection& isect) const {
+        const double A = Length2(ray.dir);
+        const double A_inv = 1.0 / A;
+        const double t_min = ray_time._min, t_max = ray_time._max;
+        alignas(64) double t_lane[CLUSTER_WIDTH];
+        #pragma omp simd aligned(t_lane:64)
+        for (int k = 0; k < CLUSTER_WIDTH; k += 1) {
+            double oc_x = cluster.x[k] + ray.time * cluster.dx[k] - ray.org.x;
+            double oc_y = cluster.y[k] + ray.time * cluster.dy[k] - ray.org.y;
+            double oc_z = cluster.z[k] + ray.time * cluster.dz[k] - ray.org.z;
+            double Б = ray.dir.x * oc_x + ray.dir.y * oc_y + ray.dir.z * oc_z;
+            double C = oc_x * oc_x + oc_y * oc_y + oc_z * oc_z - cluster.radius[k] * cluster.radius[k];
+            double discrim = Б * Б - A * C;
+            double disc_root = std::sqrt(discrim > 0 ? discrim : 0);
+            double t_near = (Б - disc_root) * A_inv;
+            double t_far  = (Б + disc_root) * A_inv;
+            double t_hit = (t_near > t_min && t_near < t_max) ? t_near : t_far;
+            bool valid = k < cluster.count && discrim >= EPS_DEUX && t_hit > t_min && t_hit < t_max;
+            t_lane[k] = valid ? t_hit : POS_INF;
+        }
+        for (int attempt = 0; attempt < cluster.count; attempt += 1) {
+            int nearest = 0;
+            for (int k = 1; k < CLUSTER_WIDTH; k += 1) 
+                if (t_lane[k] < t_lane[nearest]) nearest = k;
+            if (t_lane[nearest] == POS_INF) return false;
+            auto centre = Point3(cluster.x[nearest]  + ray.time * cluster.dx[nearest],
+                                 cluster.y[nearest]  + ray.time * cluster.dy[nearest],
+                                 cluster.z[nearest]  + ray.time * cluster.dz[nearest]);
+            if (Sphere::HitSphere(centre, cluster.radius[nearest], ray, ray_time, isect)) {
+                isect.material = materials[cluster.material[nearest]].get();
+                return true;
+            }
+            t_lane[nearest] = POS_INF;   // Rounding disagreed with the batched solve, try the next lane
+        }
+        return false;
+    }
+};
+
+
+// Flat, depth-first BVH over the references of a PrimitiveStore. The first child of an interior node 
+// directly follows it, so only the second child's index is stored. Leaves holding several spheres 
+// are packed into SphereClusters, which belong to the tree, so any number of trees can be built and
+// rebuilt over one store. When the store holds moving spheres, each node also keeps how its 
+// box changes over the shutter: nodes store their box at time 0, and rays test the box interpolated
+// at their own time instead of one stretched over the whole sweep.
+class PrimitiveBVH : public Shapes {
+public:
+    // Constructors
+    PrimitiveBVH(shared_ptr<PrimitiveStore> _store, uint32_t _max_leaf=2) 
+     : store(_store), refs(_store->Refs()), max_leaf(Max(_max_leaf, 1u)) {
+        if (refs.empty()) return;
+        vector<Bounds3> ref_bounds(refs.size());
+        vector<Point3>  ref_centroids(refs.size());
+        for (size_t i = 0; i < refs.size(); i += 1) {
+            ref_bounds[i] = store->BBox(refs[i]);
+            ref_centroids[i] = Point3(ref_bounds[i].x.Centroid(), ref_bounds[i].y.Centroid(), ref_bounds[i].z.Centroid());
+        }
+        // Boxes at both ends of the shutter, empty when nothing moves
+        vector<Bounds3> ref_ends;
+        if (store->HasMotion()) {
+            ref_ends.resize(2 * refs.size());
+            for (size_t i = 0; i < refs.size(); i += 1) {
+                ref_ends[2*i]   = store->BBox(refs[i], 0.0);
+                ref_ends[2*i+1] = store->BBox(refs[i], 1.0);
+            }
+        }
+        vector<uint32_t> order(refs.size());
+        for (uint32_t i = 0; i < order.size(); i += 1) order[i] = i;
+        nodes.reserve(2 * refs.size());
+        Build(order, ref_bounds, ref_centroids, ref_ends, 0, order.size());
+
+        vector<PrimRef> ordered(refs.size());
+        for (size_t i = 0; i < order.size(); i += 1) ordered[i] = refs.data()[order[i]];
+        refs.swap(ordered);
+        PackClusters();
+        built_areas = Areas();
+    }
+
+    // Methods
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        if (nodes.empty()) return false;
+        auto inv_dir = Vector3(1.0/ray.dir.x, 1.0/ray.dir.y, 1.0/ray.dir.z);
+        bool dir_neg[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+        bool moving = !motion.empty();
+        uint32_t stack[64];
+        int stack_size = 0;
+        uint32_t current = 0;
+        bool happened = false;
+        while (true) {
+            const PrimNode& node = nodes[current];
+            if (moving ? BoundsAt(current, ray.time).Intersect(ray, inv_dir, ray_time) 
+                       : node.bounds.Intersect(ray, inv_dir, ray_time)) {
+                if (node.count > 0) {
+                    if (store->IntersectLeaf(refs.data() + node.offset, node.count, ray, ray_time, isect, clusters.data()))
+                        happened = true;
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                } else if (dir_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            } else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+        return happened;
+    }
+    // Recompute every box from the primitives where they are now, keeping the tree: leaves in 
+    // parallel, then each interior node from its children, which always come after it.
+    void Refit() {
+        if (nodes.empty()) return;
+        if (built_areas.empty()) built_areas = Areas();
+        nodes.reserve(nodes.size());    // Own the nodes before threads write to them
+        motion.reserve(motion.size());
+        bool moving = !motion.empty();
+        #pragma omp parallel for
+        for (int64_t n = 0; n < int64_t(nodes.size()); n += 1) {
+            const auto& node = nodes[n];
+            if (node.count == 0) continue;
+            Bounds3 first = Bounds3::Empty, last = Bounds3::Empty;
+            for (uint32_t i = node.offset; i < node.offset + node.count; i += 1) {
+                first = Union(first, moving ? store->BBox(refs[i], 0.0, clusters.data()) : store->BBox(refs[i], clusters.data()));
+                if (moving) last = Union(last, store->BBox(refs[i], 1.0, clusters.data()));
+            }
+            SetBounds(n, first, last);
+        }
+        for (int64_t n = int64_t(nodes.size()) - 1; n >= 0; n -= 1) {
+            const auto& node = nodes[n];
+            if (node.count != 0) continue;
+            if (!moving) {
+                SetBounds(n, Union(nodes[n+1].bounds, nodes[node.offset].bounds), Bounds3::Empty);
+                continue;
+            }
+            SetBounds(n, Union(BoundsAt(n+1, 0.0), BoundsAt(node.offset, 0.0)), 
+                         Union(BoundsAt(n+1, 1.0), BoundsAt(node.offset, 1.0)));
+        }
+    }
+    // Mean factor by which the nodes' surface areas have grown since the build. The surface area 
+    // cost of the whole tree would be a truer measure, but one huge primitive such as a ground 
+    // sphere dominates it so much that small objects could drift anywhere without changing it.
+    double Growth() const {
+        if (built_areas.empty()) return 1.0;
+        auto areas = Areas();
+        double growth = 0.0;
+        for (size_t n = 0; n < areas.size(); n += 1) growth += areas[n] / Max(built_areas[n], EPS_QUAT);
+        return growth / areas.size();
+    }
+    // Copy every clustered sphere again after the spheres have been moved, before refitting.
+    void RefreshClusters() {
+        for (size_t c = 0; c < clusters.size(); c += 1)
+            for (int k = 0; k < clusters[c].count; k += 1) 
+                store->FillLane(clusters[c], k, cluster_sources[c * CLUSTER_WIDTH + k]);
+    }
+    // Whether refitting has worn the tree down enough that building it afresh would pay off.
+    bool Degraded() const { return Growth() > REFIT_LIMIT; }
+    Bounds3 BBox() const override { 
+        if (nodes.empty()) return Bounds3::Empty;
+        return motion.empty() ? nodes[0].bounds : Union(BoundsAt(0, 0.0), BoundsAt(0, 1.0));
+    }
+    const PrimitiveStore& Store() const { return *store; }
+    shared_ptr<PrimitiveStore> SharedStore() const { return store; }
+    template <typename Visitor>
+    void VisitBuffers(Visitor&& visit) {
+        visit("bvh.nodes", nodes);
+        visit("bvh.refs", refs);
+        visit("bvh.motion", motion);
+        visit("clusters", clusters);
+        visit("cluster.sources", cluster_sources);
+    }
+
+private:
+    // Members
+    struct PrimNode {
+        Bounds3  bounds;
+        uint32_t offset;    // Leaf: first reference, Interior: second child
+        uint16_t count;     // Number of references, zero for interior nodes
+        uint16_t axis;      // Split axis, used to visit the nearer child first
+    };
+    struct NodeMotion {
+        Vector3 lo, hi;     // Change of the box's lower and upper corners from time 0 to time 1
+    };
+    shared_ptr<PrimitiveStore> store;
+    Buffer<PrimRef> refs;
+    Buffer<PrimNode> nodes;
+    Buffer<NodeMotion> motion;      // One per node, empty when nothing moves
+    Buffer<SphereCluster> clusters;
+    Buffer<PrimRef> cluster_sources;    // The sphere behind each lane, CLUSTER_WIDTH per cluster
+    uint32_t max_leaf;
+    vector<double> built_areas;     // Per node after building, or at the first refit of a loaded tree
+
+    friend class SceneCache;
+    friend class CompressedBVH;
+
+    // Constructors
+    PrimitiveBVH() = default;
+
+    // Methods
+    // Box of node n at a time in [0,1]. Every primitive's box moves linearly from its box at 0 to
+    // its box at 1, so the same blend of the node's end boxes still encloses them all.
+    Bounds3 BoundsAt(uint32_t n, double time) const {
+        const auto& bounds = nodes[n].bounds;
+        const auto& shift = motion[n];
+        Bounds3 box;
+        box.x = Interval(bounds.x._min + time * shift.lo.x, bounds.x._max + time * shift.hi.x);
+        box.y = Interval(bounds.y._min + time * shift.lo.y, bounds.y._max + time * shift.hi.y);
+        box.z = Interval(bounds.z._min + time * shift.lo.z, bounds.z._max + time * shift.hi.z);
+        return box;
+    }
+    // Surface area of every node at mid-shutter.
+    vector<double> Areas() const {
+        vector<double> areas(nodes.size());
+        for (uint32_t n = 0; n < nodes.size(); n += 1) 
+            areas[n] = HalfArea(motion.empty() ? nodes[n].bounds : BoundsAt(n, 0.5));
+        return areas;
+    }
+    // Store a node's boxes at both ends of the shutter; last is ignored when nothing moves.
+    void SetBounds(uint32_t n, const Bounds3& first, const Bounds3& last) {
+        nodes[n].bounds = first;
+        if (motion.empty()) return;
+        motion[n] = NodeMotion{Vector3(last.x._min - first.x._min, last.y._min - first.y._min, last.z._min - first.z._min),
+                               Vector3(last.x._max - first.x._max, last.y._max - first.y._max, last.z._max - first.z._max)};
+    }
+    static double HalfArea(const Bounds3& box) { 
+        return box.x.size * box.y.size + box.y.size * box.z.size + box.z.size * box.x.size; 
+    }
+    uint32_t Build(vector<uint32_t>& order, const vector<Bounds3>& ref_bounds, const vector<Point3>& ref_centroids,
+                   const vector<Bounds3>& ref_ends, uint32_t start, uint32_t end) {
+        uint32_t index = nodes.size();
+        nodes.emplace_back();
+        Bounds3 bounds = Bounds3::Empty;
+        for (uint32_t i = start; i < end; i += 1) 
+            bounds = Union(bounds, ref_bounds[order[i]]);
+        nodes[index].bounds = bounds;
+        if (!ref_ends.empty()) {
+            Bounds3 first = Bounds3::Empty, last = Bounds3::Empty;
+            for (uint32_t i = start; i < end; i += 1) {
+                first = Union(first, ref_ends[2*order[i]]);
+                last  = Union(last,  ref_ends[2*order[i]+1]);
+            }
+            motion.emplace_back();
+            SetBounds(index, first, last);
+        }
+
+        // Spheres that fit one cluster, and triangles of one mesh that fit the lanes of its kernel, are
+        // cheaper tested together than split further
+        uint32_t object_length = end - start;
+        bool cluster_leaf = object_length <= CLUSTER_WIDTH;
+        for (uint32_t i = start; cluster_leaf && i < end; i += 1) 
+            cluster_leaf = PrimitiveStore::IsSphere(refs[order[i]]);
+        bool lane_leaf = object_length <= TRIANGLE_LANES && refs[order[start]].type == PrimType::Triangle;
+        for (uint32_t i = start; lane_leaf && i < end; i += 1) 
+            lane_leaf = refs[order[i]].type == PrimType::Triangle && 
+                        store->MeshOf(refs[order[i]].index) == store->MeshOf(refs[order[start]].index);
+        if (object_length <= max_leaf || cluster_leaf || lane_leaf) {
+            nodes[index].offset = start;
+            nodes[index].count = object_length;
+            nodes[index].axis = 0;
+            return index;
+        }
+        // Halve at the median along whichever axis leaves the halves the least surface area per
+        // primitive. The widest axis alone misleads when one huge primitive, like a ground sphere, 
+        // spans it: the other centres barely differ along it, so their order, or the drift of the 
+        // moving ones, would decide which leaves they share.
+        uint32_t mid = start + object_length/2;
+        auto split = [&](int axis) {
+            std::nth_element(order.begin()+start, order.begin()+mid, order.begin()+end, 
+                             [&](uint32_t o1, uint32_t o2) {
+                return ref_centroids[o1][axis] < ref_centroids[o2][axis];
+            });
+        };
+        int axis = bounds.MaxAxis();
+        double best = POS_INF;
+        for (int candidate = 0; candidate < 3; candidate += 1) {
+            split(candidate);
+            Bounds3 lower = Bounds3::Empty, upper = Bounds3::Empty;
+            for (uint32_t i = start; i < mid; i += 1) lower = Union(lower, ref_bounds[order[i]]);
+            for (uint32_t i = mid; i < end; i += 1)   upper = Union(upper, ref_bounds[order[i]]);
+            double cost = HalfArea(lower) * (mid - start) + HalfArea(upper) * (end - mid);
+            if (cost < best) { best = cost; axis = candidate; }
+        }
+        if (axis != 2) split(axis);
+        Build(order, ref_bounds, ref_centroids, ref_ends, start, mid);
+        uint32_t second = Build(order, ref_bounds, ref_centroids, ref_ends, mid, end);
+        nodes[index].offset = second;
+        nodes[index].count = 0;
+        nodes[index].axis = axis;
+        return index;
+    }
+    void PackClusters() {
+        vector<PrimRef> packed;
+        packed.reserve(refs.size());
+        for (size_t n = 0; n < nodes.size(); n += 1) {
+            auto& node = nodes[n];
+            if (node.count == 0) continue;
+            uint32_t first = packed.size();
+            vector<PrimRef> leaf_spheres;
+            for (uint32_t i = node.offset; i < node.offset + node.count; i += 1) {
+                if (PrimitiveStore::IsSphere(refs[i])) leaf_spheres.push_back(refs[i]);
+                else packed.push_back(refs[i]);
+            }
+            if (leaf_spheres.size() == 1) 
+                packed.push_back(leaf_spheres[0]);
+            for (size_t i = 0; leaf_spheres.size() > 1 && i < leaf_spheres.size(); i += CLUSTER_WIDTH)
+                packed.push_back(AddCluster(&leaf_spheres[i], Min<size_t>(CLUSTER_WIDTH, leaf_spheres.size()-i)));
+            node.offset = first;
+            node.count = packed.size() - first;
+        }
+        refs.swap(packed);
+    }
+    // Gather sphere references into one cluster, returning its reference.
+    PrimRef AddCluster(const PrimRef* sphere_refs, int n) {
+        SphereCluster cluster = {};
+        cluster.count = Min(n, CLUSTER_WIDTH);
+        for (int k = 0; k < CLUSTER_WIDTH; k += 1) {
+            auto source = sphere_refs[Min(k, cluster.count - 1)];
+            if (k < cluster.count) store->FillLane(cluster, k, source);
+            cluster_sources.push_back(source);
+        }
+        clusters.push_back(cluster);
+        return PrimRef{PrimType::SphereCluster, uint32_t(clusters.size()-1)};
+    }
+};
+
+
+#endif // PRIMITIVES_H
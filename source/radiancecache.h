@@ -0,0 +1,106 @@
+#pragma once
+#ifndef RADIANCECACHE_H
+#define RADIANCECACHE_H
+
+#include "global.h"
+#include "mathematics.h"
+#include "colour.h"
+
+// A cell answers lookups once it holds CACHE_MIN_SAMPLES estimates; a key that finds neither itself
+// nor a free slot within CACHE_PROBES slots of its hash is dropped.
+constexpr uint32_t CACHE_MIN_SAMPLES = 16;
+constexpr int      CACHE_PROBES      = 16;
+
+// Hashed grid of the light leaving diffuse surfaces, after Binder et al., "Massively Parallel Path
+// Space Filtering" (2019). A cell is a cube of the scene quantised at cell_size, split by which of the
+// six axis directions the surface faces, so the two sides of a thin wall never share an estimate.
+// Cells store outgoing radiance over albedo, the cosine-weighted irradiance divided by π, so a texture
+// varying inside a cell is still applied at full resolution. Recording is lock-free: cells are claimed
+// with a compare-and-swap on their key and filled with atomic sums.
+class RadianceCache {
+public:
+    // Constructors
+    RadianceCache(double _cell_size, double _max_error, size_t capacity = size_t(1) << 19)
+        : cell_size(_cell_size), max_error(_max_error) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+    }
+
+    // Methods
+    size_t Cells() const { return used.load(); }
+    double CellSize() const { return cell_size; }
+    // Add one estimate for a surface at p facing n. Safe to call from many threads at once.
+    void Record(const Point3& p, const Vector3& n, const Colour& value) {
+        if (!std::isfinite(value.x + value.y + value.z)) return;
+        Cell* cell = Claim(Key(p, n));
+        if (cell == nullptr) return;
+        for (int c = 0; c < 3; c += 1) AtomicAdd(cell->sum[c], value[c]);
+        AtomicAdd(cell->square, Sqr(Luminance(value)));
+        cell->count.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Mean of the cell around p, if it has enough samples and its standard error is within max_error
+    // of that mean. The query is jittered across the surface by up to half a cell, which trades the
+    // blocky edges of the grid for noise that later samples average away.
+    bool Lookup(const Point3& p, const Vector3& n, Colour& value) const {
+        Frame frame(n);
+        auto jitter = frame.ToWorld(Vector3(RandomFloat() - 0.5, RandomFloat() - 0.5, 0.0)) * cell_size;
+        const Cell* cell = Find(Key(p + jitter, n));
+        if (cell == nullptr) return false;
+        uint32_t count = cell->count.load(std::memory_order_relaxed);
+        if (count < CACHE_MIN_SAMPLES) return false;
+        for (int c = 0; c < 3; c += 1) value[c] = cell->sum[c].load(std::memory_order_relaxed) / count;
+        double mean = Luminance(value);
+        double variance = Max(cell->square.load(std::memory_order_relaxed) / count - Sqr(mean), 0.0);
+        return Sqrt(variance / count) <= max_error * mean;
+    }
+
+private:
+    // Members
+    struct Cell {
+        std::atomic<uint64_t> key{0};       // Zero while the slot is free
+        std::atomic<double> sum[3] = {};
+        std::atomic<double> square{0.0};    // Of the luminance, for the error bound
+        std::atomic<uint32_t> count{0};
+    };
+    double cell_size, max_error;
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    std::atomic<size_t> used{0};
+
+    // Methods
+    // 20 bits per axis, wrapping, and the facing direction as 1 to 6 so no key is ever zero.
+    uint64_t Key(const Point3& p, const Vector3& n) const {
+        uint64_t key = 0;
+        for (int axis = 0; axis < 3; axis += 1)
+            key = (key << 20) | (uint64_t(int64_t(std::floor(p[axis] / cell_size))) & 0xFFFFF);
+        int axis = Abs(n.x) >= Abs(n.y) ? (Abs(n.x) >= Abs(n.z) ? 0 : 2) : (Abs(n.y) >= Abs(n.z) ? 1 : 2);
+        return (key << 3) | uint64_t(1 + 2 * axis + (n[axis] < 0));
+    }
+    const Cell* Find(uint64_t key) const {
+        size_t slot = Hash(key) & mask;
+        for (int probe = 0; probe < CACHE_PROBES; probe += 1, slot = (slot + 1) & mask) {
+            uint64_t stored = cells[slot].key.load(std::memory_order_relaxed);
+            if (stored == key) return &cells[slot];
+            if (stored == 0) return nullptr;
+        }
+        return nullptr;
+    }
+    // Find the key's cell, taking the first free slot along its probe sequence if it has none yet.
+    Cell* Claim(uint64_t key) {
+        size_t slot = Hash(key) & mask;
+        for (int probe = 0; probe < CACHE_PROBES; probe += 1, slot = (slot + 1) & mask) {
+            uint64_t stored = cells[slot].key.load(std::memory_order_relaxed);
+            if (stored == 0 && cells[slot].key.compare_exchange_strong(stored, key)) {
+                used.fetch_add(1, std::memory_order_relaxed);
+                return &cells[slot];
+            }
+            if (stored == key) return &cells[slot];
+        }
+        return nullptr;
+    }
+};
+
+
+#endif // RADIANCECACHE_H
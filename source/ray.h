@@ -13,12 +13,15 @@ public:
     Ray(const Point3& o_, const Vector3& d_) : org(o_), dir(d_), time(0.0) {}
 
     // Methods
-    Point3 operator()(float t) const { return org + dir * t; }
+    Point3 operator()(double t) const { return org + dir * t; }
 
     // Members
     Point3 dir;
     Vector3 org;
     double time;
+    // Ray cone for texture filtering: width at the origin and growth per unit of distance
+    double width = 0.0;
+    double spread = 0.0;
 };
 
 // Debugging
@@ -11,14 +11,17 @@ class Scene : public Shapes {
 public:
     // Constructor
     Scene() = default;
-    Scene(shared_ptr<Shapes> object) { objects.push_back(object); }
+    Scene(shared_ptr<Shapes> object) { AddObject(object); }
 
     // Methods
     void AddObject(shared_ptr<Shapes> object) { 
         objects.push_back(object); 
         bounds = Union(bounds, object->BBox());
     }
-    void Clear() { objects.clear(); }
+    void Clear() {
+        objects.clear();
+        bounds = Bounds3();
+    }
     bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
         Intersection temp_isect;
         bool happened = false;
@@ -0,0 +1,482 @@
+#pragma once
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include "global.h"
+#include "primitives.h"
+#include "material.h"
+#include "texture.h"
+#include "mappedfile.h"
+
+// Bump whenever the layout of any serialised array changes.
+constexpr uint32_t SCENE_CACHE_VERSION = 4;
+constexpr size_t   SCENE_CACHE_ALIGN   = 64;
+
+struct CacheHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    uint64_t file_size;
+};
+
+struct CacheSection {
+    char     name[24];
+    uint32_t element_size;
+    uint32_t reserved;
+    uint64_t offset;        // From the start of the image, SCENE_CACHE_ALIGN aligned
+    uint64_t count;
+};
+
+struct MaterialRecord {
+    enum Kind : uint32_t { Lambertian, Metal, Dielectric, Light, Isotropic };
+    uint32_t kind;
+    uint32_t texture;
+    double   albedo[3];
+    double   fuzziness;
+    double   refractive_index;
+};
+
+struct TextureRecord {
+    enum Kind : uint32_t { Solid, Checker, Image };
+    uint32_t kind;
+    uint32_t even, odd;     // Child textures of a checker
+    uint32_t path;          // Offset into the string table
+    double   colour[3];
+    double   scale_inv;
+};
+
+struct MeshRecord {
+    uint64_t index_offset, vertex_offset;
+    uint32_t triangles, vertices;
+    uint32_t material, first;
+    uint32_t has_normals, has_uvs;
+};
+
+// Image made of named, aligned arrays addressed by offset, so it can be used in place from a 
+// mapping or a buffer read from disk.
+class CacheImage {
+public:
+    // Methods
+    template <typename T>
+    void Add(const char* name, const T* data, size_t count) {
+        Section section = {};
+        std::strncpy(section.header.name, name, sizeof(section.header.name) - 1);
+        section.header.element_size = sizeof(T);
+        section.header.count = count;
+        section.bytes.assign(reinterpret_cast<const char*>(data), reinterpret_cast<const char*>(data + count));
+        sections.push_back(std::move(section));
+    }
+    vector<char> Serialize() {
+        auto align = [](uint64_t offset) { return (offset + SCENE_CACHE_ALIGN - 1) / SCENE_CACHE_ALIGN * SCENE_CACHE_ALIGN; };
+        uint64_t offset = align(sizeof(CacheHeader) + sections.size() * sizeof(CacheSection));
+        for (auto& section : sections) {
+            section.header.offset = offset;
+            offset = align(offset + section.bytes.size());
+        }
+        CacheHeader header = {};
+        std::memcpy(header.magic, "RTSCENE", 8);
+        header.version = SCENE_CACHE_VERSION;
+        header.section_count = sections.size();
+        header.file_size = offset;
+
+        vector<char> image(offset, 0);
+        std::memcpy(image.data(), &header, sizeof(header));
+        for (size_t i = 0; i < sections.size(); i += 1) {
+            std::memcpy(image.data() + sizeof(header) + i * sizeof(CacheSection), &sections[i].header, sizeof(CacheSection));
+            std::copy(sections[i].bytes.begin(), sections[i].bytes.end(), image.begin() + sections[i].header.offset);
+        }
+        return image;
+    }
+    bool WriteFile(const std::string& filename) {
+        auto image = Serialize();
+        // Write beside the target and rename, so readers never map a half-written file
+        auto temporary = filename + ".tmp";
+        std::ofstream file(temporary, std::ios::binary);
+        file.write(image.data(), image.size());
+        file.close();
+        if (!file || std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::cerr << "ERROR: Could not write cache file '" << filename << "'.\n";
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+    // Validate an image and index its sections; data must stay valid while they are in use.
+    bool Parse(const char* data, size_t size) {
+        sections.clear();
+        if (size < sizeof(CacheHeader)) return false;
+        CacheHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, "RTSCENE", 8) != 0 || header.version != SCENE_CACHE_VERSION ||
+            header.file_size != size || sizeof(CacheHeader) + header.section_count * sizeof(CacheSection) > size)
+            return false;
+        for (uint32_t i = 0; i < header.section_count; i += 1) {
+            Section section;
+            std::memcpy(&section.header, data + sizeof(CacheHeader) + i * sizeof(CacheSection), sizeof(CacheSection));
+            section.header.name[sizeof(section.header.name) - 1] = '\0';
+            const auto& h = section.header;
+            if (h.offset % SCENE_CACHE_ALIGN != 0 || h.offset > size || h.element_size * h.count > size - h.offset) 
+                return false;
+            section.data = data + h.offset;
+            sections.push_back(std::move(section));
+        }
+        return true;
+    }
+    template <typename T>
+    const T* Find(const char* name, size_t& count) const {
+        for (const auto& section : sections) {
+            if (std::strcmp(section.header.name, name) != 0) continue;
+            if (section.header.element_size != sizeof(T)) return nullptr;
+            count = section.header.count;
+            return reinterpret_cast<const T*>(section.data);
+        }
+        count = 0;
+        return nullptr;
+    }
+    template <typename T>
+    bool View(const char* name, Buffer<T>& buffer) const {
+        size_t count = 0;
+        const T* data = Find<T>(name, count);
+        if (data == nullptr) return false;
+        buffer.View(data, count);
+        return true;
+    }
+
+private:
+    // Members
+    struct Section {
+        CacheSection header;
+        vector<char> bytes;             // Contents while writing
+        const char*  data = nullptr;    // Contents after parsing
+    };
+    vector<Section> sections;
+};
+
+
+// Single-file snapshot of a built PrimitiveBVH: the flattened primitives, the node array, mesh 
+// buffers, materials and texture references. Loading maps the file and points the buffers at it; 
+// only the small material and texture tables are rebuilt.
+class SceneCache {
+public:
+    // Methods
+    // The key identifies the scene the BVH was built from; Load refuses a file saved under another.
+    static bool Save(const std::string& filename, const PrimitiveBVH& bvh, uint64_t key = 0) {
+        CacheImage image;
+        image.Add("scene.key", &key, 1);
+        return Encode(bvh, image) && AddMaterials(bvh.store->materials, image) && image.WriteFile(filename);
+    }
+    static shared_ptr<PrimitiveBVH> Load(const std::string& filename, uint64_t key = 0) {
+        auto mapping = make_shared<MappedFile>();
+        if (!mapping->Open(filename)) return nullptr;
+        CacheImage image;
+        vector<shared_ptr<Material>> materials;
+        if (!image.Parse(mapping->Data(), mapping->Size()) || !ReadMaterials(image, materials)) {
+            std::cerr << "ERROR: Scene cache '" << filename << "' is invalid or outdated.\n";
+            return nullptr;
+        }
+        size_t key_count = 0;
+        auto saved = image.Find<uint64_t>("scene.key", key_count);
+        if (key_count != 1 || *saved != key) {
+            std::clog << "Scene cache '" << filename << "' was saved from another scene and is ignored.\n";
+            return nullptr;
+        }
+        auto bvh = Decode(image, mapping, materials);
+        if (bvh == nullptr) std::cerr << "ERROR: Scene cache '" << filename << "' is incomplete.\n";
+        return bvh;
+    }
+
+    // Geometry and nodes only; materials are referenced by their index in the store.
+    static bool Encode(const PrimitiveBVH& bvh, CacheImage& image) {
+        const auto& store = *bvh.store;
+        if (!store.shapes.empty()) {
+            std::cerr << "ERROR: Scene cache cannot hold shapes outside the primitive store.\n";
+            return false;
+        }
+        WriteMeshes(store, image);
+        auto visit = [&image](const char* name, const auto& buffer) { image.Add(name, buffer.data(), buffer.size()); };
+        const_cast<PrimitiveStore&>(store).VisitBuffers(visit);
+        const_cast<PrimitiveBVH&>(bvh).VisitBuffers(visit);
+        return true;
+    }
+    // Rebuild a BVH that views a parsed image, with the store's material table given by the caller.
+    static shared_ptr<PrimitiveBVH> Decode(const CacheImage& image, shared_ptr<void> backing, 
+                                           const vector<shared_ptr<Material>>& materials) {
+        auto store = make_shared<PrimitiveStore>();
+        store->backing = backing;
+        bool complete = true;
+        auto visit = [&image, &complete](const char* name, auto& buffer) { complete = complete && image.View(name, buffer); };
+        store->VisitBuffers(visit);
+        auto bvh = shared_ptr<PrimitiveBVH>(new PrimitiveBVH());
+        bvh->store = store;
+        bvh->VisitBuffers(visit);
+        if (!complete || !ReadMeshes(image, *store) || !Validate(*bvh, materials.size())) return nullptr;
+        store->materials = materials;
+        return bvh;
+    }
+    static bool AddMaterials(const vector<shared_ptr<Material>>& materials, CacheImage& image) {
+        vector<MaterialRecord> material_records;
+        vector<TextureRecord> texture_records;
+        vector<char> strings;
+        std::unordered_map<const Texture*, uint32_t> texture_ids;
+        bool supported = true;
+        for (const auto& material : materials) {
+            MaterialRecord record = {};
+            switch (material->Type()) {
+                case MaterialType::Lambertian:
+                    record.kind = MaterialRecord::Lambertian;
+                    record.texture = AddTexture(material->Params<Material::LambertianBSDF>().texture, 
+                                                texture_records, strings, texture_ids, supported);
+                    break;
+                case MaterialType::Metal: {
+                    const auto& metal = material->Params<Material::MetalBSDF>();
+                    record.kind = MaterialRecord::Metal;
+                    record.albedo[0] = metal.albedo.x; record.albedo[1] = metal.albedo.y; record.albedo[2] = metal.albedo.z;
+                    record.fuzziness = metal.fuzziness;
+                    break;
+                }
+                case MaterialType::Dielectric:
+                    record.kind = MaterialRecord::Dielectric;
+                    record.refractive_index = material->Params<Material::DielectricBSDF>().refractive_index;
+                    break;
+                case MaterialType::Light:
+                    record.kind = MaterialRecord::Light;
+                    record.texture = AddTexture(material->Params<Material::LightEmitter>().texture, 
+                                                texture_records, strings, texture_ids, supported);
+                    break;
+                case MaterialType::Isotropic:
+                    record.kind = MaterialRecord::Isotropic;
+                    record.texture = AddTexture(material->Params<Material::IsotropicPhase>().texture, 
+                                                texture_records, strings, texture_ids, supported);
+                    break;
+            }
+            material_records.push_back(record);
+        }
+        if (!supported) {
+            std::cerr << "ERROR: Scene cache cannot hold a custom texture.\n";
+            return false;
+        }
+        image.Add("materials", material_records.data(), material_records.size());
+        image.Add("textures", texture_records.data(), texture_records.size());
+        image.Add("strings", strings.data(), strings.size());
+        return true;
+    }
+    static bool ReadMaterials(const CacheImage& image, vector<shared_ptr<Material>>& rebuilt_materials) {
+        size_t material_count = 0, texture_count = 0, string_count = 0;
+        auto materials = image.Find<MaterialRecord>("materials", material_count);
+        auto textures  = image.Find<TextureRecord>("textures", texture_count);
+        auto names     = image.Find<char>("strings", string_count);
+        if (materials == nullptr || textures == nullptr || names == nullptr) return false;
+        vector<shared_ptr<Texture>> rebuilt(texture_count);
+        // Children are always written before their parents
+        for (size_t i = 0; i < texture_count; i += 1) {
+            const auto& record = textures[i];
+            switch (record.kind) {
+                case TextureRecord::Solid: 
+                    rebuilt[i] = make_shared<SolidColour>(record.colour[0], record.colour[1], record.colour[2]); 
+                    break;
+                case TextureRecord::Checker: {
+                    if (record.even >= i || record.odd >= i) return false;
+                    auto checker = make_shared<CheckerTexture>(1.0, rebuilt[record.even], rebuilt[record.odd]);
+                    checker->scale_inv = record.scale_inv;
+                    rebuilt[i] = checker;
+                    break;
+                }
+                case TextureRecord::Image:
+                    if (record.path >= string_count || names[string_count-1] != '\0') return false;
+                    rebuilt[i] = make_shared<ImageTexture>(names + record.path);
+                    break;
+                default: return false;
+            }
+        }
+        for (size_t i = 0; i < material_count; i += 1) {
+            const auto& record = materials[i];
+            bool textured = record.kind == MaterialRecord::Lambertian || record.kind == MaterialRecord::Light 
+                         || record.kind == MaterialRecord::Isotropic;
+            if (textured && record.texture >= texture_count) return false;
+            switch (record.kind) {
+                case MaterialRecord::Lambertian: rebuilt_materials.push_back(make_shared<Lambertian>(rebuilt[record.texture])); break;
+                case MaterialRecord::Light:      rebuilt_materials.push_back(make_shared<Light>(rebuilt[record.texture])); break;
+                case MaterialRecord::Isotropic:  rebuilt_materials.push_back(make_shared<Isotropic>(rebuilt[record.texture])); break;
+                case MaterialRecord::Dielectric: rebuilt_materials.push_back(make_shared<Dielectric>(record.refractive_index)); break;
+                case MaterialRecord::Metal: 
+                    rebuilt_materials.push_back(make_shared<Metal>(Colour(record.albedo[0], record.albedo[1], record.albedo[2]), 
+                                                                   record.fuzziness));
+                    break;
+                default: return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    // Methods
+    static uint32_t AddTexture(const shared_ptr<Texture>& texture, vector<TextureRecord>& records, vector<char>& strings,
+                               std::unordered_map<const Texture*, uint32_t>& ids, bool& supported) {
+        auto found = ids.find(texture.get());
+        if (found != ids.end()) return found->second;
+        TextureRecord record = {};
+        const auto& kind = typeid(*texture);
+        if (kind == typeid(SolidColour)) {
+            auto solid = std::static_pointer_cast<SolidColour>(texture);
+            record.kind = TextureRecord::Solid;
+            record.colour[0] = solid->albedo.x; record.colour[1] = solid->albedo.y; record.colour[2] = solid->albedo.z;
+        } else if (kind == typeid(CheckerTexture)) {
+            auto checker = std::static_pointer_cast<CheckerTexture>(texture);
+            record.kind = TextureRecord::Checker;
+            record.scale_inv = checker->scale_inv;
+            record.even = AddTexture(checker->even_texture, records, strings, ids, supported);
+            record.odd  = AddTexture(checker->odd_texture, records, strings, ids, supported);
+        } else if (kind == typeid(ImageTexture)) {
+            auto image = std::static_pointer_cast<ImageTexture>(texture);
+            record.kind = TextureRecord::Image;
+            record.path = strings.size();
+            strings.insert(strings.end(), image->filename.begin(), image->filename.end());
+            strings.push_back('\0');
+        } else {
+            supported = false;
+        }
+        records.push_back(record);
+        return ids[texture.get()] = records.size() - 1;
+    }
+    static void WriteMeshes(const PrimitiveStore& store, CacheImage& image) {
+        vector<MeshRecord> records;
+        vector<uint32_t> indices;
+        vector<float> positions, normals, uvs;
+        for (size_t m = 0; m < store.mesh_views.size(); m += 1) {
+            const auto& view = store.mesh_views[m];
+            MeshRecord record = {};
+            record.index_offset = indices.size();
+            record.vertex_offset = positions.size() / 3;
+            record.triangles = view.triangles;
+            record.vertices = view.vertices;
+            record.material = store.mesh_material[m];
+            record.first = store.mesh_first[m];
+            record.has_normals = view.normals != nullptr;
+            record.has_uvs = view.uvs != nullptr;
+            records.push_back(record);
+            indices.insert(indices.end(), view.indices, view.indices + 3 * view.triangles);
+            positions.insert(positions.end(), view.positions, view.positions + 3 * view.vertices);
+            // Attribute arrays stay parallel to positions, padded where a mesh lacks them
+            if (view.normals) normals.insert(normals.end(), view.normals, view.normals + 3 * view.vertices);
+            else normals.resize(positions.size(), 0.0f);
+            if (view.uvs) uvs.insert(uvs.end(), view.uvs, view.uvs + 2 * view.vertices);
+            else uvs.resize(positions.size() / 3 * 2, 0.0f);
+        }
+        image.Add("mesh.table", records.data(), records.size());
+        image.Add("mesh.indices", indices.data(), indices.size());
+        image.Add("mesh.positions", positions.data(), positions.size());
+        image.Add("mesh.normals", normals.data(), normals.size());
+        image.Add("mesh.uvs", uvs.data(), uvs.size());
+    }
+    // One pass over every index a viewed image holds, so that a stale or damaged file is refused
+    // instead of being read out of bounds while rendering.
+    static bool Validate(const PrimitiveBVH& bvh, size_t material_count) {
+        const auto& store = *bvh.store;
+        const auto& spheres = store.spheres;
+        const auto& moving = store.moving_spheres;
+        const auto& quads = store.quads;
+        auto same_size = [](size_t size, std::initializer_list<size_t> sizes) {
+            for (size_t other : sizes) if (other != size) return false;
+            return true;
+        };
+        auto known_materials = [material_count](const auto& ids) {
+            for (size_t i = 0; i < ids.size(); i += 1) if (ids[i] >= material_count) return false;
+            return true;
+        };
+        if (!same_size(spheres.Size(), {spheres.y.size(), spheres.z.size(), spheres.radius.size(), spheres.material.size()}) ||
+            !same_size(moving.Size(), {moving.y.size(), moving.z.size(), moving.dx.size(), moving.dy.size(), 
+                                       moving.dz.size(), moving.radius.size(), moving.material.size()}) ||
+            !same_size(quads.Size(), {quads.py.size(), quads.pz.size(), quads.ux.size(), quads.uy.size(), quads.uz.size(),
+                                      quads.vx.size(), quads.vy.size(), quads.vz.size(), quads.wx.size(), quads.wy.size(),
+                                      quads.wz.size(), quads.nx.size(), quads.ny.size(), quads.nz.size(), 
+                                      quads.constant.size(), quads.material.size()}) ||
+            !known_materials(spheres.material) || !known_materials(moving.material) || 
+            !known_materials(quads.material) || !known_materials(store.mesh_material))
+            return false;
+        for (size_t i = 0; i < store.boxes.size(); i += 1) if (store.boxes[i].material >= material_count) return false;
+
+        // Triangles are numbered globally, each mesh's first one following the last of the mesh before
+        uint64_t triangles = 0;
+        for (size_t m = 0; m < store.mesh_views.size(); m += 1) {
+            const auto& view = store.mesh_views[m];
+            if (store.mesh_first[m] != triangles) return false;
+            for (uint64_t k = 0; k < 3 * uint64_t(view.triangles); k += 1) if (view.indices[k] >= view.vertices) return false;
+            triangles += view.triangles;
+        }
+        auto in_range = [&](PrimRef ref) {
+            switch (ref.type) {
+                case PrimType::Sphere:        return ref.index < spheres.Size();
+                case PrimType::MovingSphere:  return ref.index < moving.Size();
+                case PrimType::Quad:          return ref.index < quads.Size();
+                case PrimType::SphereCluster: return ref.index < bvh.clusters.size();
+                case PrimType::Triangle:      return ref.index < triangles;
+                case PrimType::Box:           return ref.index < store.boxes.size();
+                default:                      return false;   // Shapes are never cached
+            }
+        };
+        if (bvh.cluster_sources.size() != CLUSTER_WIDTH * bvh.clusters.size()) return false;
+        for (size_t c = 0; c < bvh.clusters.size(); c += 1) {
+            const auto& cluster = bvh.clusters[c];
+            if (cluster.count < 1 || cluster.count > CLUSTER_WIDTH) return false;
+            for (int k = 0; k < CLUSTER_WIDTH; k += 1) {
+                auto source = bvh.cluster_sources[c * CLUSTER_WIDTH + k];
+                if (!PrimitiveStore::IsSphere(source) || !in_range(source)) return false;
+                if (k < cluster.count && cluster.material[k] >= material_count) return false;
+            }
+        }
+        for (size_t i = 0; i < store.refs.size(); i += 1) 
+            if (store.refs[i].type == PrimType::SphereCluster || !in_range(store.refs[i])) return false;
+        for (size_t i = 0; i < bvh.refs.size(); i += 1) if (!in_range(bvh.refs[i])) return false;
+
+        // Children always follow their parent, so depths can be found in the same forward pass and
+        // kept within the traversal stack
+        const auto& nodes = bvh.nodes;
+        if (!bvh.motion.empty() && bvh.motion.size() != nodes.size()) return false;
+        vector<uint8_t> depth(nodes.size(), 0);
+        for (size_t n = 0; n < nodes.size(); n += 1) {
+            const auto& node = nodes[n];
+            if (node.count > 0) {
+                if (uint64_t(node.offset) + node.count > bvh.refs.size()) return false;
+                continue;
+            }
+            if (node.axis > 2 || node.offset <= n + 1 || node.offset >= nodes.size() || depth[n] + 1 >= 64) return false;
+            depth[n + 1] = Max(depth[n + 1], uint8_t(depth[n] + 1));
+            depth[node.offset] = Max(depth[node.offset], uint8_t(depth[n] + 1));
+        }
+        return true;
+    }
+    static bool ReadMeshes(const CacheImage& image, PrimitiveStore& store) {
+        size_t mesh_count = 0, index_count = 0, position_count = 0, normal_count = 0, uv_count = 0;
+        auto table     = image.Find<MeshRecord>("mesh.table", mesh_count);
+        auto indices   = image.Find<uint32_t>("mesh.indices", index_count);
+        auto positions = image.Find<float>("mesh.positions", position_count);
+        auto normals   = image.Find<float>("mesh.normals", normal_count);
+        auto uvs       = image.Find<float>("mesh.uvs", uv_count);
+        for (size_t m = 0; m < mesh_count; m += 1) {
+            const auto& record = table[m];
+            if (record.index_offset + 3 * uint64_t(record.triangles) > index_count ||
+                3 * (record.vertex_offset + record.vertices) > position_count ||
+                3 * (record.vertex_offset + record.vertices) > normal_count ||
+                2 * (record.vertex_offset + record.vertices) > uv_count)
+                return false;
+            MeshView view;
+            view.indices = indices + record.index_offset;
+            view.positions = positions + 3 * record.vertex_offset;
+            view.normals = record.has_normals ? normals + 3 * record.vertex_offset : nullptr;
+            view.uvs = record.has_uvs ? uvs + 2 * record.vertex_offset : nullptr;
+            view.triangles = record.triangles;
+            view.vertices = record.vertices;
+            store.mesh_views.push_back(view);
+            store.mesh_first.push_back(record.first);
+            store.mesh_material.push_back(record.material);
+        }
+        return true;
+    }
+};
+
+
+#endif // SCENECACHE_H
@@ -2,6 +2,8 @@
 #ifndef SHAPES_H
 #define SHAPES_H
 
+#include <vector>
+
 #include "global.h"
 #include "bounds.h"
 #include "ray.h"
@@ -12,15 +14,23 @@ class Material;
 struct Intersection {
     Point3 coords;
     Vector3 normal;
-    shared_ptr<Material> material;
+    const Material* material = nullptr;    // Owned by the scene, which outlives every hit
     double time;
     double u, v;
+    double footprint = 0.0;  // Width of the ray cone in texture space, zero for the finest detail
     bool outside; // True if ray is outside the object
 
     void SetOutward(const Ray& ray, const Vector3& outward_normal) {
         outside = Dot(ray.dir, outward_normal) < 0;
         normal = outside ? outward_normal : -outward_normal;
     }
+    // Project the ray cone at the hit onto the surface; texture_scale is texture units per unit 
+    // of surface length. Requires time and normal to be set.
+    void SetFootprint(const Ray& ray, double texture_scale) {
+        auto length = Length(ray.dir);
+        auto cosine = Abs(Dot(ray.dir, normal)) / length;
+        footprint = (ray.width + ray.spread * time * length) * texture_scale / Max(cosine, 0.1);
+    }
 };
 
 class Shapes {
@@ -32,6 +42,14 @@ public:
     // Methods
     virtual bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const = 0;
     virtual Bounds3 BBox() const = 0;
+    // Intersect many rays over the same interval together. Shapes that can share work across the rays,
+    // like an OutOfCoreScene paging in treelets, override this; the rest trace them one by one.
+    virtual void IntersectBatch(const std::vector<Ray>& rays, Interval ray_time,
+                                std::vector<Intersection>& isects, std::vector<char>& hits) const {
+        isects.resize(rays.size());
+        hits.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i += 1) hits[i] = Intersect(rays[i], ray_time, isects[i]);
+    }
 };
 
 
@@ -58,7 +76,15 @@ public:
     // Methods
     Bounds3 BBox() const override { return bbox; }
     bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
-        Point3 centre = moving ? GetCentre(ray.time) : centre0;
+        Point3 centre = GetCentre(ray.time);    // Stationary spheres have a zero shift
+        if (!HitSphere(centre, radius, ray, ray_time, isect)) return false;
+        isect.material = material.get();
+        return true;
+    }
+
+    // Shared by the shape and the flattened primitive storage.
+    static bool HitSphere(const Point3& centre, double radius, const Ray& ray, Interval ray_time, 
+                          Intersection& isect) {
         Vector3 vec_oc = centre - ray.org;
         auto A = Length2(ray.dir);
         auto Б = Dot(ray.dir, vec_oc);
@@ -77,8 +103,8 @@ public:
         isect.SetOutward(ray, outward_normal);
         isect.coords = ray(t_hit);
         isect.time = t_hit;
-        isect.material = material;
         CountUV(outward_normal, isect.u, isect.v);
+        isect.SetFootprint(ray, 1.0 / (M_PI * radius));
         
         return true;
     }
@@ -92,6 +118,9 @@ private:
     Bounds3 bbox;
     shared_ptr<Material> material;
 
+    friend class PrimitiveStore;
+    friend class LightBVH;
+
     // Methods
     Point3 GetCentre(double time) const { return centre0 + time * shift; }
     static void CountUV(const Point3& p, double& u, double& v) {
@@ -118,13 +147,14 @@ public:
     Quad(const Point3& _pin, const Vector3& _u, const Vector3& _v, shared_ptr<Material> _material,
          const Transform& _transform) 
          : transform(_transform), 
-           pin(_transform.Apply(Homogeneous(_pin, 1.0))), 
-           vec_u(_transform.Apply(Homogeneous(_u, 0.0))), 
-           vec_v(_transform.Apply(Homogeneous(_v, 0.0))), 
+           pin(_transform.ApplyPoint(_pin)), 
+           vec_u(_transform.ApplyVector(_u)), 
+           vec_v(_transform.ApplyVector(_v)), 
            material(_material) { 
-        // Compute the normal and constant of the plane equation
+        // Compute the normal and constant of the plane equation. The normal goes by the inverse
+        // transpose, so a mirroring transform keeps its front face in front.
         auto n = Cross(vec_u, vec_v);
-        normal = Normalize(n); 
+        normal = Normalize(_transform.ApplyNormal(Cross(_u, _v))); 
         constant = Dot(pin, normal);
         vec_w = n / Dot(n, n);
         CountBBox(); 
@@ -139,22 +169,17 @@ public:
     }
     Bounds3 BBox() const override { return bbox; }
     bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
-        auto denominator = Dot(ray.dir, normal);
-        if (Abs(denominator) < EPS_DEUX) 
-            return false;
-        auto t = (constant - Dot(ray.org, normal)) / denominator;
-        if (!ray_time.Contains(t)) 
+        double t, alpha, beta;
+        if (!HitPlane(pin, vec_u, vec_v, vec_w, normal, constant, ray, ray_time, t, alpha, beta))
             return false;
-        auto isect_to_pin = ray(t) - pin;
-        auto alpha = Dot(vec_w, Cross(isect_to_pin, vec_v));
-        auto beta  = Dot(vec_w, Cross(vec_u, isect_to_pin));
         if (!Interior(alpha, beta, isect))
             return false;
 
         isect.coords = ray(t);
         isect.time = t;
-        isect.material = material;
+        isect.material = material.get();
         isect.SetOutward(ray, normal);
+        isect.SetFootprint(ray, Sqrt(Length(vec_w)));
         return true;
     }
     virtual bool Interior(double _a, double _b, Intersection& isect) const {
@@ -166,6 +191,22 @@ public:
         return true;
     }
 
+    // Ray-plane hit with the planar coordinates of the hit point, shared with the flattened storage.
+    static bool HitPlane(const Point3& pin, const Vector3& vec_u, const Vector3& vec_v, const Vector3& vec_w,
+                         const Vector3& normal, double constant, const Ray& ray, Interval ray_time,
+                         double& t, double& alpha, double& beta) {
+        auto denominator = Dot(ray.dir, normal);
+        if (Abs(denominator) < EPS_DEUX) 
+            return false;
+        t = (constant - Dot(ray.org, normal)) / denominator;
+        if (!ray_time.Contains(t)) 
+            return false;
+        auto isect_to_pin = ray(t) - pin;
+        alpha = Dot(vec_w, Cross(isect_to_pin, vec_v));
+        beta  = Dot(vec_w, Cross(vec_u, isect_to_pin));
+        return true;
+    }
+
 private:
     // Members
     Point3 pin;
@@ -174,6 +215,88 @@ private:
     Bounds3 bbox;
     double constant;
     Transform transform;
+
+    friend class PrimitiveStore;
+};
+
+// Box with faces along the axes of its own frame, placed in the scene by an affine transform. A ray
+// is taken into the box's frame by the stored inverse and clipped against all three slabs at once,
+// so the whole box costs one test instead of one per face.
+class Box : public Shapes {
+public:
+    // Constructors
+    Box(const Point3& a, const Point3& b, shared_ptr<Material> _material, const Transform& transform=Transform())
+     : lo(Min(a.x, b.x), Min(a.y, b.y), Min(a.z, b.z)), hi(Max(a.x, b.x), Max(a.y, b.y), Max(a.z, b.z)),
+       material(_material) {
+        auto inverse = transform.InvMatrix();
+        for (int row = 0; row < 3; row += 1) {
+            rows[row] = Vector3(inverse(row, 0), inverse(row, 1), inverse(row, 2));
+            shift[row] = inverse(row, 3);
+        }
+        bbox = Bounds3::Empty;
+        for (int corner = 0; corner < 8; corner += 1) {
+            auto p = transform.ApplyPoint(Point3(corner & 1 ? hi.x : lo.x, corner & 2 ? hi.y : lo.y, corner & 4 ? hi.z : lo.z));
+            bbox = Union(bbox, Bounds3(p, p));
+        }
+    }
+
+    // Methods
+    Bounds3 BBox() const override { return bbox; }
+    bool Intersect(const Ray& ray, Interval ray_time, Intersection& isect) const override {
+        if (!HitBox(lo, hi, rows, shift, ray, ray_time, isect)) return false;
+        isect.material = material.get();
+        return true;
+    }
+
+    // Slab test in the box's frame, whose point p is (Dot(rows[i], p) + shift[i]) for the scene's
+    // point p. Shared with the flattened primitive storage.
+    static bool HitBox(const Point3& lo, const Point3& hi, const Vector3 rows[3], const Vector3& shift,
+                       const Ray& ray, Interval ray_time, Intersection& isect) {
+        auto org = Point3(Dot(rows[0], ray.org), Dot(rows[1], ray.org), Dot(rows[2], ray.org)) + shift;
+        auto dir = Vector3(Dot(rows[0], ray.dir), Dot(rows[1], ray.dir), Dot(rows[2], ray.dir));
+        double t_near = NEG_INF, t_far = POS_INF;
+        int near_face = 0, far_face = 0;    // The axis, plus 3 for the upper face
+        for (int axis = 0; axis < 3; axis += 1) {
+            double inv = 1.0 / dir[axis];
+            double t0 = (lo[axis] - org[axis]) * inv;
+            double t1 = (hi[axis] - org[axis]) * inv;
+            int face0 = axis, face1 = axis + 3;
+            if (t0 > t1) { Swap(t0, t1); Swap(face0, face1); }
+            if (t0 > t_near) { t_near = t0; near_face = face0; }
+            if (t1 < t_far)  { t_far = t1;  far_face = face1; }
+        }
+        if (t_near > t_far) return false;
+        double t = t_near;
+        int face = near_face;
+        if (!ray_time.Surrounds(t)) {
+            t = t_far;
+            face = far_face;
+            if (!ray_time.Surrounds(t)) return false;
+        }
+        // Faces transform by the inverse transpose, so the normal of face axis is that row of the inverse
+        int axis = face % 3;
+        int u_axis = axis == 0 ? 2 : 0, v_axis = axis == 1 ? 2 : 1;
+        auto local = org + t * dir;
+        isect.coords = ray(t);
+        isect.time = t;
+        isect.u = (local[u_axis] - lo[u_axis]) / (hi[u_axis] - lo[u_axis]);
+        isect.v = (local[v_axis] - lo[v_axis]) / (hi[v_axis] - lo[v_axis]);
+        isect.SetOutward(ray, (face < 3 ? -1.0 : 1.0) * Normalize(rows[axis]));
+        // Area of the face in the scene, by Nanson's formula
+        double area = (hi[u_axis] - lo[u_axis]) * (hi[v_axis] - lo[v_axis]) * Length(rows[axis])
+                    / Abs(Dot(rows[0], Cross(rows[1], rows[2])));
+        isect.SetFootprint(ray, 1.0 / Sqrt(area));
+        return true;
+    }
+
+private:
+    // Members
+    Point3 lo, hi;
+    Vector3 rows[3], shift;     // Inverse transform, scene to box
+    Bounds3 bbox;
+    shared_ptr<Material> material;
+
+    friend class PrimitiveStore;
 };
 
 
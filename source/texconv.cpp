@@ -0,0 +1,36 @@
+// Offline texture converter: decodes images once and writes their tiled mip pyramids as .rttex
+// files beside them, which Image then maps instead of decoding at every startup.
+//
+//   texconv ../textures/earthmap.jpg [more images...]
+
+#include "global.h"
+#include "image.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " image [image...]\n";
+        return 1;
+    }
+    int failures = 0;
+    for (int i = 1; i < argc; i += 1) {
+        std::string source = argv[i];
+        auto converted = Image::ConvertedPath(source);
+        int width = 0, height = 0, origin_bpp = 0;
+        // Decode directly, so an existing converted file is never read back as the source
+        if (!stbi_info(source.c_str(), &width, &height, &origin_bpp) || converted == source) {
+            std::cerr << "ERROR: Could not read image file '" << source << "'.\n";
+            failures += 1;
+            continue;
+        }
+        std::filesystem::remove(converted);
+        Image image;
+        if (!image.Load(source) || !image.Save(converted)) {
+            std::cerr << "ERROR: Could not convert '" << source << "'.\n";
+            failures += 1;
+            continue;
+        }
+        std::clog << source << " -> " << converted << " (" << image.Width() << "x" << image.Height() 
+                  << ", " << image.Levels() << " levels)\n";
+    }
+    return failures == 0 ? 0 : 1;
+}
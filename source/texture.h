@@ -2,9 +2,13 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <algorithm>
+#include <typeinfo>
+
 #include "global.h"
 #include "mathematics.h"
 #include "image.h"
+#include "texturemanager.h"
 #include "colour.h"
 
 class Texture {
@@ -13,7 +17,9 @@ public:
     virtual ~Texture() = default;
 
     // Methods
-    virtual Colour Value(double u, double v, const Point3& p) const = 0;
+    // Footprint is the width of the lookup in texture space, as carried by Intersection.
+    virtual Colour Value(double u, double v, const Point3& p, double footprint) const = 0;
+    Colour Value(double u, double v, const Point3& p) const { return Value(u, v, p, 0.0); }
 };
 
 class SolidColour : public Texture {
@@ -23,11 +29,14 @@ public:
     SolidColour(const Colour& _albedo) : albedo(_albedo) {}
 
     // Methods
-    Colour Value(double u, double v, const Point3& p) const override { return albedo; }
+    Colour Value(double /*u*/, double /*v*/, const Point3& /*p*/, double /*footprint*/) const override { return albedo; }
 
 private:
     // Members
     Colour albedo;
+
+    friend class SceneCache;
+    friend class TextureProgram;
 };
 
 class CheckerTexture : public Texture {
@@ -39,12 +48,12 @@ public:
         : CheckerTexture(_scale, make_shared<SolidColour>(_even_colour), make_shared<SolidColour>(_odd_colour)) {}
 
     // Methods
-    Colour Value(double u, double v, const Point3& p) const override {
+    Colour Value(double u, double v, const Point3& p, double footprint) const override {
         auto x_int = static_cast<int>(p.x * scale_inv);
         auto y_int = static_cast<int>(p.y * scale_inv);
         auto z_int = static_cast<int>(p.z * scale_inv);
         bool is_even = (x_int + y_int + z_int) % 2 == 0;
-        return is_even ? even_texture->Value(u, v, p) : odd_texture->Value(u, v, p);
+        return is_even ? even_texture->Value(u, v, p, footprint) : odd_texture->Value(u, v, p, footprint);
     }
 
 private:
@@ -52,33 +61,130 @@ private:
     double scale_inv;
     shared_ptr<Texture> even_texture;
     shared_ptr<Texture> odd_texture;
+
+    friend class SceneCache;
+    friend class TextureProgram;
 };
 
 class ImageTexture : public Texture {
 public:
     // Constructor
-    ImageTexture(const char* filename) : image(filename) {}
+    ImageTexture(const char* _filename) : filename(_filename), image(TextureManager::Instance().Acquire(_filename)) {}
 
     // Methods
-    Colour Value(double u, double v, const Point3& p) const override {
+    Colour Value(double u, double v, const Point3& /*p*/, double footprint) const override { return Sample(u, v, footprint); }
+    Colour Sample(double u, double v, double footprint) const {
+        image->Wait();
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.Height() <= 0) return Colour(0,1,1);
+        if (image->Height() <= 0) return Colour(0,1,1);
         // Clamp input texture coordinates to [0,1] x [1,0];
         u = Interval(0,1).Clamp(u);
         v = 1.0 - Interval(0,1).Clamp(v);
-        auto i = static_cast<int>(u * (image.Width()  - 1));
-        auto j = static_cast<int>(v * (image.Height() - 1));
-        auto colours = image.PixelData(i, j);
-
-        auto scale_inv = 1.0 / 255.0;
-        return Colour(colours[0] * scale_inv, 
-                      colours[1] * scale_inv, 
-                      colours[2] * scale_inv);
+        return image->Trilinear(u, v, footprint);
+    }
+
+private:
+    // Members
+    std::string filename;
+    shared_ptr<Image> image;
+
+    friend class SceneCache;
+    friend class TextureProgram;
+};
+
+// A texture graph flattened into an instruction array. Evaluation walks it with a switch instead of
+// a chain of virtual calls: a checker jumps to the instruction of the branch it lands in, solid 
+// colours become immediate constants, and checkers whose branches agree fold into one. Kinds it does
+// not know stay behind their virtual interface.
+class TextureProgram {
+public:
+    // Constructors
+    TextureProgram() = default;
+    TextureProgram(shared_ptr<Texture> texture) : root(texture) { 
+        if (texture != nullptr) Compile(texture.get()); 
     }
 
+    // Methods
+    Colour Value(double u, double v, const Point3& p, double footprint) const {
+        uint32_t pc = 0;
+        while (true) {
+            const auto& instr = code[pc];
+            switch (instr.op) {
+                case Op::Constant: return instr.colour;
+                case Op::Checker: {
+                    auto x_int = static_cast<int>(p.x * instr.scale_inv);
+                    auto y_int = static_cast<int>(p.y * instr.scale_inv);
+                    auto z_int = static_cast<int>(p.z * instr.scale_inv);
+                    bool is_even = (x_int + y_int + z_int) % 2 == 0;
+                    pc = is_even ? instr.even : instr.odd;
+                    break;
+                }
+                case Op::Image:   return instr.image->Sample(u, v, footprint);
+                case Op::Generic: return instr.texture->Value(u, v, p, footprint);
+            }
+        }
+    }
+    // Evaluate n shading points at once, as the camera does for each run of hits on one material;
+    // constant programs and bare images skip the per-point walk entirely.
+    void Value(const double* u, const double* v, const Point3* p, const double* footprint,
+               Colour* out, size_t n) const {
+        if (IsConstant()) {
+            std::fill(out, out + n, code[0].colour);
+            return;
+        }
+        if (code[0].op == Op::Image) {
+            for (size_t i = 0; i < n; i += 1) out[i] = code[0].image->Sample(u[i], v[i], footprint[i]);
+            return;
+        }
+        for (size_t i = 0; i < n; i += 1) out[i] = Value(u[i], v[i], p[i], footprint[i]);
+    }
+    bool IsConstant() const { return code.size() == 1 && code[0].op == Op::Constant; }
+    size_t Size() const { return code.size(); }
+
 private:
     // Members
-    Image image;
+    enum class Op : uint8_t { Constant, Checker, Image, Generic };
+    struct Instruction {
+        Op op;
+        uint32_t even = 0, odd = 0;         // Checker: instruction to continue with for each parity
+        double scale_inv = 0.0;
+        Colour colour;
+        const ImageTexture* image = nullptr;
+        const Texture* texture = nullptr;
+    };
+    std::vector<Instruction> code;
+    shared_ptr<Texture> root;               // Keeps the compiled graph alive
+
+    // Methods
+    uint32_t Compile(const Texture* texture) {
+        uint32_t index = code.size();
+        code.emplace_back();
+        const auto& kind = typeid(*texture);
+        if (kind == typeid(SolidColour)) {
+            code[index].op = Op::Constant;
+            code[index].colour = static_cast<const SolidColour*>(texture)->albedo;
+        } else if (kind == typeid(CheckerTexture)) {
+            auto checker = static_cast<const CheckerTexture*>(texture);
+            uint32_t even = Compile(checker->even_texture.get());
+            uint32_t odd  = Compile(checker->odd_texture.get());
+            if (code[even].op == Op::Constant && code[odd].op == Op::Constant && code[even].colour == code[odd].colour) {
+                code[index] = code[even];
+                code.resize(index + 1);
+            } else {
+                code[index].op = Op::Checker;
+                code[index].scale_inv = checker->scale_inv;
+                code[index].even = even;
+                code[index].odd = odd;
+            }
+        } else if (kind == typeid(ImageTexture)) {
+            code[index].op = Op::Image;
+            code[index].image = static_cast<const ImageTexture*>(texture);
+        } else {
+            code[index].op = Op::Generic;
+            code[index].texture = texture;
+        }
+        return index;
+    }
 };
 
 
@@ -0,0 +1,190 @@
+#pragma once
+#ifndef TEXTUREMANAGER_H
+#define TEXTUREMANAGER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "global.h"
+#include "image.h"
+
+// Process-wide owner of every image texture. Files are deduplicated by resolved path and decoded (or
+// mapped, when converted) on a pool of worker threads, so scene construction and BVH builds carry on
+// while images load. All images share one memory budget enforced tile by tile: a lookup that lands on
+// an evicted tile reads a coarser level instead and marks the tile as wanted for the next Trim.
+class TextureManager {
+public:
+    // Destructor
+    ~TextureManager() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    // Methods
+    static TextureManager& Instance() {
+        static TextureManager manager;
+        return manager;
+    }
+    // Image for a file, shared with every earlier request for the same file. It may still be decoding.
+    shared_ptr<Image> Acquire(const std::string& filename) {
+        auto path = Resolve(filename);
+        if (path.empty()) {
+            std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+            return make_shared<Image>();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = images.find(path);
+        if (found != images.end()) return found->second;
+        auto image = make_shared<Image>();
+        image->ready.store(false, std::memory_order_relaxed);
+        image->path = path;
+        pending.push_back(Job{image, std::promise<void>()});
+        image->loaded = pending.back().done.get_future().share();
+        images[path] = image;
+        if (workers.size() < Max(std::thread::hardware_concurrency(), 1u))
+            workers.emplace_back([this] { Work(); });
+        work.notify_one();
+        return image;
+    }
+    void SetBudget(size_t bytes) { budget = bytes; }
+    size_t Budget() const { return budget; }
+    size_t ResidentBytes() const { return resident.load(); }
+    // Block until every queued image is decoded.
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending.empty() && busy == 0; });
+    }
+    // Frame boundary, no lookups may run concurrently. Reload evicted tiles that lookups wanted during
+    // the frame, then evict the least recently used tiles until the budget holds again.
+    void Trim() {
+        Wait();
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t now = Image::epoch.load();
+        for (auto& [path, image] : images) {
+            std::vector<size_t> wanted;
+            for (size_t t = 0; t < image->tiles.size(); t += 1)
+                if (image->tiles[t] == nullptr && image->stamps[t].load(std::memory_order_relaxed) == now) wanted.push_back(t);
+            if (wanted.empty()) continue;
+            image->Reload(wanted);
+            resident += wanted.size() * image->TileFootprint();
+        }
+        if (resident > budget) {
+            struct Candidate { uint32_t stamp; int level; Image* image; size_t tile; };
+            std::vector<Candidate> candidates;
+            for (auto& [path, image] : images) {
+                if (!image->Mapped()) continue;
+                for (int l = 0; l < image->Levels(); l += 1) {
+                    if (image->Pinned(l)) continue;
+                    const auto& level = image->levels[l];
+                    for (size_t t = level.first_tile; t < level.first_tile + size_t(level.tiles_x) * level.tiles_y; t += 1)
+                        if (image->tiles[t] != nullptr)
+                            candidates.push_back(Candidate{image->stamps[t].load(std::memory_order_relaxed), l, image.get(), t});
+                }
+            }
+            // Oldest first, and the finest level first among tiles used equally recently
+            std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+                return a.stamp != b.stamp ? a.stamp < b.stamp : a.level < b.level;
+            });
+            for (size_t i = 0; i < candidates.size() && resident > budget; i += 1) {
+                candidates[i].image->Evict(candidates[i].tile);
+                resident -= candidates[i].image->TileFootprint();
+            }
+        }
+        Image::epoch += 1;
+    }
+
+private:
+    // Members
+    struct Job {
+        shared_ptr<Image> image;
+        std::promise<void> done;
+    };
+    std::mutex mutex;
+    std::condition_variable work, idle;
+    std::deque<Job> pending;
+    std::vector<std::thread> workers;
+    std::unordered_map<std::string, shared_ptr<Image>> images;    // By resolved path
+    std::atomic<size_t> resident{0};
+    std::atomic<size_t> budget{std::numeric_limits<size_t>::max()};
+    int  busy = 0;
+    bool stopping = false;
+
+    // Constructors
+    TextureManager() = default;
+
+    // Methods
+    // Search the same locations as Image, keyed by canonical path so aliases share one entry.
+    static std::string Resolve(const std::string& filename) {
+        namespace fs = std::filesystem;
+        std::vector<std::string> candidates;
+        if (auto imagedir = getenv("TEXTURE_IMAGES")) candidates.push_back(std::string(imagedir) + "/" + filename);
+        candidates.push_back(filename);
+        candidates.push_back("images/" + filename);
+        candidates.push_back("../images/" + filename);
+        std::error_code error;
+        for (const auto& candidate : candidates)
+            if (fs::is_regular_file(candidate, error)) return fs::weakly_canonical(candidate, error).string();
+        return std::string();
+    }
+    static std::string SpillPath(const std::string& path) {
+        std::error_code error;
+        auto directory = std::filesystem::temp_directory_path(error);
+        auto name = "rt-" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::string>()(path)) + ".rttex";
+        return (directory / name).string();
+    }
+    void Work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (stopping) return;
+            auto job = std::move(pending.front());
+            pending.pop_front();
+            busy += 1;
+            lock.unlock();
+
+            auto& image = *job.image;
+            if (!image.Load(image.path))
+                std::cerr << "ERROR: Could not decode image file '" << image.path << "'.\n";
+            FitBudget(image);
+            image.ready.store(true, std::memory_order_release);
+            job.done.set_value();
+
+            lock.lock();
+            busy -= 1;
+            if (pending.empty() && busy == 0) idle.notify_all();
+        }
+    }
+    // Charge a freshly decoded image to the budget, coarsest levels first; whatever does not fit is
+    // dropped before any lookup can see the image. Only mapped tiles can be restored without decoding
+    // the whole source again, so an image decoded from its source that does not fit is first spilled
+    // to a converted file of its own, and keeps every tile if that fails.
+    void FitBudget(Image& image) {
+        size_t total = image.tiles.size() * image.TileFootprint();
+        if (!image.Mapped() && resident.load() + total > budget && !image.Spill(SpillPath(image.path))) {
+            std::cerr << "ERROR: Could not spill image file '" << image.path << "', keeping it resident.\n";
+            resident += total;
+            return;
+        }
+        size_t footprint = image.TileFootprint();
+        for (int l = image.Levels() - 1; l >= 0; l -= 1) {
+            const auto& level = image.levels[l];
+            for (size_t t = level.first_tile; t < level.first_tile + size_t(level.tiles_x) * level.tiles_y; t += 1) {
+                if (resident.fetch_add(footprint) + footprint <= budget || image.Pinned(l)) continue;
+                resident -= footprint;
+                image.Evict(t);
+            }
+        }
+    }
+};
+
+
+#endif // TEXTUREMANAGER_H
@@ -5,32 +5,139 @@
 #include "global.h"
 #include "vector.h"
 
+// Vertices transformed per thread before a batch is split across threads.
+constexpr size_t TRANSFORM_GRAIN = 1 << 16;
+
+// Affine transform kept as the top three rows of its 4×4 matrix, together with the same rows of its
+// inverse; the bottom row is always (0, 0, 0, 1), so points need no division. Inverses are known in
+// closed form as transforms are made: translations negate, scales divide, rotations transpose and
+// products multiply the inverses in reverse order. Only a matrix given from outside is inverted, by
+// the adjugate of its 3×3 part.
 class Transform {
 public:
     // Constructors
-    Transform() : matrix(Eigen::Matrix4d::Identity()), matrix_inv(Eigen::Matrix4d::Identity()) {}
-    Transform(const Eigen::Matrix4d& _matrix) : matrix(_matrix), matrix_inv(_matrix.inverse()) {}
-    Transform(const Eigen::Matrix4d& _matrix, const Eigen::Matrix4d& _matrix_inv) 
-     : matrix(_matrix), matrix_inv(_matrix_inv) {}
+    Transform() {
+        for (int row = 0; row < 3; row += 1)
+            for (int col = 0; col < 4; col += 1) matrix[row][col] = matrix_inv[row][col] = (row == col);
+    }
+    Transform(const Eigen::Matrix4d& _matrix) {
+        for (int row = 0; row < 3; row += 1)
+            for (int col = 0; col < 4; col += 1) matrix[row][col] = _matrix(row, col);
+        Invert(matrix, matrix_inv);
+    }
+    Transform(const Eigen::Matrix4d& _matrix, const Eigen::Matrix4d& _matrix_inv) {
+        for (int row = 0; row < 3; row += 1)
+            for (int col = 0; col < 4; col += 1) {
+                matrix[row][col] = _matrix(row, col);
+                matrix_inv[row][col] = _matrix_inv(row, col);
+            }
+    }
 
     // Methods
+    // Homogeneous form, dividing by w for anything but directions.
     Vector3 Apply(const Eigen::Vector4d vec) const {
-        auto multiplied_vec = matrix * vec;
-        if (vec.w() == 0) 
-            return Vector3(multiplied_vec.x(), 
-                           multiplied_vec.y(), 
-                           multiplied_vec.z());
-        auto w_inv = 1.0 / vec.w();
-        return Vector3(multiplied_vec.x() * w_inv, 
-                       multiplied_vec.y() * w_inv, 
-                       multiplied_vec.z() * w_inv);
+        auto v = Vector3(vec.x(), vec.y(), vec.z());
+        auto applied = ApplyVector(v) + Vector3(matrix[0][3], matrix[1][3], matrix[2][3]) * vec.w();
+        return vec.w() == 0 ? applied : applied / vec.w();
+    }
+    Point3 ApplyPoint(const Point3& p) const {
+        return Point3(matrix[0][0] * p.x + matrix[0][1] * p.y + matrix[0][2] * p.z + matrix[0][3],
+                      matrix[1][0] * p.x + matrix[1][1] * p.y + matrix[1][2] * p.z + matrix[1][3],
+                      matrix[2][0] * p.x + matrix[2][1] * p.y + matrix[2][2] * p.z + matrix[2][3]);
+    }
+    Vector3 ApplyVector(const Vector3& v) const {
+        return Vector3(matrix[0][0] * v.x + matrix[0][1] * v.y + matrix[0][2] * v.z,
+                       matrix[1][0] * v.x + matrix[1][1] * v.y + matrix[1][2] * v.z,
+                       matrix[2][0] * v.x + matrix[2][1] * v.y + matrix[2][2] * v.z);
+    }
+    // Normals go by the inverse transpose so they stay perpendicular to transformed surfaces; the
+    // result is not normalised.
+    Vector3 ApplyNormal(const Vector3& n) const {
+        return Vector3(matrix_inv[0][0] * n.x + matrix_inv[1][0] * n.y + matrix_inv[2][0] * n.z,
+                       matrix_inv[0][1] * n.x + matrix_inv[1][1] * n.y + matrix_inv[2][1] * n.z,
+                       matrix_inv[0][2] * n.x + matrix_inv[1][2] * n.y + matrix_inv[2][2] * n.z);
+    }
+    // Transform count xyz triples in place, e.g. the vertex buffers of a mesh.
+    template <typename T>
+    void ApplyPoints(T* xyz, size_t count) const { Batch(matrix, 1.0, xyz, count); }
+    template <typename T>
+    void ApplyVectors(T* xyz, size_t count) const { Batch(matrix, 0.0, xyz, count); }
+    template <typename T>
+    void ApplyNormals(T* xyz, size_t count) const {
+        double transposed[3][4];
+        for (int row = 0; row < 3; row += 1) {
+            for (int col = 0; col < 3; col += 1) transposed[row][col] = matrix_inv[col][row];
+            transposed[row][3] = 0.0;
+        }
+        Batch(transposed, 0.0, xyz, count);
+    }
+    Transform Inverse() const {
+        Transform inverse;
+        std::copy(&matrix_inv[0][0], &matrix_inv[0][0] + 12, &inverse.matrix[0][0]);
+        std::copy(&matrix[0][0], &matrix[0][0] + 12, &inverse.matrix_inv[0][0]);
+        return inverse;
     }
-    Eigen::Matrix4d Matrix() const { return matrix; }
-    Eigen::Matrix4d InvMatrix() const { return matrix_inv; }
+    bool IsIdentity() const {
+        for (int row = 0; row < 3; row += 1)
+            for (int col = 0; col < 4; col += 1)
+                if (matrix[row][col] != (row == col)) return false;
+        return true;
+    }
+    Eigen::Matrix4d Matrix() const { return Expand(matrix); }
+    Eigen::Matrix4d InvMatrix() const { return Expand(matrix_inv); }
+
+    friend Transform operator*(const Transform& t1, const Transform& t2);
 
 private:
     // Members
-    Eigen::Matrix4d matrix, matrix_inv;
+    double matrix[3][4], matrix_inv[3][4];
+
+    // Methods
+    // a·b for the affine matrices a and b.
+    static void Multiply(const double a[3][4], const double b[3][4], double product[3][4]) {
+        for (int row = 0; row < 3; row += 1) {
+            for (int col = 0; col < 4; col += 1)
+                product[row][col] = a[row][0] * b[0][col] + a[row][1] * b[1][col] + a[row][2] * b[2][col];
+            product[row][3] += a[row][3];
+        }
+    }
+    static void Invert(const double m[3][4], double inverse[3][4]) {
+        // Adjugate over determinant for the linear part, then undo the translation
+        double det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                   - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                   + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        if (det == 0) std::cerr << "ERROR: Transform is singular and has no inverse.\n";
+        double det_inv = 1.0 / det;
+        for (int row = 0; row < 3; row += 1)
+            for (int col = 0; col < 3; col += 1) {
+                int r0 = (col + 1) % 3, r1 = (col + 2) % 3, c0 = (row + 1) % 3, c1 = (row + 2) % 3;
+                inverse[row][col] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) * det_inv;
+            }
+        for (int row = 0; row < 3; row += 1)
+            inverse[row][3] = -(inverse[row][0] * m[0][3] + inverse[row][1] * m[1][3] + inverse[row][2] * m[2][3]);
+    }
+    static Eigen::Matrix4d Expand(const double m[3][4]) {
+        Eigen::Matrix4d expanded;
+        expanded << m[0][0], m[0][1], m[0][2], m[0][3],
+                    m[1][0], m[1][1], m[1][2], m[1][3],
+                    m[2][0], m[2][1], m[2][2], m[2][3],
+                    0, 0, 0, 1;
+        return expanded;
+    }
+    // The matrix entries are copied out first so the compiler keeps them in registers across lanes.
+    template <typename T>
+    static void Batch(const double m[3][4], double w, T* xyz, size_t count) {
+        const double m00 = m[0][0], m01 = m[0][1], m02 = m[0][2], m03 = m[0][3] * w;
+        const double m10 = m[1][0], m11 = m[1][1], m12 = m[1][2], m13 = m[1][3] * w;
+        const double m20 = m[2][0], m21 = m[2][1], m22 = m[2][2], m23 = m[2][3] * w;
+        #pragma omp parallel for simd if(count > TRANSFORM_GRAIN) schedule(static)
+        for (int64_t i = 0; i < int64_t(count); i += 1) {
+            double x = xyz[3*i], y = xyz[3*i+1], z = xyz[3*i+2];
+            xyz[3*i]   = T(m00 * x + m01 * y + m02 * z + m03);
+            xyz[3*i+1] = T(m10 * x + m11 * y + m12 * z + m13);
+            xyz[3*i+2] = T(m20 * x + m21 * y + m22 * z + m23);
+        }
+    }
 };
 
 // Inline Functions
@@ -69,9 +176,11 @@ inline Transform RotateY(double thata) {
     return Transform(matrix, matrix.transpose());
 }
 inline Transform operator*(const Transform& t1, const Transform& t2) {
-    return Transform(t1.Matrix() * t2.Matrix(), 
-                     t2.InvMatrix() * t1.InvMatrix());
+    Transform product;
+    Transform::Multiply(t1.matrix, t2.matrix, product.matrix);
+    Transform::Multiply(t2.matrix_inv, t1.matrix_inv, product.matrix_inv);
+    return product;
 }
 
 
-#endif // TRANSFORMATION_H
\ No newline at end of file
+#endif // TRANSFORMATION_H
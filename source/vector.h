@@ -52,10 +52,11 @@ inline Vector3 RandomVec3(double min, double max) {
                    RandomFloat(min, max), 
                    RandomFloat(min, max));
 }
-inline Vector3 RandomVec3Unit() {
-    auto θ = M_PI   * RandomFloat();
+inline Vector3 RandomVec3Unit() { // Uniform over the sphere: z is uniform by Archimedes' hat-box theorem
+    auto z = 1 - 2*RandomFloat();
+    auto r = Sqrt(Max(0.0, 1 - Sqr(z)));
     auto φ = 2*M_PI * RandomFloat();
-    return Vector3(Sin(φ)*Cos(θ), Sin(φ)*Sin(θ), Cos(φ));
+    return Vector3(r*Cos(φ), r*Sin(φ), z);
 }
 inline Vector3 RandomVec3Disk() {
     auto u = Vector3(RandomFloat(-1,1), RandomFloat(-1,1), 0);
@@ -75,6 +76,10 @@ inline Vector3 Cross(const Vector3 v1, const Vector3 v2) {
                    v1.z*v2.x - v1.x*v2.z, 
                    v1.x*v2.y - v1.y*v2.x); 
 }
+inline Vector3 RandomVec3Cosine() { // Cosine-weighted over the +z hemisphere, pdf = z / π
+    auto d = RandomVec3Disk();
+    return Vector3(d.x, d.y, Sqrt(Max(0.0, 1 - Sqr(d.x) - Sqr(d.y))));
+}
 inline Vector3 Reflect(const Vector3& wi, const Vector3& n) // v outward n
 { return 2 * Dot(wi,n) * n - wi; }
 inline bool    Refract(const Vector3& wi, Vector3& wt, const Vector3& n, double eta) { 
@@ -90,6 +95,27 @@ inline bool    Refract(const Vector3& wi, Vector3& wt, const Vector3& n, double
 inline Eigen::Vector4d Homogeneous(const Vector3& v, double w=1) 
 { return Eigen::Vector4d(v.x, v.y, v.z, w); }
 
+// Orthonormal basis around a unit normal, which becomes the local +z axis. Built without branches or
+// trigonometry following Duff et al., "Building an Orthonormal Basis, Revisited" (2017).
+class Frame {
+public:
+    // Constructor
+    Frame(const Vector3& _n) : n(_n) {
+        double sign = std::copysign(1.0, n.z);
+        double a = -1.0 / (sign + n.z);
+        double b = n.x * n.y * a;
+        s = Vector3(1.0 + sign * Sqr(n.x) * a, sign * b, -sign * n.x);
+        t = Vector3(b, sign + Sqr(n.y) * a, -n.y);
+    }
+
+    // Methods
+    Vector3 ToLocal(const Vector3& v) const { return Vector3(Dot(v, s), Dot(v, t), Dot(v, n)); }
+    Vector3 ToWorld(const Vector3& v) const { return v.x * s + v.y * t + v.z * n; }
+
+    // Members
+    Vector3 s, t, n;
+};
+
 // Debugging
 inline std::string Str(const Vector3 v) 
 { return "(" + Str(v.x) + ", " + Str(v.y) + ", " + Str(v.z) + ")"; }